@@ -1,6 +1,9 @@
 
 #ifndef _AD5522_H_
 #define _AD5522_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <lua.h>
 //  version macros for compile-time API detection
 
@@ -16,6 +19,18 @@
 
 #define AD5522_NUM_CHANNELS 4
 
+/* settling time after a configuration write */
+#define AD5522_SETTLE_US 15000
+
+/* Calibration entries per channel: force/measure voltage per supply rail,
+ * force/measure current per range */
+#define AD5522_CAL_RAILS 4
+#define AD5522_CAL_RANGES 5
+#define AD5522_CAL_FORCE_V   0
+#define AD5522_CAL_FORCE_I   1
+#define AD5522_CAL_MEASURE_V 2
+#define AD5522_CAL_MEASURE_I 3
+
 /* We restrict the available PMU source/measure modes to the most commen cases */
 #define PMU_MODE_FVMI 0
 #define PMU_MODE_FIMV 1
@@ -55,6 +70,7 @@
 #define PMU1               0x02
 #define PMU2               0x04
 #define PMU3               0x08
+#define AD5522_ALL_CHANNELS (PMU0 | PMU1 | PMU2 | PMU3)
 #define RD_NOTWR           0x40
 #define DAC_RD_NOTWR       RD_NOTWR << 6 
 
@@ -148,8 +164,47 @@ typedef struct _ad5522_t ad5522_t;
 
 ad5522_t * ad5522_create(const char *ad5522_path);
 void ad5522_destroy(ad5522_t **self_p);
+/*
+ * Command queue: between ad5522_begin and ad5522_commit register and DAC
+ * writes are collected and sent as a single SPI message. Batches nest, the
+ * outermost commit sends the queue. It returns -1 if any transfer of the
+ * batch failed, the shadow registers are then read back from the device.
+ */
+void ad5522_begin(ad5522_t *self);
+int ad5522_flush(ad5522_t *self);
+int ad5522_commit(ad5522_t *self);
+/*
+ * Shadow registers: the control, PMU and DAC (M, C and X1) registers are
+ * kept in memory and only written to the device, the comparator and alarm
+ * status is always read from it. ad5522_sync reloads the shadow from the device, e.g. after a
+ * reset. ad5522_verify does the same and returns the number of registers
+ * that differed, negative on SPI errors.
+ */
+int ad5522_sync(ad5522_t *self);
+int ad5522_verify(ad5522_t *self);
+/*
+ * Calibration: a Q16.16 gain and an offset per channel and range or supply
+ * rail, code' = code * gain + offset. Force entries correct the FIN DAC
+ * code, in software or, with ad5522_set_calibration_mode(self, true), by
+ * the M and C DACs (gains up to 1 only). Measure entries correct ADC codes
+ * with ad5522_calibrate_codes. ad5522_set_calibration_rail selects the
+ * force voltage entries of the supply rail.
+ */
+int ad5522_load_calibration(ad5522_t *self, const void *data, size_t len);
+/* Returns -1 if the entries don't fit the M and C DACs, software
+ * calibration is active then */
+int ad5522_set_calibration_mode(ad5522_t *self, bool hw);
+void ad5522_set_calibration_rail(ad5522_t *self, unsigned int rail);
+void ad5522_calibrate_codes(ad5522_t *self, unsigned int ch, unsigned int kind,
+        unsigned int index, int *codes, size_t n);
+/* An entry applied to a code in software, rounded */
+int64_t ad5522_cal_code(int32_t gain, int32_t offset, int code);
+/* M and C DAC codes that apply an entry in hardware, -1 if it doesn't fit */
+int ad5522_cal_dac_codes(int32_t gain, int32_t offset, unsigned int *m, unsigned int *c);
 void ad5522_set_force_mode(ad5522_t *self, unsigned int ch, unsigned int mode);
+void ad5522_get_force_mode(ad5522_t *self, unsigned int ch, unsigned int *mode);
 void ad5522_set_measure_mode(ad5522_t *self, unsigned int ch, unsigned int mode);
+void ad5522_get_measure_mode(ad5522_t *self, unsigned int ch, unsigned int *mode);
 void ad5522_set_range(ad5522_t *self, unsigned int ch, unsigned int range);
 void ad5522_get_range(ad5522_t *self, unsigned int ch, unsigned int *range);
 void ad5522_set_offset(ad5522_t *self, unsigned int level);
@@ -158,6 +213,22 @@ void ad5522_set_current(ad5522_t *self, unsigned int ch, int level);
 void ad5522_set_compliance(ad5522_t *self, unsigned int ch, int level);
 void ad5522_set_output_state(ad5522_t *self, unsigned int ch, unsigned int state);
 void ad5522_set_all_output_state(ad5522_t *self, unsigned int state);
+/*
+ * Group operations on the channels of mask, bit n is channel n. Channels
+ * that end up with the same register value or DAC code are addressed by a
+ * single write, all writes go out in one SPI message.
+ * ad5522_set_output_mask sets force mode and output state with one PMU
+ * register write, channels with the same configuration switch at the same
+ * instant.
+ */
+void ad5522_set_force_mode_mask(ad5522_t *self, unsigned int mask, unsigned int mode);
+void ad5522_set_measure_mode_mask(ad5522_t *self, unsigned int mask, unsigned int mode);
+void ad5522_set_range_mask(ad5522_t *self, unsigned int mask, unsigned int range);
+void ad5522_set_voltage_mask(ad5522_t *self, unsigned int mask, int level);
+void ad5522_set_current_mask(ad5522_t *self, unsigned int mask, int level);
+void ad5522_set_output_state_mask(ad5522_t *self, unsigned int mask, unsigned int state);
+void ad5522_set_output_mask(ad5522_t *self, unsigned int mask, unsigned int mode,
+        unsigned int state);
 void ad5522_read_pmu_reg(ad5522_t *self, unsigned int ch, unsigned int *val);
 void ad5522_read_sysctrl_reg(ad5522_t *self, unsigned int *val);
 void ad5522_read_alarm_reg(ad5522_t *self, unsigned int *val);
@@ -166,6 +237,12 @@ void ad5522_read_fin_dac_x1(ad5522_t *self, unsigned int ch, unsigned int range,
 void ad5522_set_gain(ad5522_t *self, int gain);
 void ad5522_get_gain(ad5522_t *self, int *gain);
 void ad5522_configure(ad5522_t *self, unsigned int *sysval, unsigned int *pmuval);
+/*
+ * The two steps of ad5522_configure without the settling time, the caller
+ * waits AD5522_SETTLE_US after each
+ */
+void ad5522_configure_sys(ad5522_t *self, unsigned int *sysval);
+void ad5522_configure_pmu(ad5522_t *self, unsigned int *pmuval);
 void ad5522_get_alarm_flag(ad5522_t *self, int *flag);
 void ad5522_clear_alarm_flag(ad5522_t *self);
 int luaopen_ad5522(lua_State *L);
@@ -8,6 +8,7 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -34,7 +35,70 @@
 #define AD5522_FIN_DAC(range)   (((range) | 8) & 0xf)
 
 #define VREF_MICROVOLT 5000000
+
+/* Number of SPI transfers the command queue holds before it is flushed */
+#define AD5522_QUEUE_SIZE 32
+
+/* DAC registers are addressed by MODE (M = 1, C = 2, X1 = 3) and address */
+#define AD5522_DAC_MODES 3
+#define AD5522_DAC_ADDRS 0x30
+
+/* Bits of a PMU register that are kept, CLEAR and the reserved bits are not */
+#define AD5522_PMU_MASK 0x3fff80
+
+/*
+ * Calibration data: a 12 byte header ("PMUC", version, entry count, FNV-1a
+ * hash of the entries) and per channel the entries force voltage per rail,
+ * force current per range, measure voltage per rail and measure current per
+ * range. Every entry is a Q16.16 gain and an offset in LSB, little endian.
+ */
+#define AD5522_CAL_MAGIC "PMUC"
+#define AD5522_CAL_VERSION 1
+#define AD5522_CAL_HEADER_SIZE 12
+#define AD5522_CAL_ENTRY_SIZE 8
+#define AD5522_CAL_PER_CHANNEL (2 * AD5522_CAL_RAILS + 2 * AD5522_CAL_RANGES)
+#define AD5522_CAL_ENTRIES (AD5522_NUM_CHANNELS * AD5522_CAL_PER_CHANNEL)
+
+/* Identity gain in Q16.16 */
+#define AD5522_CAL_UNITY 65536
+
+/* First entry and number of entries of each kind in a channel */
+static const unsigned int ad5522_cal_base[] = {
+    0,
+    AD5522_CAL_RAILS,
+    AD5522_CAL_RAILS + AD5522_CAL_RANGES,
+    2 * AD5522_CAL_RAILS + AD5522_CAL_RANGES,
+};
+static const unsigned int ad5522_cal_size[] = {
+    AD5522_CAL_RAILS, AD5522_CAL_RANGES, AD5522_CAL_RAILS, AD5522_CAL_RANGES,
+};
+
+/* Addresses of the per channel DACs: FIN, clamps and comparators */
+static const unsigned int ad5522_dac_addrs[] = {
+    DAC_FIN_I_5_MICROAMP, DAC_FIN_I_20_MICROAMP, DAC_FIN_I_200_MICROAMP,
+    DAC_FIN_I_2000_MICROAMP, DAC_FIN_I_EXT, DAC_FIN_V,
+    DAC_CLL_I, DAC_CLL_V, DAC_CLH_I, DAC_CLH_V,
+    DAC_CPL_I_5_MICROAMP, DAC_CPL_I_20_MICROAMP, DAC_CPL_I_200_MICROAMP,
+    DAC_CPL_I_2000_MICROAMP, DAC_CPL_I_EXT, DAC_CPL_V,
+    DAC_CPH_I_5_MICROAMP, DAC_CPH_I_20_MICROAMP, DAC_CPH_I_200_MICROAMP,
+    DAC_CPH_I_2000_MICROAMP, DAC_CPH_I_EXT, DAC_CPH_V,
+};
+
 typedef struct _spidev_t spidev_t;
+typedef struct _ad5522_channel_t ad5522_channel_t;
+
+typedef struct {
+    int32_t gain; /* Q16.16 */
+    int32_t offset; /* LSB */
+} ad5522_cal_t;
+
+struct _ad5522_channel_t {
+    /* Shadow registers */
+    uint32_t pmu; /* PMU register */
+    /* M, C and X1 of every DAC, indexed by MODE - 1 and DAC address */
+    uint16_t dac[AD5522_DAC_MODES][AD5522_DAC_ADDRS];
+    ad5522_cal_t cal[AD5522_CAL_PER_CHANNEL];
+};
 
 /*
  * TODO: factor out spi specific data, so that a bus handle can be created
@@ -42,6 +106,30 @@ typedef struct _spidev_t spidev_t;
  */
 struct _ad5522_t {
     spidev_t *ad5522_dev; /* PMU device specific settings */
+    /* Command queue, sent as a single SPI_IOC_MESSAGE(n) on flush */
+    struct spi_ioc_transfer xfer[AD5522_QUEUE_SIZE];
+    char txbuf[AD5522_QUEUE_SIZE][4];
+    char rdbuf[3]; /* readback clocked out after a read request */
+    char rxbuf[3];
+    unsigned int queued;
+    int batch; /* nesting depth of ad5522_begin/ad5522_commit */
+    bool failed; /* a transfer of the current batch failed */
+    /*
+     * Shadow registers, every write goes through them. Once synced they are
+     * authoritative and reads of SYSCTRL, the PMU registers and the M, C
+     * and X1 registers of all DACs never reach the device. COMP and ALARM
+     * report status, they hold the value last read and are always read
+     * from the device.
+     */
+    bool synced;
+    uint32_t ctrl;  /* system control register */
+    uint32_t comp;  /* comparator status register */
+    uint32_t alarm; /* alarm status register */
+    uint16_t dacx;  /* global offset DAC X1 */
+    ad5522_channel_t channel[AD5522_NUM_CHANNELS];
+    /* Force calibration is done by the M and C DACs instead of in software */
+    bool cal_hw;
+    unsigned int cal_rail; /* supply rail selecting the force voltage entry */
 };
 
 struct _spidev_t {
@@ -124,28 +212,196 @@ void spidev_destroy(spidev_t **self_p)
     }
 }
 
-static int ad5522_spi_write(int fd, const void *buf, size_t buf_len)
+/*
+ * Send all queued transfers as one SPI message. SYNC (chip select) is
+ * released after every 32 bit word, as the AD5522 latches a word on the
+ * rising edge of SYNC, and stays released after the last one.
+ */
+static int ad5522_spi_flush(ad5522_t *self)
+{
+    int ret;
+
+    if (self->queued == 0)
+        return 0;
+    self->xfer[self->queued - 1].cs_change = 0;
+    ret = ioctl(self->ad5522_dev->fd, SPI_IOC_MESSAGE(self->queued), self->xfer);
+    self->queued = 0;
+    if (ret < 0) {
+        /* the device no longer matches the shadow registers */
+        self->synced = false;
+        self->failed = true;
+    }
+    return ret;
+}
+
+static struct spi_ioc_transfer *ad5522_spi_queue(ad5522_t *self, unsigned int slots)
+{
+    struct spi_ioc_transfer *tr;
+
+    if (self->queued + slots > AD5522_QUEUE_SIZE)
+        ad5522_spi_flush(self);
+    tr = &self->xfer[self->queued];
+    memset(tr, 0, slots * sizeof(struct spi_ioc_transfer));
+    return tr;
+}
+
+/*
+ * Queue a 32 bit word, delay_us is the time to wait after the word was
+ * sent. Outside of a batch the word is sent right away.
+ */
+static int ad5522_spi_write(ad5522_t *self, const char *buf, unsigned int delay_us)
 {
-    struct spi_ioc_transfer tr = { .tx_buf = (unsigned long)buf, .len = buf_len, };
-    return ioctl(fd, SPI_IOC_MESSAGE(1), &tr);
+    struct spi_ioc_transfer *tr = ad5522_spi_queue(self, 1);
+
+    memcpy(self->txbuf[self->queued], buf, 4);
+    tr->tx_buf = (unsigned long)self->txbuf[self->queued];
+    tr->len = 4;
+    tr->delay_usecs = delay_us;
+    tr->cs_change = 1;
+    self->queued++;
+    if (self->batch == 0)
+        return ad5522_spi_flush(self);
+    return 0;
 }
 
-static int ad5522_spi_write_then_read(int fd, 
-        const void *txbuf, size_t txbuf_len, 
-        void *rxbuf, size_t rxbuf_len)
+/*
+ * A read request is followed by 24 clocks with SYNC low that shift out the
+ * register. Both go out in the same message as the queued writes.
+ */
+static int ad5522_spi_write_then_read(ad5522_t *self, const char *txbuf, char *rxbuf)
 {
+    struct spi_ioc_transfer *tr = ad5522_spi_queue(self, 2);
     int ret;
-    char buf[3] = {0xff, 0xff, 0xff};
 
-    struct spi_ioc_transfer tr = { .tx_buf = (unsigned long)txbuf, .len = txbuf_len, };
-    ret = ioctl(fd, SPI_IOC_MESSAGE(1), &tr);
-    if (ret < 0) {
-        return ret;
+    memcpy(self->txbuf[self->queued], txbuf, 4);
+    tr[0].tx_buf = (unsigned long)self->txbuf[self->queued];
+    tr[0].len = 4;
+    tr[0].cs_change = 1;
+    memset(self->rdbuf, 0xff, sizeof(self->rdbuf));
+    tr[1].tx_buf = (unsigned long)self->rdbuf;
+    tr[1].rx_buf = (unsigned long)self->rxbuf;
+    tr[1].len = sizeof(self->rxbuf);
+    self->queued += 2;
+    ret = ad5522_spi_flush(self);
+    memcpy(rxbuf, self->rxbuf, sizeof(self->rxbuf));
+    return ret;
+}
+
+int64_t ad5522_cal_code(int32_t gain, int32_t offset, int code)
+{
+    return (((int64_t)code * gain + (1 << 15)) >> 16) + offset;
+}
+
+/*
+ * The DAC output is X1 * (M + 1) / 2^16 + C - 2^15, so M is the Q16.16
+ * gain less one and C the offset around mid scale. Gains above 1 don't fit.
+ */
+int ad5522_cal_dac_codes(int32_t gain, int32_t offset, unsigned int *m, unsigned int *c)
+{
+    int64_t mval = (int64_t)gain - 1, cval = 0x8000 + (int64_t)offset;
+
+    if ((mval < 0) || (mval > 0xffff) || (cval < 0) || (cval > 0xffff))
+        return -1;
+    *m = mval;
+    *c = cval;
+    return 0;
+}
+
+static int64_t ad5522_cal_apply(const ad5522_cal_t *cal, int code)
+{
+    return ad5522_cal_code(cal->gain, cal->offset, code);
+}
+
+static const ad5522_cal_t *ad5522_cal_entry(ad5522_t *self, unsigned int ch,
+        unsigned int kind, unsigned int index)
+{
+    if ((ch >= AD5522_NUM_CHANNELS) || (kind > AD5522_CAL_MEASURE_I)
+            || (index >= ad5522_cal_size[kind]))
+        return NULL;
+    return &self->channel[ch].cal[ad5522_cal_base[kind] + index];
+}
+
+/* Force code corrected in software, unless the M and C DACs do it */
+static unsigned int ad5522_cal_force(ad5522_t *self, unsigned int ch,
+        unsigned int kind, unsigned int index, unsigned int code)
+{
+    const ad5522_cal_t *cal = ad5522_cal_entry(self, ch, kind, index);
+    int64_t val;
+
+    if (self->cal_hw || (cal == NULL))
+        return code;
+    val = ad5522_cal_apply(cal, code);
+    return val < 0? 0: val > 0xffff? 0xffff: (unsigned int)val;
+}
+
+static bool ad5522_dac_addr_valid(unsigned int addr)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(ad5522_dac_addrs); i++)
+        if (ad5522_dac_addrs[i] == addr)
+            return true;
+    return false;
+}
+
+/*
+ * Shadow of a DAC register. The offset DAC only has an X1 register. A write
+ * addressing several channels returns the shadow of the lowest one,
+ * ad5522_shadow_dac_store updates all of them.
+ */
+static uint16_t *ad5522_shadow_dac(ad5522_t *self, unsigned int reg)
+{
+    unsigned int pmu = (reg >> 8) & 0xf;
+    unsigned int mode = (reg >> 6) & 3;
+    unsigned int addr = reg & 0x3f;
+    int ch;
+
+    if (mode == 0)
+        return NULL;
+    if (addr == DAC_OFFSET_X)
+        return mode == 3? &self->dacx: NULL;
+    if (!ad5522_dac_addr_valid(addr))
+        return NULL;
+    for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++)
+        if (pmu & (1 << ch))
+            return &self->channel[ch].dac[mode - 1][addr];
+    return NULL;
+}
+
+static void ad5522_shadow_dac_store(ad5522_t *self, unsigned int reg, unsigned int val)
+{
+    unsigned int pmu = (reg >> 8) & 0xf;
+    int ch;
+    uint16_t *shadow = ad5522_shadow_dac(self, reg);
+
+    if (shadow == NULL)
+        return;
+    if (shadow == &self->dacx) {
+        *shadow = val;
+        return;
+    }
+    for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++)
+        if (pmu & (1 << ch))
+            self->channel[ch].dac[((reg >> 6) & 3) - 1][reg & 0x3f] = val;
+}
+
+/* Shadow of a system or PMU register, a PMU write may address several channels */
+static uint32_t *ad5522_shadow_reg(ad5522_t *self, unsigned int reg)
+{
+    int ch;
+
+    switch (reg) {
+        case AD5522_REG_SYSCTRL:
+            return &self->ctrl;
+        case AD5522_REG_COMP:
+            return &self->comp;
+        case AD5522_REG_ALARM:
+            return &self->alarm;
     }
-    tr.tx_buf = (unsigned long)buf;
-    tr.rx_buf = (unsigned long)rxbuf;
-    tr.len = rxbuf_len;
-    return ioctl(fd, SPI_IOC_MESSAGE(1), &tr);
+    for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++)
+        if (reg & AD5522_REG_PMU(1 << ch))
+            return &self->channel[ch].pmu;
+    return NULL;
 }
 
 static void ad5522_format_10_22_write(void *buf,
@@ -189,7 +445,7 @@ static unsigned int ad5522_parse_16(const void *buf)
 	return ret;
 }
 
-static void ad5522_write_dac_reg(int fd, unsigned int reg, unsigned int val)
+static void ad5522_write_dac_reg(ad5522_t *self, unsigned int reg, unsigned int val)
 {
     /* 
      * The input shift register is 29 bits wide. It accepts 32 bits as long as
@@ -204,14 +460,15 @@ static void ad5522_write_dac_reg(int fd, unsigned int reg, unsigned int val)
     int ret;
 
     ad5522_format_16_16_write(work_buf, reg, val);
-    ret = ad5522_spi_write(fd, work_buf, 4);
+    ret = ad5522_spi_write(self, work_buf, 0);
     if (ret < 0) {
         perror("SPI write error\n");
         return;
     }
+    ad5522_shadow_dac_store(self, reg, val);
 }
 
-static int ad5522_read_dac_reg(int fd, unsigned int reg, unsigned int *val)
+static int ad5522_read_dac_reg(ad5522_t *self, unsigned int reg, unsigned int *val)
 {
 
     /* 
@@ -221,9 +478,8 @@ static int ad5522_read_dac_reg(int fd, unsigned int reg, unsigned int *val)
      */
     char txbuf[4], rxbuf[3];
     int ret;
-
     ad5522_format_16_16_write(txbuf, DAC_RD_NOTWR | reg, 0);
-    ret = ad5522_spi_write_then_read(fd, txbuf, ARRAY_SIZE(txbuf), rxbuf, ARRAY_SIZE(rxbuf));
+    ret = ad5522_spi_write_then_read(self, txbuf, rxbuf);
     if (ret < 0) {
         perror("SPI write error\n");
         return ret;
@@ -233,7 +489,8 @@ static int ad5522_read_dac_reg(int fd, unsigned int reg, unsigned int *val)
     return ret;
 }
 
-static void ad5522_write_sys_reg(int fd, unsigned int reg, unsigned int val)
+static void ad5522_write_sys_reg_delayed(ad5522_t *self, unsigned int reg,
+        unsigned int val, unsigned int delay_us)
 {
 
     /* 
@@ -244,17 +501,28 @@ static void ad5522_write_sys_reg(int fd, unsigned int reg, unsigned int val)
      * B23...B22 select the mode, B21...B0 are register specific bits.
      */
     char work_buf[4];
-    int ret;
+    int ret, ch;
 
     ad5522_format_10_22_write(work_buf, reg, val);
-    ret = ad5522_spi_write(fd, work_buf, 4);
+    ret = ad5522_spi_write(self, work_buf, delay_us);
     if (ret < 0) {
         perror("SPI write error\n");
         return;
     }
+    if (reg == AD5522_REG_SYSCTRL)
+        self->ctrl = val & 0x3fffff;
+    else if (reg > AD5522_REG_ALARM)
+        for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++)
+            if (reg & AD5522_REG_PMU(1 << ch))
+                self->channel[ch].pmu = val & AD5522_PMU_MASK;
+}
+
+static void ad5522_write_sys_reg(ad5522_t *self, unsigned int reg, unsigned int val)
+{
+    ad5522_write_sys_reg_delayed(self, reg, val, 0);
 }
 
-static int ad5522_read_sys_reg(int fd, unsigned int reg, unsigned int *val)
+static int ad5522_read_sys_reg(ad5522_t *self, unsigned int reg, unsigned int *val)
 {
 
     /* 
@@ -264,43 +532,212 @@ static int ad5522_read_sys_reg(int fd, unsigned int reg, unsigned int *val)
      */
     char txbuf[4], rxbuf[3];
     int ret;
-
     ad5522_format_10_22_write(txbuf, RD_NOTWR | reg, 0);
-    ret = ad5522_spi_write_then_read(fd, txbuf, ARRAY_SIZE(txbuf), rxbuf, ARRAY_SIZE(rxbuf));
+    ret = ad5522_spi_write_then_read(self, txbuf, rxbuf);
     if (ret < 0) {
         perror("SPI write error\n");
         return ret;
     }
     *val = ad5522_parse_22(rxbuf);
+    if (reg == AD5522_REG_COMP || reg == AD5522_REG_ALARM)
+        *ad5522_shadow_reg(self, reg) = *val;
 
     return ret;
 }
 
+/*
+ * Register value from the shadow, status registers and anything read before
+ * the shadow was synced come from the device
+ */
+static int ad5522_get_sys_reg(ad5522_t *self, unsigned int reg, unsigned int *val)
+{
+    uint32_t *shadow = ad5522_shadow_reg(self, reg);
+
+    if (self->synced && shadow != NULL
+            && reg != AD5522_REG_COMP && reg != AD5522_REG_ALARM) {
+        *val = *shadow;
+        return 0;
+    }
+    return ad5522_read_sys_reg(self, reg, val);
+}
+
+static int ad5522_get_dac_reg(ad5522_t *self, unsigned int reg, unsigned int *val)
+{
+    uint16_t *shadow = ad5522_shadow_dac(self, reg);
+
+    if (self->synced && shadow != NULL) {
+        *val = *shadow;
+        return 0;
+    }
+    return ad5522_read_dac_reg(self, reg, val);
+}
+
+/*
+ * Set and clear bits of the PMU registers of the channels in mask, only the
+ * writes go to the device. Channels whose registers end up equal share a
+ * single write, so they change at the same instant.
+ */
+static void ad5522_update_pmu_mask(ad5522_t *self, unsigned int mask,
+        unsigned int set, unsigned int clr)
+{
+    unsigned int val[AD5522_NUM_CHANNELS], ch, other, group;
+
+    mask &= AD5522_ALL_CHANNELS;
+    for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++) {
+        if (!(mask & (1 << ch)))
+            continue;
+        if (ad5522_get_sys_reg(self, AD5522_REG_PMU(1 << ch), &val[ch]) < 0) {
+            mask &= ~(1 << ch);
+            continue;
+        }
+        val[ch] &= AD5522_PMU_MASK;
+        val[ch] &= ~clr;
+        val[ch] |= set;
+    }
+    ad5522_begin(self);
+    for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++) {
+        if (!(mask & (1 << ch)))
+            continue;
+        group = 0;
+        for (other = ch; other < AD5522_NUM_CHANNELS; other++)
+            if ((mask & (1 << other)) && (val[other] == val[ch]))
+                group |= 1 << other;
+        ad5522_write_sys_reg(self, AD5522_REG_PMU(group), val[ch]);
+        mask &= ~group;
+    }
+    ad5522_commit(self);
+}
+
+static void ad5522_update_pmu(ad5522_t *self, unsigned int ch,
+        unsigned int set, unsigned int clr)
+{
+    ad5522_update_pmu_mask(self, 1 << ch, set, clr);
+}
+
+/*
+ * Read every shadowed register from the device. With compare set the
+ * return value is the number of registers that differed from the shadow,
+ * the device wins in any case.
+ */
+static int ad5522_readback(ad5522_t *self, bool compare)
+{
+    unsigned int val, mode, i;
+    int ch, ret, mismatches = 0;
+
+    if ((ret = ad5522_read_sys_reg(self, AD5522_REG_SYSCTRL, &val)) < 0)
+        return ret;
+    val &= 0x3fffff;
+    if (compare && val != self->ctrl)
+        mismatches++;
+    self->ctrl = val;
+    if ((ret = ad5522_read_sys_reg(self, AD5522_REG_COMP, &self->comp)) < 0)
+        return ret;
+    if ((ret = ad5522_read_sys_reg(self, AD5522_REG_ALARM, &self->alarm)) < 0)
+        return ret;
+    if ((ret = ad5522_read_dac_reg(self, AD5522_REG_X1(PMU0 | PMU1 | PMU2 | PMU3,
+                        DAC_OFFSET_X), &val)) < 0)
+        return ret;
+    if (compare && val != self->dacx)
+        mismatches++;
+    self->dacx = val;
+    for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++) {
+        ad5522_channel_t *channel = &self->channel[ch];
+
+        if ((ret = ad5522_read_sys_reg(self, AD5522_REG_PMU(1 << ch), &val)) < 0)
+            return ret;
+        val &= AD5522_PMU_MASK;
+        if (compare && val != channel->pmu)
+            mismatches++;
+        channel->pmu = val;
+        for (mode = 1; mode <= AD5522_DAC_MODES; mode++)
+            for (i = 0; i < ARRAY_SIZE(ad5522_dac_addrs); i++) {
+                uint16_t *shadow = &channel->dac[mode - 1][ad5522_dac_addrs[i]];
+
+                ret = ad5522_read_dac_reg(self, ((1 << ch) << 8) | (mode << 6)
+                        | ad5522_dac_addrs[i], &val);
+                if (ret < 0)
+                    return ret;
+                if (compare && val != *shadow)
+                    mismatches++;
+                *shadow = val;
+            }
+    }
+    self->synced = true;
+    return mismatches;
+}
+
 ad5522_t * ad5522_create(const char *ad5522_path)
 {
     ad5522_t *self = (ad5522_t *) calloc(1, (sizeof (ad5522_t)));
+    int ch, i;
 
     if (!self)
         return NULL;
+    /* uncalibrated until ad5522_load_calibration */
+    for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++)
+        for (i = 0; i < AD5522_CAL_PER_CHANNEL; i++)
+            self->channel[ch].cal[i].gain = AD5522_CAL_UNITY;
     self->ad5522_dev = spidev_create(ad5522_path, SPI_MODE_1, 8, 400000);
 
-    if (self->ad5522_dev < 0) {
+    if (self->ad5522_dev == NULL) {
         perror("can't create ad5522 spi device");
         free(self);
         return NULL;
     }
+    /* start from the state the device is in */
+    if (ad5522_sync(self) < 0)
+        perror("can't read back ad5522 registers");
     return self;
 }
 
-void ad5522_configure(ad5522_t *self, unsigned int *sysval, unsigned int *pmuval)
+int ad5522_sync(ad5522_t *self)
+{
+    int ret = ad5522_readback(self, false);
+
+    /* a reset sets the M and C DACs back to their defaults */
+    if (self->cal_hw)
+        ad5522_set_calibration_mode(self, true);
+    return ret;
+}
+
+int ad5522_verify(ad5522_t *self)
+{
+    return ad5522_readback(self, true);
+}
+
+void ad5522_begin(ad5522_t *self)
+{
+    if (self->batch++ == 0)
+        self->failed = false;
+}
+
+int ad5522_flush(ad5522_t *self)
+{
+    return ad5522_spi_flush(self);
+}
+
+int ad5522_commit(ad5522_t *self)
+{
+    if (self->batch == 0)
+        return 0;
+    if (--self->batch > 0)
+        return 0;
+    /* a queue that filled up was flushed within the batch already */
+    if ((ad5522_spi_flush(self) < 0) || self->failed)
+        return -1;
+    return 0;
+}
+
+static void ad5522_configure_sys_delayed(ad5522_t *self, unsigned int *sysval,
+        unsigned int delay_us)
 {
     uint32_t val, rdval;
-    const struct timespec wr_delay = {.tv_sec = 0, .tv_nsec = 15000000};
+
     if (sysval != NULL)
-        ad5522_write_sys_reg(self->ad5522_dev->fd, AD5522_REG_SYSCTRL, *sysval);
+        ad5522_write_sys_reg_delayed(self, AD5522_REG_SYSCTRL, *sysval, delay_us);
     else {
         /* set initial system configuration */
-        ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_SYSCTRL, &rdval);
+        ad5522_get_sys_reg(self, AD5522_REG_SYSCTRL, &rdval);
         /* limit word to 22 bits */
         rdval &= 0x3ffffc;
         val = rdval
@@ -310,26 +747,50 @@ void ad5522_configure(ad5522_t *self, unsigned int *sysval, unsigned int *pmuval
             | SYS_CTRL_MEASOUT_GAIN_200_MILLI 
             | SYS_CTRL_I_GAIN_10 
             | SYS_CTRL_TMP_100; 
-        nanosleep(&wr_delay, NULL);
-        ad5522_write_sys_reg(self->ad5522_dev->fd, AD5522_REG_SYSCTRL, val);
+        ad5522_write_sys_reg_delayed(self, AD5522_REG_SYSCTRL, val, delay_us);
     }
+}
+
+static void ad5522_configure_pmu_delayed(ad5522_t *self, unsigned int *pmuval,
+        unsigned int delay_us)
+{
+    uint32_t val, rdval;
+
     /* set pmu channel specific defaults */
-    nanosleep(&wr_delay, NULL);
     if (pmuval != NULL)
-        ad5522_write_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(PMU0 | PMU1 | PMU2 | PMU3), *pmuval);
+        ad5522_write_sys_reg_delayed(self, AD5522_REG_PMU(PMU0 | PMU1 | PMU2 | PMU3),
+                *pmuval, delay_us);
     else {
-        ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(PMU0), &rdval);
+        ad5522_get_sys_reg(self, AD5522_REG_PMU(PMU0), &rdval);
         /* limit word to 22 bits, mask out lower 7 bits */
         rdval &= 0x3fff80;
         val = rdval | PMU_HIZ_I | PMU_I_2000_MICROAMP | PMU_MEAS_HIZ; 
-        nanosleep(&wr_delay, NULL);
         /* initialize all pmu registers */
-        ad5522_write_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(PMU0 | PMU1 | PMU2 | PMU3), val);
+        ad5522_write_sys_reg_delayed(self, AD5522_REG_PMU(PMU0 | PMU1 | PMU2 | PMU3),
+                val, delay_us);
         /* CAUTION: client needs to ensure that supply voltage/bias voltage is set appropriately */
         /* set the offset DAC to the most positive output range */
     }
 }
 
+void ad5522_configure(ad5522_t *self, unsigned int *sysval, unsigned int *pmuval)
+{
+    ad5522_begin(self);
+    ad5522_configure_sys_delayed(self, sysval, AD5522_SETTLE_US);
+    ad5522_configure_pmu_delayed(self, pmuval, AD5522_SETTLE_US);
+    ad5522_commit(self);
+}
+
+void ad5522_configure_sys(ad5522_t *self, unsigned int *sysval)
+{
+    ad5522_configure_sys_delayed(self, sysval, 0);
+}
+
+void ad5522_configure_pmu(ad5522_t *self, unsigned int *pmuval)
+{
+    ad5522_configure_pmu_delayed(self, pmuval, 0);
+}
+
 /*
  * Destructor
  */
@@ -348,70 +809,60 @@ void ad5522_destroy(ad5522_t **self_p)
 /*
  * Sets the mode to either replicate a current source (force current, measure voltage - FIMV)
  * or voltage source (force voltage, measure current).
- * Follows a read-modify-write policy.
+ * The PMU register is modified in the shadow, only the write reaches the device.
  */
 void ad5522_set_measure_mode(ad5522_t *self, unsigned int ch, unsigned int mode)
 {
-    int pmu;
-    uint32_t val, rdval = 0;
-
-    if ((ch > 4) || (ch < 0)) {
+    if (ch >= AD5522_NUM_CHANNELS) {
         /* not a valid channel number */
         return;
     }
-    /* convert channel number to respective bit in PMU register */
-    pmu = 1 << ch;
+    if (mode > 3) {
+        perror("unknown measure mode.");
+        return;
+    }
+    /* Modify only measure mode bits, keep all others */
+    ad5522_update_pmu(self, ch, mode << 13, PMU_MEASURE_MODE_BITMASK);
+}
 
-    /* Read current register state */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(pmu), &rdval);
-    val = rdval;
-    /* Clear force mode bits */
-    val &= ~PMU_MEASURE_MODE_BITMASK; 
-    /* limit word to 22 bits, mask out lower 7 bits */
-    val &= 0x3fff80;
-    /* Modify only force mode and measure mode bits, keep all others */
-    if ((mode < 0) || (mode > 3)) {
+void ad5522_set_measure_mode_mask(ad5522_t *self, unsigned int mask, unsigned int mode)
+{
+    if (mode > 3) {
         perror("unknown measure mode.");
         return;
     }
-    val |= (mode << 13);
-    ad5522_write_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(pmu), val);
+    ad5522_update_pmu_mask(self, mask, mode << 13, PMU_MEASURE_MODE_BITMASK);
 }
 
 void ad5522_set_force_mode(ad5522_t *self, unsigned int ch, unsigned int mode)
 {
-    int pmu;
-    uint32_t val, rdval = 0;
-
-    if ((ch > 4) || (ch < 0)) {
+    if (ch >= AD5522_NUM_CHANNELS) {
         /* not a valid channel number */
         return;
     }
-    /* convert channel number to respective bit in PMU register */
-    pmu = 1 << ch;
+    if (mode > 3) {
+        perror("unknown force mode.");
+        return;
+    }
+    /* Modify only force mode bits, keep all others */
+    ad5522_update_pmu(self, ch, mode << 19, PMU_FORCE_MODE_BITMASK);
+}
 
-    /* Read current register state */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(pmu), &rdval);
-    val = rdval;
-    /* Clear force mode bits */
-    val &= ~PMU_FORCE_MODE_BITMASK; 
-    /* limit word to 22 bits, mask out lower 7 bits */
-    val &= 0x3fff80;
-    /* Modify only force mode and measure mode bits, keep all others */
-    if ((mode < 0) || (mode > 3)) {
+void ad5522_set_force_mode_mask(ad5522_t *self, unsigned int mask, unsigned int mode)
+{
+    if (mode > 3) {
         perror("unknown force mode.");
         return;
     }
-    val |= (mode << 19);
-    ad5522_write_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(pmu), val);
+    ad5522_update_pmu_mask(self, mask, mode << 19, PMU_FORCE_MODE_BITMASK);
 }
 
 void ad5522_set_gain(ad5522_t *self, int gain)
 {
     uint32_t val, rdval = 0;
 
-    /* Read current register state */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_SYSCTRL, &rdval);
+    /* Current register state */
+    ad5522_get_sys_reg(self, AD5522_REG_SYSCTRL, &rdval);
     /* limit word to 24 bits, mask out lowest bit */
     val = rdval & 0xfffffe;
     /* Clear range bits */
@@ -422,15 +873,15 @@ void ad5522_set_gain(ad5522_t *self, int gain)
         return;
     }
     val |= (gain << 6);
-    ad5522_write_sys_reg(self->ad5522_dev->fd, AD5522_REG_SYSCTRL, val);
+    ad5522_write_sys_reg(self, AD5522_REG_SYSCTRL, val);
 }
 
 void ad5522_get_gain(ad5522_t *self, int *gain)
 {
     uint32_t rdval = 0;
 
-    /* Read current register state */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_SYSCTRL, &rdval);
+    /* Current register state */
+    ad5522_get_sys_reg(self, AD5522_REG_SYSCTRL, &rdval);
     /* limit word to range bits */
     *gain = (rdval & SYS_CTRL_GAIN_BITMASK) >> 6;
    
@@ -442,7 +893,7 @@ void ad5522_get_alarm_flag(ad5522_t *self, int *flag)
     uint32_t rdval = 0;
 
     /* Read current register state */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_ALARM, &rdval);
+    ad5522_read_sys_reg(self, AD5522_REG_ALARM, &rdval);
     /* limit word to range bits */
     *flag = (rdval & ALARM_TMPALM_BITMASK) >> 20;
    
@@ -453,13 +904,13 @@ void ad5522_clear_alarm_flag(ad5522_t *self)
 {
     uint32_t val, rdval = 0;
 
-    /* Read current register state, only one register can be read back at a time */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(PMU0), &rdval);
+    /* Current register state */
+    ad5522_get_sys_reg(self, AD5522_REG_PMU(PMU0), &rdval);
     val = rdval;
     /* limit word to 22 bits, mask out lower 7 bits */
     val &= 0x3fff80;
     /* Alarm clear bit is global, so writing to any pmu register is sufficient and clears the bit */
-    ad5522_write_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(PMU0),
+    ad5522_write_sys_reg(self, AD5522_REG_PMU(PMU0),
             val | PMU_CLEAR);
    
     return;
@@ -467,28 +918,51 @@ void ad5522_clear_alarm_flag(ad5522_t *self)
 
 void ad5522_set_range(ad5522_t *self, unsigned int ch, unsigned int range)
 {
-    int pmu;
-    uint32_t val, rdval = 0;
-
-    if ((ch > 4) || (ch < 0)) {
+    if (ch >= AD5522_NUM_CHANNELS) {
         /* not a valid channel number */
         return;
     }
-    /* convert channel number to respective bit in PMU register */
-    pmu = 1 << ch;
-    /* Read current register state */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(pmu), &rdval);
-    /* limit word to 22 bits, mask out lower 7 bits */
-    val = rdval & 0x3fff80;
-    /* Clear range bits */
-    val &= ~PMU_RANGE_BITMASK; 
+    if (range > 4) {
+        perror("unknown current range.");
+        return;
+    }
     /* Modify only current range bits, keep all others */
-    if ((range < 0) || (range > 4)) {
+    ad5522_update_pmu(self, ch, range << 15, PMU_RANGE_BITMASK);
+}
+
+void ad5522_set_range_mask(ad5522_t *self, unsigned int mask, unsigned int range)
+{
+    if (range > 4) {
         perror("unknown current range.");
         return;
     }
-    val |= (range << 15);
-    ad5522_write_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(pmu), val);
+    ad5522_update_pmu_mask(self, mask, range << 15, PMU_RANGE_BITMASK);
+}
+
+void ad5522_get_force_mode(ad5522_t *self, unsigned int ch, unsigned int *mode)
+{
+    uint32_t rdval = 0;
+
+    if (ch >= AD5522_NUM_CHANNELS) {
+        /* not a valid channel number */
+        return;
+    }
+    /* Current register state */
+    ad5522_get_sys_reg(self, AD5522_REG_PMU(1 << ch), &rdval);
+    *mode = (rdval & PMU_FORCE_MODE_BITMASK) >> 19;
+}
+
+void ad5522_get_measure_mode(ad5522_t *self, unsigned int ch, unsigned int *mode)
+{
+    uint32_t rdval = 0;
+
+    if (ch >= AD5522_NUM_CHANNELS) {
+        /* not a valid channel number */
+        return;
+    }
+    /* Current register state */
+    ad5522_get_sys_reg(self, AD5522_REG_PMU(1 << ch), &rdval);
+    *mode = (rdval & PMU_MEASURE_MODE_BITMASK) >> 13;
 }
 
 void ad5522_get_range(ad5522_t *self, unsigned int ch, unsigned int *range)
@@ -496,15 +970,15 @@ void ad5522_get_range(ad5522_t *self, unsigned int ch, unsigned int *range)
     int pmu;
     uint32_t rdval = 0;
 
-    if ((ch > 4) || (ch < 0)) {
+    if (ch >= AD5522_NUM_CHANNELS) {
         /* not a valid channel number */
         range = NULL;
         return;
     }
     /* convert channel number to respective bit in PMU register */
     pmu = 1 << ch;
-    /* Read current register state */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(pmu), &rdval);
+    /* Current register state */
+    ad5522_get_sys_reg(self, AD5522_REG_PMU(pmu), &rdval);
     /* limit word to range bits */
     *range = (rdval & PMU_RANGE_BITMASK) >> 15;
    
@@ -512,26 +986,42 @@ void ad5522_get_range(ad5522_t *self, unsigned int ch, unsigned int *range)
 }
 
 /*
- * level is voltage in micro volt
+ * Write DAC addr[ch] = code[ch] on the channels of mask. Channels that agree
+ * on address and code share a write, all of them go out in one SPI message.
  */
-void ad5522_set_voltage(ad5522_t *self, unsigned int ch, int level)
+static void ad5522_write_dac_group(ad5522_t *self, unsigned int mask,
+        const unsigned int *addr, const unsigned int *code)
+{
+    unsigned int ch, other, group;
+
+    ad5522_begin(self);
+    for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++) {
+        if (!(mask & (1 << ch)))
+            continue;
+        group = 0;
+        for (other = ch; other < AD5522_NUM_CHANNELS; other++)
+            if ((mask & (1 << other)) && (addr[other] == addr[ch])
+                    && (code[other] == code[ch]))
+                group |= 1 << other;
+        ad5522_write_dac_reg(self, AD5522_REG_X1(group, addr[ch]), code[ch]);
+        mask &= ~group;
+    }
+    ad5522_commit(self);
+}
+
+/*
+ * FIN DAC code of a voltage in micro volt
+ */
+static unsigned int ad5522_voltage_code(ad5522_t *self, unsigned int ch, int level)
 {
-    int pmu, addr;
     unsigned int raw_level, rdval;
     int level_mv, level_uv;
 
-    if ((ch > 4) || (ch < 0)) {
-        /* not a valid channel number */
-        return;
-    }
-    /* convert channel number to respective bit in PMU register */
-    pmu = 1 << ch;
-    addr = DAC_FIN_V; /* voltage output is set, so modify the voltage register */
     /* all voltages are in micro volt */
     level_mv = level / 1000;
     level_uv = level - 1000 * level_mv;
-    /* offset term, read from device */
-    ad5522_read_dac_reg(self->ad5522_dev->fd, AD5522_REG_X1(PMU0 | PMU1 | PMU2 | PMU3,
+    /* offset term, from the shadow */
+    ad5522_get_dac_reg(self, AD5522_REG_X1(PMU0 | PMU1 | PMU2 | PMU3,
                 DAC_OFFSET_X), &rdval);
     raw_level = rdval;
     raw_level =  (raw_level * 35) / 45;
@@ -539,76 +1029,207 @@ void ad5522_set_voltage(ad5522_t *self, unsigned int ch, int level)
     raw_level += level_mv * 65535 / (4.5 * VREF_MICROVOLT / 1000);
     /* micro volt term */
     raw_level += level_uv * 65535 / (4.5 * VREF_MICROVOLT);
-    ad5522_write_dac_reg(self->ad5522_dev->fd, AD5522_REG_X1(pmu, addr), raw_level);
+    return ad5522_cal_force(self, ch, AD5522_CAL_FORCE_V, self->cal_rail, raw_level);
 }
 
 /*
- * level is current in nano amp
+ * FIN DAC address and code of a current in nano amp in the range the
+ * channel is set to, -1 if the range has no FIN DAC
  */
-void ad5522_set_current(ad5522_t *self, unsigned int ch, int level)
+static int ad5522_current_code(ad5522_t *self, unsigned int ch, int level,
+        unsigned int *addr, unsigned int *code)
 {
-    int pmu, addr;
     int64_t tmp; /* scaling factors imply the use of 64 bit wide integers */
-    unsigned int raw_level, curr_gain, curr_gain_scale, rdval, val;
+    unsigned int raw_level, curr_gain, curr_gain_scale, rdval, range;
 
-    if ((ch > 4) || (ch < 0)) {
-        /* not a valid channel number */
-        return;
-    }
-    /* convert channel number to respective bit in PMU register */
-    pmu = 1 << ch;
     /*
      * DAC level: X1 = Iout * MI * (Rsense * 2^16)/(4.5 * Vref) 
      * = Iout * MI * curr_gain/curr_gain_cf 
      */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(pmu), &rdval);
-    /* Mask out all range bits */
-    val = rdval & PMU_RANGE_BITMASK;
-    /* set current gain and gain scale values according to the range */
-    switch (val) {
-        case PMU_I_5_MICROAMP:
-            addr = DAC_FIN_I_5_MICROAMP;
-            curr_gain = curr_gain_tbl[0]; 
-            curr_gain_scale = curr_gain_scale_tbl[0]; 
-            break;
-        case PMU_I_20_MICROAMP:
-            addr = DAC_FIN_I_20_MICROAMP;
-            curr_gain = curr_gain_tbl[1]; 
-            curr_gain_scale = curr_gain_scale_tbl[1]; 
-            break;
-        case PMU_I_200_MICROAMP:
-            addr = DAC_FIN_I_200_MICROAMP;
-            curr_gain = curr_gain_tbl[2]; 
-            curr_gain_scale = curr_gain_scale_tbl[2]; 
-            break;
-        case PMU_I_2000_MICROAMP:
-            addr = DAC_FIN_I_2000_MICROAMP;
-            curr_gain = curr_gain_tbl[3]; 
-            curr_gain_scale = curr_gain_scale_tbl[3]; 
-            break;
-        case PMU_I_EXT:
-            addr = DAC_FIN_I_EXT;
-            curr_gain = curr_gain_tbl[4]; 
-            curr_gain_scale = curr_gain_scale_tbl[4]; 
-            break;
-        default:
-            return;
-    }
+    ad5522_get_sys_reg(self, AD5522_REG_PMU(1 << ch), &rdval);
+    /* Mask out all range bits, one FIN DAC per range */
+    range = (rdval & PMU_RANGE_BITMASK) >> 15;
+    if (range > PMU_RANGE_EXT)
+        return -1;
+    *addr = AD5522_FIN_DAC(range);
+    curr_gain = curr_gain_tbl[range];
+    curr_gain_scale = curr_gain_scale_tbl[range];
     tmp = level; /* integer value represents nano amp */
     tmp *= curr_gain;
     tmp = tmp >> curr_gain_scale; 
     raw_level = 32768; /* level can be negative, but not less than -32768 */
     raw_level = (unsigned int)((int)raw_level + (int)tmp); /* always positive by definition */
+    *code = ad5522_cal_force(self, ch, AD5522_CAL_FORCE_I, range, raw_level);
+    return 0;
+}
+
+/*
+ * level is voltage in micro volt
+ */
+void ad5522_set_voltage(ad5522_t *self, unsigned int ch, int level)
+{
+    if (ch >= AD5522_NUM_CHANNELS) {
+        /* not a valid channel number */
+        return;
+    }
+    ad5522_set_voltage_mask(self, 1 << ch, level);
+}
 
-    ad5522_write_dac_reg(self->ad5522_dev->fd, AD5522_REG_X1(pmu, addr), raw_level);
+void ad5522_set_voltage_mask(ad5522_t *self, unsigned int mask, int level)
+{
+    unsigned int ch, addr[AD5522_NUM_CHANNELS], code[AD5522_NUM_CHANNELS];
+
+    mask &= AD5522_ALL_CHANNELS;
+    for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++)
+        if (mask & (1 << ch)) {
+            addr[ch] = DAC_FIN_V;
+            code[ch] = ad5522_voltage_code(self, ch, level);
+        }
+    ad5522_write_dac_group(self, mask, addr, code);
+}
+
+/*
+ * level is current in nano amp
+ */
+void ad5522_set_current(ad5522_t *self, unsigned int ch, int level)
+{
+    if (ch >= AD5522_NUM_CHANNELS) {
+        /* not a valid channel number */
+        return;
+    }
+    ad5522_set_current_mask(self, 1 << ch, level);
+}
+
+void ad5522_set_current_mask(ad5522_t *self, unsigned int mask, int level)
+{
+    unsigned int ch, addr[AD5522_NUM_CHANNELS], code[AD5522_NUM_CHANNELS];
+
+    mask &= AD5522_ALL_CHANNELS;
+    for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++)
+        if ((mask & (1 << ch)) && (ad5522_current_code(self, ch, level, &addr[ch], &code[ch]) < 0))
+            mask &= ~(1 << ch);
+    ad5522_write_dac_group(self, mask, addr, code);
 }
 
 void ad5522_set_offset(ad5522_t *self, unsigned int raw_level)
 {
-    ad5522_write_dac_reg(self->ad5522_dev->fd, AD5522_REG_X1(PMU0 | PMU1 | PMU2 | PMU3, 
+    ad5522_write_dac_reg(self, AD5522_REG_X1(PMU0 | PMU1 | PMU2 | PMU3, 
                 DAC_OFFSET_X), raw_level);
 }
 
+static uint32_t ad5522_cal_le(const unsigned char *buf, unsigned int bytes)
+{
+    uint32_t val = 0;
+
+    while (bytes-- > 0)
+        val = (val << 8) | buf[bytes];
+    return val;
+}
+
+int ad5522_load_calibration(ad5522_t *self, const void *data, size_t len)
+{
+    const unsigned char *buf = data, *entry;
+    uint32_t hash = 2166136261u; /* FNV-1a */
+    size_t i, size = AD5522_CAL_ENTRIES * AD5522_CAL_ENTRY_SIZE;
+    int ch, k;
+
+    if ((len < AD5522_CAL_HEADER_SIZE + size) || (memcmp(buf, AD5522_CAL_MAGIC, 4) != 0)
+            || (ad5522_cal_le(buf + 4, 2) != AD5522_CAL_VERSION)
+            || (ad5522_cal_le(buf + 6, 2) != AD5522_CAL_ENTRIES)) {
+        fprintf(stderr, "ad5522 calibration data has a wrong format\n");
+        return -1;
+    }
+    entry = buf + AD5522_CAL_HEADER_SIZE;
+    for (i = 0; i < size; i++)
+        hash = (hash ^ entry[i]) * 16777619u;
+    if (hash != ad5522_cal_le(buf + 8, 4)) {
+        fprintf(stderr, "ad5522 calibration data has a wrong checksum\n");
+        return -1;
+    }
+    for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++)
+        for (k = 0; k < AD5522_CAL_PER_CHANNEL; k++) {
+            self->channel[ch].cal[k].gain = (int32_t)ad5522_cal_le(entry, 4);
+            self->channel[ch].cal[k].offset = (int32_t)ad5522_cal_le(entry + 4, 4);
+            entry += AD5522_CAL_ENTRY_SIZE;
+        }
+    /* entries that don't fit the M and C DACs fall back to software */
+    if (self->cal_hw)
+        ad5522_set_calibration_mode(self, true);
+    return 0;
+}
+
+/*
+ * M and C DACs of a FIN DAC, NULL writes the identity
+ */
+static int ad5522_write_cal_dac(ad5522_t *self, unsigned int ch,
+        unsigned int addr, const ad5522_cal_t *cal)
+{
+    unsigned int m = 0xffff, c = 0x8000;
+
+    if ((cal != NULL) && (ad5522_cal_dac_codes(cal->gain, cal->offset, &m, &c) < 0))
+        return -1;
+    ad5522_write_dac_reg(self, AD5522_REG_M(1 << ch, addr), m);
+    ad5522_write_dac_reg(self, AD5522_REG_C(1 << ch, addr), c);
+    return 0;
+}
+
+int ad5522_set_calibration_mode(ad5522_t *self, bool hw)
+{
+    unsigned int ch, i;
+    int ret = 0;
+
+    ad5522_begin(self);
+    for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++) {
+        for (i = 0; i < AD5522_CAL_RANGES; i++)
+            if (ad5522_write_cal_dac(self, ch, DAC_FIN_I_5_MICROAMP + i,
+                    hw? ad5522_cal_entry(self, ch, AD5522_CAL_FORCE_I, i): NULL) < 0)
+                ret = -1;
+        if (ad5522_write_cal_dac(self, ch, DAC_FIN_V,
+                hw? ad5522_cal_entry(self, ch, AD5522_CAL_FORCE_V, self->cal_rail): NULL) < 0)
+            ret = -1;
+    }
+    if (ret < 0) {
+        /* the entries don't fit, stay with the default transfer function */
+        for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++) {
+            for (i = 0; i < AD5522_CAL_RANGES; i++)
+                ad5522_write_cal_dac(self, ch, DAC_FIN_I_5_MICROAMP + i, NULL);
+            ad5522_write_cal_dac(self, ch, DAC_FIN_V, NULL);
+        }
+        hw = false;
+    }
+    ad5522_commit(self);
+    self->cal_hw = hw;
+    return ret;
+}
+
+void ad5522_set_calibration_rail(ad5522_t *self, unsigned int rail)
+{
+    unsigned int ch;
+
+    if (rail >= AD5522_CAL_RAILS)
+        return;
+    self->cal_rail = rail;
+    if (!self->cal_hw)
+        return;
+    ad5522_begin(self);
+    for (ch = 0; ch < AD5522_NUM_CHANNELS; ch++)
+        ad5522_write_cal_dac(self, ch, DAC_FIN_V,
+                ad5522_cal_entry(self, ch, AD5522_CAL_FORCE_V, rail));
+    ad5522_commit(self);
+}
+
+void ad5522_calibrate_codes(ad5522_t *self, unsigned int ch, unsigned int kind,
+        unsigned int index, int *codes, size_t n)
+{
+    const ad5522_cal_t *cal = ad5522_cal_entry(self, ch, kind, index);
+    size_t i;
+
+    if ((cal == NULL) || ((cal->gain == AD5522_CAL_UNITY) && (cal->offset == 0)))
+        return;
+    for (i = 0; i < n; i++)
+        codes[i] = (int)ad5522_cal_apply(cal, codes[i]);
+}
+
 void ad5522_set_voltage_compliance(ad5522_t *self, unsigned int ch, int level)
 {
     ;
@@ -621,36 +1242,36 @@ void ad5522_set_current_compliance(ad5522_t *self, unsigned int ch, int level)
 
 void ad5522_set_output_state(ad5522_t *self, unsigned int ch, unsigned int state)
 {
-    int pmu;
-    uint32_t val, rdval = 0;
-
-    if ((ch > 4) || (ch < 0)) {
+    if (ch >= AD5522_NUM_CHANNELS) {
         /* not a valid channel number */
         return;
     }
-    /* convert channel number to respective bit in PMU register */
-    pmu = 1 << ch;
-
-    /* Read current register state */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(pmu), &rdval);
-    val = rdval;
-    /* Clear relevant bits */
-    val &= ~PMU_ENABLE_BITMASK; 
-    /* limit the register value to be 22 bits wide */
-    val &= 0x3fffff;
     /* Modify enable and fin bits, keep all others */
-    if (state == PMU_CHANNEL_ON)
-            val |= PMU_CH_EN | PMU_FIN;
+    ad5522_update_pmu(self, ch, state == PMU_CHANNEL_ON? PMU_CH_EN | PMU_FIN: 0,
+            PMU_ENABLE_BITMASK);
+}
 
-    ad5522_write_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(pmu), val);
+void ad5522_set_output_state_mask(ad5522_t *self, unsigned int mask, unsigned int state)
+{
+    ad5522_update_pmu_mask(self, mask, state == PMU_CHANNEL_ON? PMU_CH_EN | PMU_FIN: 0,
+            PMU_ENABLE_BITMASK);
 }
 
-void ad5522_set_all_output_state(ad5522_t *self, unsigned int state)
+void ad5522_set_output_mask(ad5522_t *self, unsigned int mask, unsigned int mode,
+        unsigned int state)
 {
-    int ch;
-    for (ch=0; ch <= PMU_MAX_CHANNEL; ch++) {
-        ad5522_set_output_state(self, ch, state);
+    if (mode > 3) {
+        perror("unknown force mode.");
+        return;
     }
+    ad5522_update_pmu_mask(self, mask,
+            (mode << 19) | (state == PMU_CHANNEL_ON? PMU_CH_EN | PMU_FIN: 0),
+            PMU_FORCE_MODE_BITMASK | PMU_ENABLE_BITMASK);
+}
+
+void ad5522_set_all_output_state(ad5522_t *self, unsigned int state)
+{
+    ad5522_set_output_state_mask(self, AD5522_ALL_CHANNELS, state);
 }
 
 void ad5522_read_pmu_reg(ad5522_t *self, unsigned int ch, unsigned int *val)
@@ -658,45 +1279,45 @@ void ad5522_read_pmu_reg(ad5522_t *self, unsigned int ch, unsigned int *val)
     int pmu;
 
 
-    if ((ch > 4) || (ch < 0)) {
+    if (ch >= AD5522_NUM_CHANNELS) {
         /* not a valid channel number */
         return;
     }
     /* convert channel number to respective bit in PMU register */
     pmu = 1 << ch;
     /* Read current register state */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_PMU(pmu), val);
+    ad5522_read_sys_reg(self, AD5522_REG_PMU(pmu), val);
 }
 
 void ad5522_read_sysctrl_reg(ad5522_t *self, unsigned int *val)
 {
     /* Read current register state */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_SYSCTRL, val);
+    ad5522_read_sys_reg(self, AD5522_REG_SYSCTRL, val);
 }
 
 void ad5522_read_alarm_reg(ad5522_t *self, unsigned int *val)
 {
     /* Read current register state */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_ALARM, val);
+    ad5522_read_sys_reg(self, AD5522_REG_ALARM, val);
 }
 
 void ad5522_read_comp_reg(ad5522_t *self, unsigned int *val)
 {
     /* Read current register state */
-    ad5522_read_sys_reg(self->ad5522_dev->fd, AD5522_REG_COMP, val);
+    ad5522_read_sys_reg(self, AD5522_REG_COMP, val);
 }
 
 void ad5522_read_fin_dac_x1(ad5522_t *self, unsigned int ch, unsigned int range, unsigned int *val)
 {
     int pmu;
 
-    if ((ch > 4) || (ch < 0)) {
+    if (ch >= AD5522_NUM_CHANNELS) {
         /* not a valid channel number */
         return;
     }
     /* convert channel number to respective bit in PMU register */
     pmu = 1 << ch;
     /* Read current register state */
-    ad5522_read_dac_reg(self->ad5522_dev->fd, AD5522_REG_X1(pmu, AD5522_FIN_DAC(range)), val);
+    ad5522_read_dac_reg(self, AD5522_REG_X1(pmu, AD5522_FIN_DAC(range)), val);
 }
 
@@ -2,6 +2,7 @@
 #define _GNU_SOURCE  // stdio.h to include asprintf
 #include "config.h"
 #include <stdlib.h>
+#include <stdint.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <stdio.h>
@@ -11,7 +12,13 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
 #include "ad5522.h"
+#include "device.h"
+#include "iio.h"
+#include "gpio.h"
+#include "stats.h"
 
 #define VREF 5.0
 #define AD5522_CHANNEL_NUM 4
@@ -26,26 +33,107 @@
 #define FHIZV 2
 #define FHIZI 3
 
-#define SUP_LO_NAME "/sys/class/gpio/gpio98/value"
-#define SUP_MID_NAME "/sys/class/gpio/gpio5/value"
-#define SUP_HI_NAME "/sys/class/gpio/gpio103/value"
-#define SUP_LDO_EN_NAME "/sys/class/gpio/gpio63/value"
-#define SUP_DCDC_EN_NAME "/sys/class/gpio/gpio96/value"
-
-#define PMU_RST_NAME "/sys/class/gpio/gpio88/value"
+/*
+ * Supply rail and reset lines, in the order of the rail selection bits.
+ * Found by line name, or by their sysfs GPIO number if the device tree
+ * doesn't name them.
+ */
+static const gpio_line_t pmu_gpio_lines[] = {
+    {"sup_hi", 103, 0},
+    {"sup_mid", 5, 0},
+    {"sup_lo", 98, 0},
+    {"sup_ldo_en", 63, 0},
+    {"sup_dcdc_en", 96, 0},
+    {"pmu_rst", 88, 1}, /* low active */
+};
+#define SUP_RAIL_MASK 0x1f
+#define PMU_RST_LINE (1 << 5)
+/* reset pulse and recovery, > 1500 ns each */
+#define RESET_HOLD_NS 3000
 #define PMU_TMP_NAME "/sys/class/gpio/gpio127/value"
 #define PMU_CG_NAME "/sys/class/gpio/gpio108/value"
 #define PMU_BUSY_NAME "/sys/class/gpio/gpio119/value"
 
+/* Largest number of samples of a single capture */
+#define CAPTURE_MAX_SAMPLES (1 << 20)
+
+/*
+ * Auto-ranging: a reading above AUTORANGE_UP of the range maximum moves up,
+ * a reading below AUTORANGE_DOWN of the next lower range maximum moves
+ * down. The gap between both is the hysteresis.
+ */
+#define AUTORANGE_UP 0.95
+#define AUTORANGE_DOWN 0.5
+#define AUTORANGE_RANGES 5
+/* settling time after a range change */
+#define AUTORANGE_SETTLE_NS 200000
+
+/* Limits of a sweep */
+#define SWEEP_MAX_POINTS 100000
+#define SWEEP_MAX_CHANNELS 2
+
+/* Monitor: samples of die temperature and alarm register kept, a power of two */
+#define MONITOR_HISTORY 256
+#define MONITOR_MAX_RATE 1000.0
+/* temperature sensor output, c.f. data sheet: 1.5V at 25 degrees, 4.7mV/K */
+#define TEMP_V_25C 1.5
+#define TEMP_V_PER_K 0.0047
+
+/* Phases of the async methods, the continuation context */
+#define OP_ACQUIRE 0
+#define OP_RESET_RELEASE 1
+#define OP_CONFIGURE_PMU 1
+#define OP_FINISH 2
+
 #define SUP_OFF 0
 #define SUP_LO_RANGE 1
 #define SUP_MID_RANGE 2
 #define SUP_HI_RANGE 3
 
+typedef struct {
+    int64_t time_us; /* CLOCK_MONOTONIC */
+    double temp; /* die temperature in degree celsius, NAN if the adc failed */
+    unsigned int alarm; /* alarm status register */
+} lad5522_sample_t;
+
+/*
+ * Background monitor of a board. The thread takes the device lock per
+ * sample only. Samples go to a single writer ring, readers copy without a
+ * lock and drop what the writer may have overwritten meanwhile.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock; /* guards everything but the ring */
+    pthread_cond_t wake;
+    bool started; /* thread is created and not joined */
+    bool stop;
+    double period; /* seconds between samples */
+    double temp_limit; /* temperature raising an alarm, NAN if none */
+    device_t *dev; /* the pmu, its lock serializes with the Lua methods */
+    device_t *adc;
+    char *iio_name;
+    uint64_t head; /* samples written, atomic */
+    uint64_t alarms; /* alarms raised, atomic */
+    lad5522_sample_t ring[MONITOR_HISTORY];
+} lad5522_monitor_t;
+
+/* Handle of the shared device, one per pmu board */
 typedef struct {
     ad5522_t *s;
+    gpio_lines_t *gpio; /* supply rail and reset lines */
+    int supply_rail; /* rail the lines are set to */
+    int last_range[AD5522_CHANNEL_NUM]; /* last range auto-ranging settled on, -1 if none */
+    lad5522_monitor_t *monitor; /* NULL until the monitor is first started */
+} lad5522_board_t;
+
+typedef struct {
+    device_t *dev; /* shared device, must be the first member */
+    lad5522_board_t *board;
+    ad5522_t *s; /* board->s */
     char *spi_name;
     char *iio_name; /* name of the iio sysfs interface file for the adc */
+    device_t *adc; /* iio buffer of the adc, shared like the pmu and used under its lock */
+    device_events_t *events; /* events of the Lua state subscribed to the monitor, if any */
     unsigned int channel_mapping[AD5522_CHANNEL_NUM]; /* logical to physical driver channel mapping */
 } lad5522_userdata_t;
 
@@ -65,42 +153,41 @@ const int current_range_max_na_tbl[] = {5000, 20000, 200000, 2000000, 10000000};
 const int voltage_range_max_uv_tbl[] = {0, 6250000, 11250000, 17250000};
 const int voltage_range_min_uv_tbl[] = {0, -16250000, -11250000, -5250000};
 
-static void reset (void)
+static int reset_assert (lad5522_board_t *board)
 {
-    int fd;
-    const struct timespec tv = {.tv_sec = 0, .tv_nsec = 3000};
-
     /* Pull reset line */
-    fd = open(PMU_RST_NAME, O_WRONLY);
-    if (fd < 0) {
-        perror("can't open reset gpio device");
-        return;
-    }
-    if (write(fd, "0", 1) < 0) {
-        perror("can't write to reset gpio device");
-        close(fd);
+    return gpio_lines_set(board->gpio, PMU_RST_LINE, 0);
+}
+
+static void reset_release (lad5522_board_t *board)
+{
+    /* Release reset line */
+    gpio_lines_set(board->gpio, PMU_RST_LINE, PMU_RST_LINE);
+}
+
+static void reset (lad5522_board_t *board)
+{
+    const struct timespec tv = {.tv_sec = 0, .tv_nsec = RESET_HOLD_NS};
+
+    if (reset_assert(board) < 0)
         return;
-    }
-    close(fd);
     /* hold rst line low for at least tv_nsec nano seconds > 1500 */
     nanosleep(&tv, NULL);
-    /* Release reset line */
-    fd = open(PMU_RST_NAME, O_WRONLY);
-    if (fd < 0) {
-        perror("can't open reset gpio device");
-        return;
-    }
-    if (write(fd, "1", 1) < 0) {
-        perror("can't write to reset gpio device");
-        close(fd);
-        return;
-    }
-    close(fd);
+    reset_release(board);
     /* hold rst line low for at least tv_nsec nano seconds > 1500 */
     nanosleep(&tv, NULL);
     return; 
 }
 
+/*
+ * Sends the batch, a failed SPI transfer raises an error
+ */
+static void commit_or_error(lua_State *L, lad5522_userdata_t *su)
+{
+    if (ad5522_commit(su->s) < 0)
+        luaL_error(L, "%s: spi transfer failed", su->spi_name);
+}
+
 static int adc_read_raw (const char *iio_dev, int *val)
 {
     int fd;
@@ -140,117 +227,168 @@ static int adc_read_raw (const char *iio_dev, int *val)
     return 0; 
 }
 
-static int get_supply_rail(void)
+/*
+ * Single conversion, from the iio buffer if the adc has one and its trigger
+ * runs, otherwise through sysfs. The buffer stays enabled between reads.
+ */
+static int adc_read(lad5522_userdata_t *su, int *val)
 {
-    int fd, range_id, sup = 0;
-    char buf[] = "0";
-    /* Is it dcdc on? */
-    fd = open(SUP_DCDC_EN_NAME, O_RDONLY);
-    if (fd < 0) {
-        perror("can't open sup_dcdc_en gpio device");
-        return -1;
-    }
-    if (read(fd, buf, 1) < 0) {
-        perror("can't read from sup_dcdc_en gpio device");
-        close(fd);
-        return -1;
-    }
-    buf[1] = '\0';
-    close(fd);
-    if (atoi(buf) == 1)
-        sup |= 1 << 4;
+    iio_buffer_t *buf = device_handle(su->adc);
 
-    /* Is it dcdc on? */
-    fd = open(SUP_LDO_EN_NAME, O_RDONLY);
-    if (fd < 0) {
-        perror("can't open sup_ldo_en gpio device");
-        return -1;
-    }
-    if (read(fd, buf, 1) < 0) {
-        perror("can't read from sup_ldo_en gpio device");
-        close(fd);
-        return -1;
-    }
-    buf[1] = '\0';
-    close(fd);
-    if (atoi(buf) == 1)
-        sup |= 1 << 3;
+    if ((buf != NULL) && (iio_buffer_capture(buf, val, 1, 0) == 1))
+        return 0;
+    return adc_read_raw(su->iio_name, val);
+}
 
-    /* Is it lo range? */
-    fd = open(SUP_LO_NAME, O_RDONLY);
-    if (fd < 0) {
-        perror("can't open sup_lo gpio device");
-        return -1;
-    }
-    if (read(fd, buf, 1) < 0) {
-        perror("can't read from sup_lo gpio device");
-        close(fd);
-        return -1;
-    }
-    buf[1] = '\0';
-    close(fd);
-    if (atoi(buf) == 1)
-        sup |= 1 << 2;
+/*
+ * n conversions, one buffered capture if the adc has a buffer. Returns the
+ * number of conversions read or -1
+ */
+static int adc_read_n(lad5522_userdata_t *su, int *val, int n)
+{
+    iio_buffer_t *buf = device_handle(su->adc);
+    int i;
+
+    if (n == 1)
+        return adc_read(su, val) < 0 ? -1 : 1;
+    if (buf != NULL)
+        return iio_buffer_capture(buf, val, n, 0);
+    for (i = 0; i < n; i++)
+        if (adc_read_raw(su->iio_name, &val[i]) < 0)
+            return i > 0 ? i : -1;
+    return n;
+}
 
-    /* Is it mid range? */
-    fd = open(SUP_MID_NAME, O_RDONLY);
-    if (fd < 0) {
-        perror("can't open sup_mid gpio device");
-        return -1;
-    }
-    if (read(fd, buf, 1) < 0) {
-        perror("can't read from sup_mid gpio device");
-        close(fd);
-        return -1;
-    }
-    buf[1] = '\0';
-    close(fd);
-    if (atoi(buf) == 1)
-        sup |= 1 << 1;
+/* Convert adc raw level to amps, c.f. table 11, p.33, data sheet */
+static double raw_to_current(double raw_level, int range_id)
+{
+    double level = VREF * raw_level/65536.0 - VREF * 0.45;
+    return level / (rsense_ohm_tbl[range_id] * 10.0 * 0.2);
+}
 
-    /* Is it hi range? */
-    fd = open(SUP_HI_NAME, O_RDONLY);
-    if (fd < 0) {
-        perror("can't open sup_hi gpio device");
-        return -1;
-    }
-    if (read(fd, buf, 1) < 0) {
-        perror("can't read from sup_hi gpio device");
-        close(fd);
-        return -1;
-    }
-    buf[1] = '\0';
-    close(fd);
-    if (atoi(buf) == 1)
-        sup |= 1;
+/* Convert adc raw level to volts, c.f. table 11, p.33, data sheet */
+static double raw_to_voltage(double raw_level, int range_id)
+{
+    /* Wrong formula in Rev. D and Rev. E! */
+    double level = raw_level * VREF / 65536.0 * 5.0;
+    return level - 3.5 * VREF * voltage_range_offset_dac_tbl[range_id] / 65536.0;
+}
+
+/* Convert adc raw level to degree celsius, the sensor output bypasses the measout gain */
+static double raw_to_temperature(double raw_level)
+{
+    double level = VREF * raw_level / 65536.0;
+    return 25.0 + (level - TEMP_V_25C) / TEMP_V_PER_K;
+}
+
+/* The rail is cached, measurements need no gpio access */
+static int get_supply_rail(lad5522_board_t *board)
+{
+    return board->supply_rail;
+}
 
-    switch(sup) {
-        case 0x1c: range_id = 1; break;
-        case 0x1a: range_id = 2; break;
-        case 0x19: range_id = 3; break;
-        default: range_id = 0;break; /* off-state */
+/*
+ * Continuation of reset, the context is the phase
+ */
+static int lad5522_reset_k (lua_State *L, int status, lua_KContext ctx)
+{
+    lad5522_userdata_t *su = (lad5522_userdata_t *)lua_touserdata(L, 1);
+
+    (void)status;
+    device_lock(su->dev);
+    switch (ctx) {
+    case OP_ACQUIRE:
+        if (device_op_begin(su->dev, su) < 0) {
+            device_unlock(su->dev);
+            return device_retry(L, su->dev, ctx, lad5522_reset_k);
+        }
+        if (reset_assert(su->board) < 0)
+            break;
+        device_unlock(su->dev);
+        /* hold rst line low for at least RESET_HOLD_NS */
+        return device_wait(L, RESET_HOLD_NS / 1e9, OP_RESET_RELEASE, lad5522_reset_k);
+    case OP_RESET_RELEASE:
+        reset_release(su->board);
+        device_unlock(su->dev);
+        return device_wait(L, RESET_HOLD_NS / 1e9, OP_FINISH, lad5522_reset_k);
     }
-    return range_id;
+    /* registers are back at their power on values */
+    ad5522_sync(su->s);
+    device_op_end(su->dev);
+    device_unlock(su->dev);
+    return 0;
 }
 
+/** reset
+ * \brief: pulses the reset line and reloads the shadow registers
+ *
+ * Inside a coroutine the pulse yields, see configure.
+ */
 static int lad5522_reset (lua_State *L)
+{
+    luaL_checkudata(L, 1, "Lad5522");
+    lua_settop(L, 1);
+    return lad5522_reset_k(L, LUA_OK, OP_ACQUIRE);
+}
+
+/** verify
+ * \brief: compares the shadow registers with the device and reloads them
+ * \return the number of registers that differed, nil on SPI errors
+ */
+static int lad5522_verify(lua_State *L)
 {
     lad5522_userdata_t *su;
+    int mismatches;
 
     su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
+    mismatches = ad5522_verify(su->s);
+    if (mismatches < 0)
+        lua_pushnil(L);
+    else
+        lua_pushinteger(L, mismatches);
+    return 1;
+}
 
-    reset();
+/*
+ * Continuation of configure, the context is the phase
+ */
+static int lad5522_configure_k(lua_State *L, int status, lua_KContext ctx)
+{
+    lad5522_userdata_t *su = (lad5522_userdata_t *)lua_touserdata(L, 1);
+
+    (void)status;
+    device_lock(su->dev);
+    switch (ctx) {
+    case OP_ACQUIRE:
+        if (device_op_begin(su->dev, su) < 0) {
+            device_unlock(su->dev);
+            return device_retry(L, su->dev, ctx, lad5522_configure_k);
+        }
+        ad5522_configure_sys(su->s, NULL);
+        device_unlock(su->dev);
+        return device_wait(L, AD5522_SETTLE_US / 1e6, OP_CONFIGURE_PMU, lad5522_configure_k);
+    case OP_CONFIGURE_PMU:
+        ad5522_configure_pmu(su->s, NULL);
+        device_unlock(su->dev);
+        return device_wait(L, AD5522_SETTLE_US / 1e6, OP_FINISH, lad5522_configure_k);
+    }
+    device_op_end(su->dev);
+    device_unlock(su->dev);
     return 0;
 }
 
+/** configure
+ * \brief: writes the default system and pmu configuration
+ *
+ * Each write needs AD5522_SETTLE_US to settle. Inside a coroutine the
+ * settling time yields, other tracks run until the scheduler resumes the
+ * coroutine. Elsewhere it sleeps.
+ */
 static int lad5522_configure(lua_State *L)
 {
-    unsigned int *sysval_p = NULL, *pmuval_p = NULL;
-    lad5522_userdata_t *su;
-
-    su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
-    ad5522_configure(su->s, sysval_p, pmuval_p);
-    return 0;
+    luaL_checkudata(L, 1, "Lad5522");
+    lua_settop(L, 1);
+    return lad5522_configure_k(L, LUA_OK, OP_ACQUIRE);
 }
 
 static int lad5522_set_force_mode(lua_State *L)
@@ -533,20 +671,39 @@ static int clamp(int val, int minval, int maxval)
     return (val < minval) ? minval : (val > maxval) ? maxval : val;
 }
 
+/*
+ * Convert a level in volt or ampere to micro volt or nano amp, clamped to
+ * the supply rail or current range
+ */
+static int level_to_raw(unsigned int md, double level, int rail_id, unsigned int range_id)
+{
+    if ((md == FV) || (md == FHIZV))
+        return clamp((int)(1000000 * level), voltage_range_min_uv_tbl[rail_id],
+                voltage_range_max_uv_tbl[rail_id]);
+    return clamp((int)(1000000000 * level), -1 * current_range_max_na_tbl[range_id],
+            current_range_max_na_tbl[range_id]);
+}
+
 /** measure
- * \brief: sets the output mode and level for a given channel
+ * \brief: measures current or voltage of a given channel
  * \param ch the channel number
- * \param mode the force mode to be used
- * \param level the levelue to be set as a floating point number representing SI units,
- * i.e. ampere when mode is 'i' or  'hizi' or volts, otherwise
+ * \param mode 'i', 'v' or 'temp'
+ * \param n the number of conversions to average, optional, default 1
+ * \param reject outlier rejection 'none' (default), 'median' or 'trim'
+ * \param trim fraction dropped at either end with 'trim', default 0.1
+ * \return mean level in SI units, i.e. ampere when mode is 'i', degree
+ * celsius when mode is 'temp', volts otherwise, its standard deviation and
+ * the number of conversions used
  */
 static int lad5522_measure(lua_State *L)
 {
     lad5522_userdata_t *su;
     int ch, range_id;
-    int raw_level;
-    double level;
-    const char *mode;
+    int raw_level, n, count;
+    int *raw_levels, *kept;
+    double level, mean, std, trim;
+    double (*convert)(double, int);
+    const char *mode, *reject;
 
     su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
     /* Check the arguments are levelid. */
@@ -554,44 +711,431 @@ static int lad5522_measure(lua_State *L)
     mode  = luaL_checkstring(L, 3);
     if (mode == NULL)
         return luaL_error(L, "mode cannot be empty");
+    n = luaL_optinteger(L, 4, 1);
+    reject = luaL_optstring(L, 5, "none");
+    trim = luaL_optnumber(L, 6, 0.1);
+    luaL_argcheck(L, (n > 0) && (n <= CAPTURE_MAX_SAMPLES), 4, "sample count out of range");
+    luaL_argcheck(L, (strcmp(reject, "none") == 0) || (strcmp(reject, "median") == 0)
+            || (strcmp(reject, "trim") == 0), 5, "unknown outlier rejection");
+    luaL_argcheck(L, (trim >= 0.0) && (trim < 0.5), 6, "trim fraction out of range");
+    /* scratch space, collected with the rest of the garbage */
+    raw_levels = (n > 1) ? (int *)lua_newuserdata(L, n * sizeof(int)) : &raw_level;
 
     if (strcmp(mode, "i") == 0)
     {
         /* MEASOUT Gain 0.2, current gain 10 */
+        ad5522_begin(su->s);
         ad5522_set_gain(su->s,  2);
         ad5522_set_measure_mode(su->s, ch - 1, MI); 
         ad5522_get_range(su->s, ch - 1, &range_id);/* use 1..4 indexing in Lua, but 0..3 in C */
-        adc_read_raw(su->iio_name, &raw_level);
-        /* Convert dac raw level to amps, c.f. table 11, p.33, data sheet */
-        level = VREF * raw_level/65536.0 - VREF * 0.45;
-        level /= rsense_ohm_tbl[range_id] * 10.0 * 0.2;
-
+        /* settings must have reached the device before the ADC samples */
+        commit_or_error(L, su);
+        convert = raw_to_current;
     }
     else if (strcmp(mode, "v") == 0) 
     {
+        ad5522_begin(su->s);
         ad5522_set_gain(su->s,  2);
         ad5522_set_measure_mode(su->s, ch - 1, MV); 
-        range_id = get_supply_rail();
-        adc_read_raw(su->iio_name, &raw_level);
-        /* Convert dac raw level to volts, c.f. table 11, p.33, data sheet */
-        /* Wrong formula in Rev. D and Rev. E! */
-        level = raw_level * VREF / 65536.0 * 5.0;
-        level += -3.5 * VREF * voltage_range_offset_dac_tbl[range_id] / 65536.0;
+        commit_or_error(L, su);
+        range_id = get_supply_rail(su->board);
+        convert = raw_to_voltage;
     } 
     else if (strcmp(mode, "temp") == 0)
     {
-        fprintf(stderr, "measuring temperature is not yet implemented\n");
-        level = 100.0;
+        ad5522_set_measure_mode(su->s, ch - 1, MTEMP);
+        range_id = 0;
+        convert = NULL;
     }
     else 
     {
         return luaL_error(L, "unknown mode %s", mode);
     }
+    count = adc_read_n(su, raw_levels, n);
     ad5522_set_measure_mode(su->s, ch - 1, MHIZ); 
+    if (count < 0)
+        return luaL_error(L, "can't read from adc");
+
+    if (convert != NULL)
+        ad5522_calibrate_codes(su->s, ch - 1, convert == raw_to_current?
+                AD5522_CAL_MEASURE_I: AD5522_CAL_MEASURE_V, range_id, raw_levels, count);
+    count = stats_reject(raw_levels, count, reject, trim, &kept);
+    stats_mean_std(kept, count, &mean, &std);
+    if (convert == NULL) {
+        lua_pushnumber(L, raw_to_temperature(mean));
+        lua_pushnumber(L, std * VREF / 65536.0 / TEMP_V_PER_K);
+        lua_pushinteger(L, count);
+        return 3;
+    }
+    level = convert(mean, range_id);
+    lua_pushnumber(L, level);
+    /* the conversion is linear, scale the deviation by its slope */
+    lua_pushnumber(L, std * fabs(convert(1.0, range_id) - convert(0.0, range_id)));
+    lua_pushinteger(L, count);
+    return 3;
+}
+
+/** measure_auto
+ * \brief: measures the current of a channel forcing a voltage, choosing the current range
+ * \param ch the channel number
+ * \param n the number of conversions to average per reading, optional, default 1
+ * \return current in ampere, the range it was measured in, its standard
+ * deviation and the number of conversions used
+ *
+ * The search starts at the range the channel settled on last time and
+ * leaves the channel in the chosen range.
+ */
+static int lad5522_measure_auto(lua_State *L)
+{
+    lad5522_userdata_t *su;
+    unsigned int ch, md, range_id;
+    int n, count, next, tries;
+    int *raw_levels;
+    double level, mean, std, max;
+    const struct timespec settle = {.tv_sec = 0, .tv_nsec = AUTORANGE_SETTLE_NS};
+
+    su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
+    /* Check the arguments are valid. */
+    ch = luaL_checkinteger(L, 2);
+    n = luaL_optinteger(L, 3, 1);
+    luaL_argcheck(L, (ch >= 1) && (ch <= AD5522_CHANNEL_NUM), 2, "invalid channel");
+    luaL_argcheck(L, (n > 0) && (n <= CAPTURE_MAX_SAMPLES), 3, "sample count out of range");
+    ad5522_get_force_mode(su->s, ch - 1, &md);
+    /* in force current mode the range scales the forced current */
+    if ((md != FV) && (md != FHIZV))
+        return luaL_error(L, "auto-ranging needs a channel forcing voltage");
+    raw_levels = (int *)lua_newuserdata(L, n * sizeof(int));
+
+    if (su->board->last_range[ch - 1] >= 0)
+        range_id = su->board->last_range[ch - 1];
+    else
+        ad5522_get_range(su->s, ch - 1, &range_id);
+    ad5522_begin(su->s);
+    /* MEASOUT Gain 0.2, current gain 10 */
+    ad5522_set_gain(su->s,  2);
+    ad5522_set_range(su->s, ch - 1, range_id);
+    ad5522_set_measure_mode(su->s, ch - 1, MI);
+    commit_or_error(L, su);
+    nanosleep(&settle, NULL);
+
+    /* every range is visited once at most */
+    for (tries = 0; tries < AUTORANGE_RANGES; tries++) {
+        count = adc_read_n(su, raw_levels, n);
+        if (count < 0)
+            break;
+        ad5522_calibrate_codes(su->s, ch - 1, AD5522_CAL_MEASURE_I, range_id, raw_levels, count);
+        stats_mean_std(raw_levels, count, &mean, &std);
+        level = raw_to_current(mean, range_id);
+        max = current_range_max_na_tbl[range_id] / 1e9;
+        next = range_id;
+        if ((fabs(level) > AUTORANGE_UP * max) && (range_id < AUTORANGE_RANGES - 1))
+            next = range_id + 1;
+        /* down to the lowest range that still has head room */
+        while ((next > 0) && (next <= (int)range_id)
+                && (fabs(level) < AUTORANGE_DOWN * current_range_max_na_tbl[next - 1] / 1e9))
+            next--;
+        if (next == (int)range_id)
+            break;
+        range_id = next;
+        ad5522_set_range(su->s, ch - 1, range_id);
+        nanosleep(&settle, NULL);
+    }
+    ad5522_set_measure_mode(su->s, ch - 1, MHIZ);
+    if (count < 0)
+        return luaL_error(L, "can't read from adc");
+    su->board->last_range[ch - 1] = range_id;
+
     lua_pushnumber(L, level);
+    lua_pushinteger(L, range_id);
+    lua_pushnumber(L, std * fabs(raw_to_current(1.0, range_id) - raw_to_current(0.0, range_id)));
+    lua_pushinteger(L, count);
+    return 4;
+}
+
+/** capture
+ * \brief: captures a series of measurements through the iio buffer of the adc
+ * \param ch the channel number
+ * \param mode 'i' or 'v'
+ * \param n the number of samples
+ * \param rate the sampling rate in Hz, optional
+ * \return a sequence of up to n levels in SI units
+ */
+static int lad5522_capture(lua_State *L)
+{
+    lad5522_userdata_t *su;
+    iio_buffer_t *buf;
+    unsigned int ch, range_id;
+    int i, n, count, rate;
+    int *raw_levels;
+    const char *mode;
+
+    su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
+    /* Check the arguments are valid. */
+    ch = luaL_checkinteger(L, 2);
+    mode  = luaL_checkstring(L, 3);
+    n = luaL_checkinteger(L, 4);
+    rate = luaL_optinteger(L, 5, 0);
+    luaL_argcheck(L, (n > 0) && (n <= CAPTURE_MAX_SAMPLES), 4, "sample count out of range");
+    luaL_argcheck(L, rate >= 0, 5, "negative rate");
+    if ((strcmp(mode, "i") != 0) && (strcmp(mode, "v") != 0))
+        return luaL_error(L, "unknown mode %s", mode);
+    buf = device_handle(su->adc);
+    if (buf == NULL)
+        return luaL_error(L, "adc has no iio buffer");
+    /* scratch space, collected with the rest of the garbage */
+    raw_levels = (int *)lua_newuserdata(L, n * sizeof(int));
+
+    ad5522_begin(su->s);
+    /* MEASOUT Gain 0.2, current gain 10 */
+    ad5522_set_gain(su->s,  2);
+    if (strcmp(mode, "i") == 0) {
+        ad5522_set_measure_mode(su->s, ch - 1, MI);
+        ad5522_get_range(su->s, ch - 1, &range_id);/* use 1..4 indexing in Lua, but 0..3 in C */
+    } else {
+        ad5522_set_measure_mode(su->s, ch - 1, MV);
+        range_id = get_supply_rail(su->board);
+    }
+    commit_or_error(L, su);
+    count = iio_buffer_capture(buf, raw_levels, n, rate);
+    ad5522_set_measure_mode(su->s, ch - 1, MHIZ);
+    if (count < 0)
+        return luaL_error(L, "can't capture from iio buffer");
+    ad5522_calibrate_codes(su->s, ch - 1, strcmp(mode, "i") == 0?
+            AD5522_CAL_MEASURE_I: AD5522_CAL_MEASURE_V, range_id, raw_levels, count);
+
+    lua_createtable(L, count, 0);
+    for (i = 0; i < count; i++) {
+        if (strcmp(mode, "i") == 0)
+            lua_pushnumber(L, raw_to_current(raw_levels[i], range_id));
+        else
+            lua_pushnumber(L, raw_to_voltage(raw_levels[i], range_id));
+        lua_rawseti(L, -2, i + 1);
+    }
     return 1;
 }
 
+/*
+ * Points of a sweep from the spec table at index t, either the sequence
+ * t.list or t.points values from t.start to t.stop spaced by t.scale
+ * ('lin' or 'log'). Returns the number of points, the points are left on
+ * the stack in a userdata.
+ */
+static int sweep_points(lua_State *L, int t, double **points)
+{
+    const char *scale;
+    double start, stop;
+    int i, n;
+
+    lua_getfield(L, t, "list");
+    if (lua_istable(L, -1)) {
+        n = lua_rawlen(L, -1);
+        if ((n < 1) || (n > SWEEP_MAX_POINTS))
+            luaL_error(L, "sweep list needs 1 to %d points", SWEEP_MAX_POINTS);
+        *points = (double *)lua_newuserdata(L, n * sizeof(double));
+        for (i = 0; i < n; i++) {
+            lua_rawgeti(L, -2, i + 1);
+            if (!lua_isnumber(L, -1))
+                luaL_error(L, "sweep list point %d is not a number", i + 1);
+            (*points)[i] = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+        lua_remove(L, -2);
+        return n;
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, t, "start");
+    lua_getfield(L, t, "stop");
+    lua_getfield(L, t, "points");
+    lua_getfield(L, t, "scale");
+    if (!lua_isnumber(L, -4) || !lua_isnumber(L, -3) || !lua_isinteger(L, -2))
+        luaL_error(L, "sweep needs a list or start, stop and points");
+    start = lua_tonumber(L, -4);
+    stop = lua_tonumber(L, -3);
+    n = lua_tointeger(L, -2);
+    scale = luaL_optstring(L, -1, "lin");
+    lua_pop(L, 4);
+    if ((n < 1) || (n > SWEEP_MAX_POINTS))
+        luaL_error(L, "sweep needs 1 to %d points", SWEEP_MAX_POINTS);
+    *points = (double *)lua_newuserdata(L, n * sizeof(double));
+    if (strcmp(scale, "lin") == 0) {
+        for (i = 0; i < n; i++)
+            (*points)[i] = (n == 1) ? start : start + (stop - start) * i / (n - 1);
+    } else if (strcmp(scale, "log") == 0) {
+        if ((start * stop <= 0.0))
+            luaL_error(L, "log sweep needs start and stop of the same sign");
+        for (i = 0; i < n; i++)
+            (*points)[i] = (n == 1) ? start : start * pow(stop / start, (double)i / (n - 1));
+    } else {
+        luaL_error(L, "unknown sweep scale %s", scale);
+    }
+    return n;
+}
+
+/*
+ * Conversion of a sweep point from the buffer started for the sweep, through
+ * sysfs if there is none or it stopped
+ */
+static int sweep_read(lad5522_userdata_t *su, iio_buffer_t *buf, int *val)
+{
+    if ((buf != NULL) && (iio_buffer_read(buf, val, 1) == 1))
+        return 0;
+    return adc_read_raw(su->iio_name, val);
+}
+
+/** sweep
+ * \brief: IV sweep, forces every point on the channels and measures the other quantity
+ * \param spec a table with
+ *   ch       channel number or a list of up to two channels swept in lockstep
+ *   mode     'v' forces voltage and measures current, 'i' the other way round
+ *   list     the points in volt or ampere, or
+ *   start, stop, points, scale  'lin' (default) or 'log' spaced points
+ *   settle   time in seconds between forcing a point and measuring, default 0
+ * \return per channel a table {v = {...}, i = {...}} with the forced
+ * (clamped) and the measured levels
+ */
+static int lad5522_sweep(lua_State *L)
+{
+    lad5522_userdata_t *su;
+    unsigned int ch[SWEEP_MAX_CHANNELS], range_id[SWEEP_MAX_CHANNELS];
+    unsigned int md, mm;
+    int nch, npoints, rail_id, i, k, raw_level;
+    double *points, *results, settle;
+    iio_buffer_t *buf;
+    const char *mode;
+    struct timespec settle_ts;
+
+    su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    /* Check the arguments are valid, before the pmu is touched */
+    lua_getfield(L, 2, "ch");
+    if (lua_istable(L, -1)) {
+        nch = lua_rawlen(L, -1);
+        if ((nch < 1) || (nch > SWEEP_MAX_CHANNELS))
+            return luaL_error(L, "sweep takes 1 to %d channels", SWEEP_MAX_CHANNELS);
+        for (i = 0; i < nch; i++) {
+            lua_rawgeti(L, -1, i + 1);
+            ch[i] = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+        }
+    } else {
+        nch = 1;
+        ch[0] = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+    for (i = 0; i < nch; i++)
+        if ((ch[i] < 1) || (ch[i] > AD5522_CHANNEL_NUM))
+            return luaL_error(L, "invalid sweep channel");
+    if ((nch == 2) && (ch[0] == ch[1]))
+        return luaL_error(L, "sweep channels must differ");
+
+    lua_getfield(L, 2, "mode");
+    mode = luaL_optstring(L, -1, "v");
+    if (strcmp(mode, "v") == 0) {
+        md = FV;
+        mm = MI;
+    } else if (strcmp(mode, "i") == 0) {
+        md = FI;
+        mm = MV;
+    } else {
+        return luaL_error(L, "unknown mode %s", mode);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 2, "settle");
+    settle = luaL_optnumber(L, -1, 0.0);
+    lua_pop(L, 1);
+    if (settle < 0.0)
+        return luaL_error(L, "negative settle time");
+    settle_ts.tv_sec = (time_t)settle;
+    settle_ts.tv_nsec = (long)((settle - settle_ts.tv_sec) * 1e9);
+
+    npoints = sweep_points(L, 2, &points);
+    /* forced and measured level per channel and point */
+    results = (double *)lua_newuserdata(L, 2 * nch * npoints * sizeof(double));
+
+    /* the configuration holds for the whole sweep, only the DACs change per point */
+    rail_id = get_supply_rail(su->board);
+    ad5522_begin(su->s);
+    /* MEASOUT Gain 0.2, current gain 10 */
+    ad5522_set_gain(su->s, 2);
+    for (i = 0; i < nch; i++) {
+        ad5522_get_range(su->s, ch[i] - 1, &range_id[i]);
+        raw_level = level_to_raw(md, points[0], rail_id, range_id[i]);
+        /* pre-load the first point in hiz force mode, like set_output */
+        if (md == FV) {
+            ad5522_set_force_mode(su->s, ch[i] - 1, FHIZV);
+            ad5522_set_voltage(su->s, ch[i] - 1, raw_level);
+        } else {
+            ad5522_set_force_mode(su->s, ch[i] - 1, FHIZI);
+            ad5522_set_current(su->s, ch[i] - 1, raw_level);
+        }
+        ad5522_set_force_mode(su->s, ch[i] - 1, md);
+        ad5522_set_output_state(su->s, ch[i] - 1, PMU_CHANNEL_ON);
+    }
+    /* measure outputs share the adc, a single channel keeps its measure mode */
+    if (nch == 1)
+        ad5522_set_measure_mode(su->s, ch[0] - 1, mm);
+    commit_or_error(L, su);
+    /* one buffer enabled for the whole sweep, a point reads a single scan */
+    buf = device_handle(su->adc);
+    if ((buf != NULL) && (iio_buffer_start(buf, 1, 0) < 0))
+        buf = NULL;
+
+    for (k = 0; k < npoints; k++) {
+        ad5522_begin(su->s);
+        for (i = 0; i < nch; i++) {
+            raw_level = level_to_raw(md, points[k], rail_id, range_id[i]);
+            if (k > 0) {
+                if (md == FV)
+                    ad5522_set_voltage(su->s, ch[i] - 1, raw_level);
+                else
+                    ad5522_set_current(su->s, ch[i] - 1, raw_level);
+            }
+            results[2 * (i * npoints + k)] = (md == FV) ? raw_level / 1e6 : raw_level / 1e9;
+        }
+        commit_or_error(L, su);
+        if (settle > 0.0)
+            nanosleep(&settle_ts, NULL);
+        for (i = 0; i < nch; i++) {
+            int raw;
+
+            if (nch > 1)
+                ad5522_set_measure_mode(su->s, ch[i] - 1, mm);
+            if (sweep_read(su, buf, &raw) < 0)
+                results[2 * (i * npoints + k) + 1] = NAN;
+            else if (mm == MI) {
+                ad5522_calibrate_codes(su->s, ch[i] - 1, AD5522_CAL_MEASURE_I, range_id[i], &raw, 1);
+                results[2 * (i * npoints + k) + 1] = raw_to_current(raw, range_id[i]);
+            } else {
+                ad5522_calibrate_codes(su->s, ch[i] - 1, AD5522_CAL_MEASURE_V, rail_id, &raw, 1);
+                results[2 * (i * npoints + k) + 1] = raw_to_voltage(raw, rail_id);
+            }
+            if (nch > 1)
+                ad5522_set_measure_mode(su->s, ch[i] - 1, MHIZ);
+        }
+    }
+    if (nch == 1)
+        ad5522_set_measure_mode(su->s, ch[0] - 1, MHIZ);
+
+    for (i = 0; i < nch; i++) {
+        lua_createtable(L, 0, 2);
+        lua_createtable(L, npoints, 0);
+        lua_createtable(L, npoints, 0);
+        for (k = 0; k < npoints; k++) {
+            double forced = results[2 * (i * npoints + k)];
+            double measured = results[2 * (i * npoints + k) + 1];
+            lua_pushnumber(L, (md == FV) ? forced : measured);
+            lua_rawseti(L, -3, k + 1);
+            lua_pushnumber(L, (md == FV) ? measured : forced);
+            lua_rawseti(L, -2, k + 1);
+        }
+        lua_setfield(L, -3, "i");
+        lua_setfield(L, -2, "v");
+    }
+    return nch;
+}
+
 /** set_output
  * \brief: sets the output mode and level for a given channel
  * \param ch the channel number
@@ -634,16 +1178,17 @@ static int lad5522_set_output(lua_State *L)
         return luaL_error(L, "unknown mode %s", mode);
     }
     level = luaL_checknumber(L, 4);
+    /* all register writes below go out as a single SPI message */
+    ad5522_begin(su->s);
     if ((md == 0) || (md == 2)) /* level represents a voltage */
     {
         /* which supply range? */
-        range_id = get_supply_rail();
+        range_id = get_supply_rail(su->board);
         /* supply rail limits the voltage output, so select from look-up table */
 
         /* convert from floating point number in volt to integer in micro volt */
         /* clamp voltage to allowed region according to selected supply voltage range */
-        raw_level = clamp((int)(1000000 * level), voltage_range_min_uv_tbl[range_id], 
-                voltage_range_max_uv_tbl[range_id]);
+        raw_level = level_to_raw(md, level, range_id, 0);
         /* set 'hizv' force mode */
         ad5522_set_force_mode(su->s, ch - 1, FHIZV); 
         /* pre-load new DAC value and let internal circuitry settle */
@@ -655,8 +1200,7 @@ static int lad5522_set_output(lua_State *L)
         ad5522_get_range(su->s, ch - 1, &range_id);/* use 1..4 indexing in Lua, but 0..3 in C */
         /* convert from floating point number in volt to integer in micro volt */
         /* clamp voltage to allowed region according to selected current range */
-        raw_level = clamp((int)(1000000000 * level), -1 * current_range_max_na_tbl[range_id], 
-                current_range_max_na_tbl[range_id]);
+        raw_level = level_to_raw(md, level, 0, range_id);
         /* set 'hizi' force mode */
         ad5522_set_force_mode(su->s, ch - 1, FHIZI); 
         /* pre-load new DAC value and let internal circuitry settle */
@@ -665,89 +1209,501 @@ static int lad5522_set_output(lua_State *L)
     /* change force mode as the user requested */
     ad5522_set_force_mode(su->s, ch - 1, md); 
     ad5522_set_output_state(su->s, ch - 1, PMU_CHANNEL_ON); 
+    commit_or_error(L, su);
     return 0;
 }
 
-static int lad5522_get_channel_count(lua_State *L)
+/** load_calibration
+ * \brief: loads the calibration of all channels
+ * \param cal path of a calibration file or the calibration data itself,
+ * e.g. as read from an eeprom
+ * \param hw true applies the force calibration with the M and C DACs,
+ * optional, default false
+ * \return true and the active force calibration, 'hw' or 'sw', or nil and
+ * a message if the data was rejected. Entries that don't fit the M and C
+ * DACs are applied in software.
+ */
+static int lad5522_load_calibration(lua_State *L)
 {
     lad5522_userdata_t *su;
+    const char *cal;
+    char *data;
+    size_t len;
+    long size;
+    int hw, ret;
+    FILE *f;
+
     su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
-    lua_pushinteger(L, AD5522_CHANNEL_NUM);
-    return 1;
+    cal = luaL_checklstring(L, 2, &len);
+    hw = lua_toboolean(L, 3);
+
+    if ((len >= 4) && (memcmp(cal, "PMUC", 4) == 0)) {
+        ret = ad5522_load_calibration(su->s, cal, len);
+    } else {
+        f = fopen(cal, "rb");
+        if (f == NULL) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "can't open calibration file %s", cal);
+            return 2;
+        }
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        rewind(f);
+        data = (size > 0)? (char *)malloc(size): NULL;
+        if ((data == NULL) || (fread(data, 1, size, f) != (size_t)size)) {
+            free(data);
+            fclose(f);
+            lua_pushnil(L);
+            lua_pushfstring(L, "can't read calibration file %s", cal);
+            return 2;
+        }
+        fclose(f);
+        ret = ad5522_load_calibration(su->s, data, size);
+        free(data);
+    }
+    if (ret < 0) {
+        lua_pushnil(L);
+        lua_pushstring(L, "invalid calibration data");
+        return 2;
+    }
+    if (ad5522_set_calibration_mode(su->s, hw) < 0)
+        hw = 0;
+    lua_pushboolean(L, 1);
+    lua_pushstring(L, hw? "hw": "sw");
+    return 2;
 }
 
-static int set_supply_rail(int range_id)
+/*
+ * Channel mask of the channel number or list of channel numbers at index,
+ * bit n is channel n + 1
+ */
+static unsigned int channel_mask(lua_State *L, int index)
 {
-    int fd, sup, range;
+    unsigned int mask = 0;
+    lua_Integer ch;
+    int i, n;
+
+    if (!lua_istable(L, index)) {
+        ch = luaL_checkinteger(L, index);
+        luaL_argcheck(L, (ch >= 1) && (ch <= AD5522_CHANNEL_NUM), index, "invalid channel");
+        return 1 << (ch - 1);
+    }
+    n = lua_rawlen(L, index);
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, index, i);
+        ch = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        luaL_argcheck(L, (ch >= 1) && (ch <= AD5522_CHANNEL_NUM), index, "invalid channel");
+        mask |= 1 << (ch - 1);
+    }
+    luaL_argcheck(L, mask != 0, index, "no channels");
+    return mask;
+}
 
-    sup = 0;
-    switch(range_id) {
-        case 1: sup = 0x1c; range = 1; break; /* -19.5V...+11.5V, enable dcdc + ldo */
-        case 2: sup = 0x1a; range = 2;break; /* -16.5V...+16.5V, enable dcdc + ldo */
-        case 3: sup = 0x19; range = 3;break; /* -11.5V...+19.5V, enable dcdc + ldo */
-        default: sup = 0; range = 0; break;   /* off, disable dcdc + ldo */
+/** set_group_output
+ * \brief: sets the output mode and level of several channels at once
+ * \param chs a list of channel numbers
+ * \param mode 'v', 'i' or 'off'
+ * \param level the level in volt or ampere, clamped to the supply rail or
+ * the smallest current range of the channels
+ *
+ * Channels that are configured alike are written with a single register
+ * word, so they are switched on at the same instant.
+ */
+static int lad5522_set_group_output(lua_State *L)
+{
+    lad5522_userdata_t *su;
+    unsigned int mask, md, ch, range, min_range;
+    const char *mode;
+    double level;
+
+    su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
+    /* Check the arguments are valid, before the pmu is touched */
+    mask = channel_mask(L, 2);
+    mode = luaL_checkstring(L, 3);
+    if (strcmp(mode, "off") == 0) {
+        ad5522_set_output_state_mask(su->s, mask, PMU_CHANNEL_OFF);
+        return 0;
     }
-    /* Write to dcdc pin */
-    fd = open(SUP_DCDC_EN_NAME, O_WRONLY);
-    if (fd < 0) {
-        perror("can't open sup_dcdc_en gpio device");
-        return -1;
+    if (strcmp(mode, "v") == 0)
+        md = FV;
+    else if (strcmp(mode, "i") == 0)
+        md = FI;
+    else
+        return luaL_error(L, "unknown mode %s", mode);
+    level = luaL_checknumber(L, 4);
+
+    ad5522_begin(su->s);
+    if (md == FV) {
+        ad5522_set_force_mode_mask(su->s, mask, FHIZV);
+        ad5522_set_voltage_mask(su->s, mask,
+                level_to_raw(md, level, get_supply_rail(su->board), 0));
+    } else {
+        min_range = PMU_RANGE_EXT;
+        for (ch = 0; ch < AD5522_CHANNEL_NUM; ch++)
+            if (mask & (1 << ch)) {
+                ad5522_get_range(su->s, ch, &range);
+                if (range < min_range)
+                    min_range = range;
+            }
+        ad5522_set_force_mode_mask(su->s, mask, FHIZI);
+        ad5522_set_current_mask(su->s, mask, level_to_raw(md, level, 0, min_range));
     }
-    if (write(fd, (sup & 0x10) ? "1" : "0", 1) < 0) {
-        perror("can't write to sup_dcdc_en gpio device");
-        close(fd);
+    /* force mode and output enable in one write per configuration */
+    ad5522_set_output_mask(su->s, mask, md, PMU_CHANNEL_ON);
+    commit_or_error(L, su);
+    return 0;
+}
+
+/** set_group_range
+ * \brief: sets the current range of several channels with a single write
+ * \param chs a list of channel numbers
+ * \param range the current range 0..4
+ */
+static int lad5522_set_group_range(lua_State *L)
+{
+    lad5522_userdata_t *su;
+    unsigned int mask;
+    lua_Integer range;
+
+    su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
+    mask = channel_mask(L, 2);
+    range = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, (range >= 0) && (range <= PMU_RANGE_EXT), 3, "invalid range");
+    ad5522_set_range_mask(su->s, mask, range);
+    return 0;
+}
+
+static int lad5522_turn_group_on(lua_State *L)
+{
+    lad5522_userdata_t *su;
+
+    su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
+    ad5522_set_output_state_mask(su->s, channel_mask(L, 2), PMU_CHANNEL_ON);
+    return 0;
+}
+
+static int lad5522_turn_group_off(lua_State *L)
+{
+    lad5522_userdata_t *su;
+
+    su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
+    ad5522_set_output_state_mask(su->s, channel_mask(L, 2), PMU_CHANNEL_OFF);
+    return 0;
+}
+
+static int64_t monitor_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * One sample of the die temperature through channel 1 and of the alarm
+ * register, under the device lock like any Lua method
+ */
+/*
+ * Returns -1 while an async operation, e.g. a reset, owns the pmu
+ */
+static int monitor_sample(lad5522_monitor_t *mon, lad5522_board_t *board,
+        lad5522_sample_t *sample)
+{
+    lad5522_userdata_t su = {.dev = mon->dev, .board = board, .s = board->s,
+        .iio_name = mon->iio_name, .adc = mon->adc};
+    unsigned int mm;
+    int raw;
+
+    device_lock(mon->dev);
+    if (device_op_busy(mon->dev)) {
+        device_unlock(mon->dev);
         return -1;
     }
-    close(fd);
-    /* Write to ldo pin */
-    fd = open(SUP_LDO_EN_NAME, O_WRONLY);
-    if (fd < 0) {
-        perror("can't open sup_ldo_en gpio device");
-        return -1;
+    ad5522_get_measure_mode(board->s, 0, &mm);
+    ad5522_begin(board->s);
+    ad5522_set_gain(board->s, 2);
+    ad5522_set_measure_mode(board->s, 0, MTEMP);
+    if ((ad5522_commit(board->s) < 0) || (adc_read(&su, &raw) < 0))
+        sample->temp = NAN;
+    else
+        sample->temp = raw_to_temperature(raw);
+    ad5522_set_measure_mode(board->s, 0, mm);
+    ad5522_read_alarm_reg(board->s, &sample->alarm);
+    device_unlock(mon->dev);
+    sample->time_us = monitor_now_us();
+    return 0;
+}
+
+static void *monitor_run(void *arg)
+{
+    lad5522_board_t *board = arg;
+    lad5522_monitor_t *mon = board->monitor;
+    lad5522_sample_t sample;
+    unsigned int last_alarm = 0;
+    bool hot = false, raise, skip;
+    struct timespec deadline;
+    uint64_t head;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    pthread_mutex_lock(&mon->lock);
+    while (!mon->stop) {
+        pthread_mutex_unlock(&mon->lock);
+        /* periods during an async operation are skipped */
+        skip = monitor_sample(mon, board, &sample) < 0;
+        if (!skip) {
+            head = __atomic_load_n(&mon->head, __ATOMIC_RELAXED);
+            mon->ring[head % MONITOR_HISTORY] = sample;
+            __atomic_store_n(&mon->head, head + 1, __ATOMIC_RELEASE);
+        }
+
+        pthread_mutex_lock(&mon->lock);
+        /* alarms are raised on new alarm bits and on crossing the limit */
+        raise = !skip && ((sample.alarm & ~last_alarm) != 0);
+        if (!skip)
+            last_alarm = sample.alarm;
+        if (!skip && !isnan(mon->temp_limit) && !isnan(sample.temp)) {
+            raise |= !hot && (sample.temp > mon->temp_limit);
+            hot = sample.temp > mon->temp_limit;
+        }
+        if (raise) {
+            __atomic_add_fetch(&mon->alarms, 1, __ATOMIC_RELEASE);
+            device_notify(mon->dev);
+        }
+        deadline.tv_sec += (time_t)mon->period;
+        deadline.tv_nsec += (long)((mon->period - (time_t)mon->period) * 1e9);
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!mon->stop && (pthread_cond_timedwait(&mon->wake, &mon->lock, &deadline) == 0))
+            ;
     }
-    if (write(fd, (sup & 0x8) ? "1" : "0", 1) < 0) {
-        perror("can't write to sup_ldo_en gpio device");
-        close(fd);
-        return -1;
+    pthread_mutex_unlock(&mon->lock);
+    return NULL;
+}
+
+static lad5522_monitor_t *monitor_new(lad5522_userdata_t *su)
+{
+    lad5522_monitor_t *mon = (lad5522_monitor_t *)calloc(1, sizeof(lad5522_monitor_t));
+    pthread_condattr_t attr;
+
+    if (mon == NULL)
+        return NULL;
+    pthread_mutex_init(&mon->lock, NULL);
+    /* deadlines are on the monotonic clock */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mon->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    mon->dev = su->dev;
+    mon->adc = su->adc;
+    mon->iio_name = strdup(su->iio_name);
+    mon->temp_limit = NAN;
+    return mon;
+}
+
+/*
+ * Stops the thread and waits for it. The thread takes the device lock, so
+ * the caller must not hold it.
+ */
+static void monitor_stop(lad5522_monitor_t *mon)
+{
+    pthread_mutex_lock(&mon->lock);
+    mon->stop = true;
+    pthread_cond_signal(&mon->wake);
+    pthread_mutex_unlock(&mon->lock);
+    if (mon->started)
+        pthread_join(mon->thread, NULL);
+    mon->started = false;
+}
+
+static void monitor_destroy(lad5522_monitor_t **mon_p)
+{
+    lad5522_monitor_t *mon = *mon_p;
+
+    if (mon == NULL)
+        return;
+    monitor_stop(mon);
+    pthread_cond_destroy(&mon->wake);
+    pthread_mutex_destroy(&mon->lock);
+    free(mon->iio_name);
+    free(mon);
+    *mon_p = NULL;
+}
+
+/*
+ * Device event handler of a Lua state, signals 'pmu_alarm' if the monitor
+ * raised alarms since it ran last
+ */
+static int monitor_handler(lua_State *L)
+{
+    lad5522_userdata_t *su = (lad5522_userdata_t *)lua_touserdata(L, lua_upvalueindex(1));
+    uint64_t alarms;
+
+    if ((su->board == NULL) || (su->board->monitor == NULL))
+        return 0;
+    alarms = __atomic_load_n(&su->board->monitor->alarms, __ATOMIC_ACQUIRE);
+    if ((lua_Integer)alarms == lua_tointeger(L, lua_upvalueindex(2)))
+        return 0;
+    lua_pushinteger(L, alarms);
+    lua_replace(L, lua_upvalueindex(2));
+    lua_getglobal(L, "signal");
+    lua_pushstring(L, "pmu_alarm");
+    lua_call(L, 1, 0);
+    return 0;
+}
+
+/** start_monitor
+ * \brief: samples die temperature and alarm register in the background
+ * \param rate samples per second, optional, default 10
+ * \param temp_limit temperature in degree celsius above which an alarm is
+ * raised, optional
+ *
+ * New alarm register bits and crossing the temperature limit raise
+ * signal('pmu_alarm') in every Lua state that started the monitor.
+ */
+static int lad5522_start_monitor(lua_State *L)
+{
+    lad5522_userdata_t *su;
+    lad5522_monitor_t *mon;
+    double rate, temp_limit;
+    char *key;
+
+    su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
+    rate = luaL_optnumber(L, 2, 10.0);
+    temp_limit = luaL_optnumber(L, 3, NAN);
+    luaL_argcheck(L, (rate > 0.0) && (rate <= MONITOR_MAX_RATE), 2, "rate out of range");
+
+    if (su->board->monitor == NULL) {
+        su->board->monitor = monitor_new(su);
+        if (su->board->monitor == NULL)
+            return luaL_error(L, "can't create pmu monitor");
     }
-    close(fd);
-    /* Is it lo range? */
-    fd = open(SUP_LO_NAME, O_WRONLY);
-    if (fd < 0) {
-        perror("can't open sup_lo gpio device");
-        return -1;
+    mon = su->board->monitor;
+    pthread_mutex_lock(&mon->lock);
+    mon->period = 1.0 / rate;
+    mon->temp_limit = temp_limit;
+    pthread_mutex_unlock(&mon->lock);
+    if (!mon->started) {
+        mon->stop = false;
+        if (pthread_create(&mon->thread, NULL, monitor_run, su->board) != 0)
+            return luaL_error(L, "can't start pmu monitor");
+        mon->started = true;
     }
-    if (write(fd, (sup & 0x4) ? "1" : "0", 1) < 0) {
-        perror("can't write to sup_lo gpio device");
-        close(fd);
-        return -1;
+    /* states whose actor doesn't poll device events only get the history */
+    if ((su->events == NULL) && ((su->events = device_events_get(L)) != NULL)) {
+        if (device_subscribe(su->dev, su->events) < 0) {
+            su->events = NULL;
+            return luaL_error(L, "too many Lua states watch the pmu");
+        }
+        if (asprintf(&key, "ad5522:%s", su->spi_name) >= 0) {
+            lua_pushvalue(L, 1);
+            lua_pushinteger(L, __atomic_load_n(&mon->alarms, __ATOMIC_ACQUIRE));
+            lua_pushcclosure(L, monitor_handler, 2);
+            device_events_set_handler(L, key);
+            free(key);
+        }
     }
-    close(fd);
-    /* Is it mid range? */
-    fd = open(SUP_MID_NAME, O_WRONLY);
-    if (fd < 0) {
-        perror("can't open sup_mid gpio device");
-        return -1;
+    return 0;
+}
+
+/** stop_monitor
+ * \brief: stops the background monitor of the board, the history is kept
+ */
+static int lad5522_stop_monitor(lua_State *L)
+{
+    lad5522_userdata_t *su;
+
+    su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
+    if ((su->board->monitor == NULL) || !su->board->monitor->started)
+        return 0;
+    /* the thread may be waiting for the lock this method runs under */
+    device_unlock(su->dev);
+    monitor_stop(su->board->monitor);
+    device_lock(su->dev);
+    return 0;
+}
+
+/** monitor_history
+ * \brief: recent samples of the background monitor
+ * \param n the number of samples, optional, default all that are kept
+ * \return a sequence of {t = seconds, temp = degree celsius, alarm = register},
+ * oldest first
+ */
+static int lad5522_monitor_history(lua_State *L)
+{
+    lad5522_userdata_t *su;
+    lad5522_monitor_t *mon;
+    lad5522_sample_t *copy;
+    uint64_t head, first, valid, k;
+    lua_Integer n;
+    int i;
+
+    su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
+    n = luaL_optinteger(L, 2, MONITOR_HISTORY);
+    luaL_argcheck(L, n > 0, 2, "sample count out of range");
+    mon = su->board->monitor;
+    if (mon == NULL) {
+        lua_newtable(L);
+        return 1;
     }
-    if (write(fd, (sup & 0x2) ? "1" : "0", 1) < 0) {
-        perror("can't write to sup_mid gpio device");
-        close(fd);
-        return -1;
+    if (n > MONITOR_HISTORY)
+        n = MONITOR_HISTORY;
+    copy = (lad5522_sample_t *)lua_newuserdata(L, n * sizeof(lad5522_sample_t));
+    head = __atomic_load_n(&mon->head, __ATOMIC_ACQUIRE);
+    first = (head > (uint64_t)n) ? head - n : 0;
+    for (k = first; k < head; k++)
+        copy[k - first] = mon->ring[k % MONITOR_HISTORY];
+    /* samples the writer got to meanwhile may be torn */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    valid = __atomic_load_n(&mon->head, __ATOMIC_RELAXED);
+    valid = (valid > MONITOR_HISTORY) ? valid - MONITOR_HISTORY + 1 : 0;
+    if (valid < first)
+        valid = first;
+
+    lua_createtable(L, head - valid, 0);
+    for (k = valid, i = 1; k < head; k++, i++) {
+        lua_createtable(L, 0, 3);
+        lua_pushnumber(L, copy[k - first].time_us / 1e6);
+        lua_setfield(L, -2, "t");
+        lua_pushnumber(L, copy[k - first].temp);
+        lua_setfield(L, -2, "temp");
+        lua_pushinteger(L, copy[k - first].alarm);
+        lua_setfield(L, -2, "alarm");
+        lua_rawseti(L, -2, i);
     }
-    close(fd);
-    /* Is it hi range? */
-    fd = open(SUP_HI_NAME, O_WRONLY);
-    if (fd < 0) {
-        perror("can't open sup_hi gpio device");
-        return -1;
+    return 1;
+}
+
+static int lad5522_get_channel_count(lua_State *L)
+{
+    lad5522_userdata_t *su;
+    su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
+    lua_pushinteger(L, AD5522_CHANNEL_NUM);
+    return 1;
+}
+
+static int set_supply_rail(lad5522_board_t *board, int range_id)
+{
+    int sup, range;
+
+    sup = 0;
+    switch(range_id) {
+        case 1: sup = 0x1c; range = 1; break; /* -19.5V...+11.5V, enable dcdc + ldo */
+        case 2: sup = 0x1a; range = 2;break; /* -16.5V...+16.5V, enable dcdc + ldo */
+        case 3: sup = 0x19; range = 3;break; /* -11.5V...+19.5V, enable dcdc + ldo */
+        default: sup = 0; range = 0; break;   /* off, disable dcdc + ldo */
     }
-    if (write(fd, (sup & 0x1) ? "1" : "0", 1) < 0) {
-        perror("can't write to sup_hi gpio device");
-        close(fd);
+    /* one ioctl per gpio chip sets dcdc, ldo and the range selection */
+    if (gpio_lines_set(board->gpio, SUP_RAIL_MASK, sup) < 0) {
+        /* some chips may have switched, the rail is known only if all did */
+        sup = gpio_lines_get(board->gpio) & SUP_RAIL_MASK;
+        board->supply_rail = (sup == 0x1c) ? SUP_LO_RANGE : (sup == 0x1a) ? SUP_MID_RANGE
+            : (sup == 0x19) ? SUP_HI_RANGE : SUP_OFF;
         return -1;
     }
-    close(fd);
-
+    board->supply_rail = range;
     return 0;
 }
 
@@ -758,12 +1714,11 @@ static int lad5522_set_supply_rail(lua_State *L)
     lad5522_userdata_t *su;
     su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
     range_id = luaL_checkinteger(L, 2);
-    if (set_supply_rail(range_id) < 0) {
+    if (set_supply_rail(su->board, range_id) < 0)
         perror("can't set supply rails");
-        return 0;
-    }
-    /* set offset dac level */
-    ad5522_set_offset(su->s, voltage_range_offset_dac_tbl[range_id]);
+    /* set offset dac level, for the rail the lines ended up at */
+    ad5522_set_offset(su->s, voltage_range_offset_dac_tbl[get_supply_rail(su->board)]);
+    ad5522_set_calibration_rail(su->s, get_supply_rail(su->board));
 
     return 0;
 }
@@ -773,7 +1728,7 @@ static int lad5522_get_supply_rail(lua_State *L)
     lad5522_userdata_t *su;
     su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
 
-    lua_pushinteger(L, get_supply_rail());
+    lua_pushinteger(L, get_supply_rail(su->board));
     return 1;
 }
 
@@ -805,7 +1760,7 @@ static int lad5522_get_min_voltage(lua_State *L)
     lad5522_userdata_t *su;
     su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
 
-    lua_pushnumber(L, voltage_range_min_uv_tbl[get_supply_rail()]/1.0e6);
+    lua_pushnumber(L, voltage_range_min_uv_tbl[get_supply_rail(su->board)]/1.0e6);
     return 1;
 }
 
@@ -814,15 +1769,15 @@ static int lad5522_get_max_voltage(lua_State *L)
     lad5522_userdata_t *su;
     su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
 
-    lua_pushnumber(L, voltage_range_max_uv_tbl[get_supply_rail()]/1.0e6);
+    lua_pushnumber(L, voltage_range_max_uv_tbl[get_supply_rail(su->board)]/1.0e6);
     return 1;
 }
 
 static int lad5522_new(lua_State *L)
 {
     lad5522_userdata_t *su;
-    int spi_dev_num, spi_cs_num, iio_dev_num, gpio_rst_num;
-    char *spi_dev_name, *iio_dev_name, *gpio_rst_dev_name;
+    int spi_dev_num, spi_cs_num, iio_dev_num, gpio_rst_num, i;
+    char *spi_dev_name, *iio_dev_name, *iio_chr_name, *gpio_rst_dev_name;
 
     /* Check the arguments are valid. */
     spi_dev_num  = luaL_checkinteger(L, 1);
@@ -834,8 +1789,13 @@ static int lad5522_new(lua_State *L)
      * the member of the userdata in case initialization fails in some way. If
      * that happens we want the userdata to be in a consistent state for __gc. */
     su       = (lad5522_userdata_t *)lua_newuserdata(L, sizeof(*su));
+    su->dev  = NULL;
+    su->board = NULL;
     su->s    = NULL;
     su->spi_name = NULL;
+    su->iio_name = NULL;
+    su->adc  = NULL;
+    su->events = NULL;
 
     /* Add the metatable to the stack. */
     luaL_getmetatable(L, "Lad5522");
@@ -847,12 +1807,47 @@ static int lad5522_new(lua_State *L)
     asprintf(&iio_dev_name, "/sys/bus/iio/devices/iio:device%d", iio_dev_num);
     su->spi_name = strdup(spi_dev_name);
     su->iio_name = strdup(iio_dev_name);
-    /* turn on supply rails for the device */
-    set_supply_rail(SUP_MID_RANGE);
-    /* reset the device */
-    reset();
-
-    su->s    = ad5522_create(spi_dev_name);
+    /* the pmu is shared by all Lua states, only the first one brings it up */
+    su->dev  = device_claim(spi_dev_name);
+    if (su->dev == NULL)
+        return luaL_error(L, "can't claim device %s", spi_dev_name);
+    device_lock(su->dev);
+    su->board = device_handle(su->dev);
+    if (su->board == NULL) {
+        su->board = (lad5522_board_t *)calloc(1, sizeof(lad5522_board_t));
+        if (su->board != NULL)
+            su->board->gpio = gpio_lines_create("ad5522", pmu_gpio_lines,
+                    sizeof(pmu_gpio_lines) / sizeof(pmu_gpio_lines[0]));
+        if ((su->board == NULL) || (su->board->gpio == NULL)) {
+            free(su->board);
+            su->board = NULL;
+            device_unlock(su->dev);
+            free(spi_dev_name);
+            free(iio_dev_name);
+            return luaL_error(L, "can't request pmu gpio lines");
+        }
+        for (i = 0; i < AD5522_CHANNEL_NUM; i++)
+            su->board->last_range[i] = -1;
+        /* turn on supply rails for the device */
+        set_supply_rail(su->board, SUP_MID_RANGE);
+        /* reset the device */
+        reset(su->board);
+
+        su->board->s = ad5522_create(spi_dev_name);
+        if (su->board->s != NULL)
+            ad5522_set_calibration_rail(su->board->s, get_supply_rail(su->board));
+        device_set_handle(su->dev, su->board);
+    }
+    su->s    = su->board->s;
+    /* the character device can only be opened once per process */
+    asprintf(&iio_chr_name, "/dev/iio:device%d", iio_dev_num);
+    su->adc  = device_claim(iio_chr_name);
+    if ((su->adc != NULL) && (device_handle(su->adc) == NULL))
+        device_set_handle(su->adc, iio_buffer_create(iio_dev_num, 0));
+    device_unlock(su->dev);
+    free(spi_dev_name);
+    free(iio_dev_name);
+    free(iio_chr_name);
     return 1;
 }
 
@@ -862,17 +1857,48 @@ static int lad5522_destroy(lua_State *L)
 
     su = (lad5522_userdata_t *)luaL_checkudata(L, 1, "Lad5522");
 
-    ad5522_set_all_output_state(su->s, PMU_CHANNEL_OFF);
-    /* turn off supply rails for the device */
-    set_supply_rail(SUP_OFF);
-    if (su->s != NULL)
-        ad5522_destroy(&(su->s));
+    if (su->dev != NULL) {
+        device_op_cancel(su->dev, su);
+        if (su->events != NULL)
+            device_unsubscribe(su->dev, su->events);
+        su->events = NULL;
+        /* the monitor thread takes the device lock, stop it before */
+        if ((su->board != NULL) && (device_refs(su->dev) == 1))
+            monitor_destroy(&su->board->monitor);
+        device_lock(su->dev);
+        if (su->adc != NULL) {
+            if (device_refs(su->adc) == 1) {
+                iio_buffer_t *buf = device_handle(su->adc);
+                iio_buffer_destroy(&buf);
+                device_set_handle(su->adc, NULL);
+            }
+            device_release(&(su->adc));
+        }
+        /* the last user powers the pmu down */
+        if ((device_refs(su->dev) == 1) && (su->board != NULL)) {
+            if (su->s != NULL)
+                ad5522_set_all_output_state(su->s, PMU_CHANNEL_OFF);
+            /* turn off supply rails for the device */
+            set_supply_rail(su->board, SUP_OFF);
+            ad5522_destroy(&(su->board->s));
+            gpio_lines_destroy(&(su->board->gpio));
+            free(su->board);
+            device_set_handle(su->dev, NULL);
+        }
+        device_unlock(su->dev);
+        device_release(&(su->dev));
+    }
+    su->board = NULL;
     su->s = NULL;
 
     if (su->spi_name != NULL)
         free(su->spi_name);
     su->spi_name = NULL;
 
+    if (su->iio_name != NULL)
+        free(su->iio_name);
+    su->iio_name = NULL;
+
     return 0;
 }
 
@@ -882,12 +1908,19 @@ static const luaL_Reg lad5522_methods[] = {
     {"get_current_range", lad5522_get_current_range},
     {"set_output", lad5522_set_output},
     {"measure", lad5522_measure},
+    {"measure_auto", lad5522_measure_auto},
+    {"capture", lad5522_capture},
+    {"sweep", lad5522_sweep},
     {"set_voltage", lad5522_set_voltage},
     {"set_current", lad5522_set_current},
     {"turn_on", lad5522_turn_on},
     {"turn_off", lad5522_turn_off},
     {"turn_all_on", lad5522_turn_all_on},
     {"turn_all_off", lad5522_turn_all_off},
+    {"turn_group_on", lad5522_turn_group_on},
+    {"turn_group_off", lad5522_turn_group_off},
+    {"set_group_output", lad5522_set_group_output},
+    {"set_group_range", lad5522_set_group_range},
     {"set_force_mode", lad5522_set_force_mode},
     {"set_measure_mode", lad5522_set_measure_mode},
     {"get_channel_count", lad5522_get_channel_count},
@@ -902,9 +1935,19 @@ static const luaL_Reg lad5522_methods[] = {
     {"read_alarm_reg", lad5522_read_alarm_reg},
     {"read_comp_reg", lad5522_read_comp_reg},
     {"read_dac_x1", lad5522_read_dac_x1},
+    {"verify", lad5522_verify},
+    {"start_monitor", lad5522_start_monitor},
+    {"stop_monitor", lad5522_stop_monitor},
+    {"monitor_history", lad5522_monitor_history},
+    {"load_calibration", lad5522_load_calibration},
+    {"__gc", lad5522_destroy},
+    {NULL, NULL}
+};
+
+/* Methods that yield, not serialized through the device lock trampoline */
+static const luaL_Reg lad5522_async_methods[] = {
     {"reset", lad5522_reset},
     {"configure", lad5522_configure},
-    {"__gc", lad5522_destroy},
     {NULL, NULL}
 };
 
@@ -926,8 +1969,11 @@ int luaopen_ad5522(lua_State *L){
      */
     lua_setfield(L, -2, "__index");
 
-    /* Set the methods to the metatable that should be accessed via object:func */
-    luaL_setfuncs(L, lad5522_methods, 0);
+    /* Set the methods to the metatable that should be accessed via object:func,
+     * calls from different Lua states are serialized on the device lock */
+    device_setfuncs(L, "Lad5522", lad5522_methods);
+    /* waits yield, they can't run under the device lock */
+    device_setfuncs_async(L, lad5522_async_methods);
 
     /* Register the object.func functions into the table that is at the top of the
      *      * stack. */
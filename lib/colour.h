@@ -0,0 +1,15 @@
+#ifndef _COLOUR_H_
+#define _COLOUR_H_
+#include <stddef.h>
+
+/* Outputs of the colour kernel, one array each: calibrated CIE 1931 XYZ,
+ * chromaticity xy, CIE 1976 u'v' and the correlated colour temperature */
+enum {COLOUR_X, COLOUR_Y, COLOUR_Z, COLOUR_XC, COLOUR_YC, COLOUR_U, COLOUR_V,
+    COLOUR_CCT, COLOUR_NUM};
+
+/*
+ * Raw r[0..2][n] through the 3-by-3 row major matrix m to the outputs, n
+ * samples at once. Zero sums give NaN.
+ */
+void colour_kernel(const double *m, double *const r[3], double *const out[COLOUR_NUM], size_t n);
+#endif
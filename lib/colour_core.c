@@ -0,0 +1,43 @@
+/* File: colour_core.c
+ *
+ * Colour calculations on calibrated sensor data, see colour.h
+ */
+
+#include <stddef.h>
+
+#include "colour.h"
+
+/*
+ * Works on structure of arrays. Every output is its own loop without
+ * branches, so the compiler can vectorize them. CCT after McCamy.
+ */
+void colour_kernel(const double *m, double *const r[3], double *const out[COLOUR_NUM], size_t n)
+{
+    const double *restrict r0 = r[0], *restrict r1 = r[1], *restrict r2 = r[2];
+    double *restrict X = out[COLOUR_X], *restrict Y = out[COLOUR_Y], *restrict Z = out[COLOUR_Z];
+    double *restrict xc = out[COLOUR_XC], *restrict yc = out[COLOUR_YC];
+    double *restrict u = out[COLOUR_U], *restrict v = out[COLOUR_V];
+    double *restrict cct = out[COLOUR_CCT];
+    double sum, d, k;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        X[i] = m[0] * r0[i] + m[1] * r1[i] + m[2] * r2[i];
+        Y[i] = m[3] * r0[i] + m[4] * r1[i] + m[5] * r2[i];
+        Z[i] = m[6] * r0[i] + m[7] * r1[i] + m[8] * r2[i];
+    }
+    for (i = 0; i < n; i++) {
+        sum = X[i] + Y[i] + Z[i];
+        xc[i] = X[i] / sum;
+        yc[i] = Y[i] / sum;
+    }
+    for (i = 0; i < n; i++) {
+        d = X[i] + 15.0 * Y[i] + 3.0 * Z[i];
+        u[i] = 4.0 * X[i] / d;
+        v[i] = 9.0 * Y[i] / d;
+    }
+    for (i = 0; i < n; i++) {
+        k = (xc[i] - 0.3320) / (0.1858 - yc[i]);
+        cct[i] = ((449.0 * k + 3525.0) * k + 6823.3) * k + 5520.33;
+    }
+}
@@ -0,0 +1,466 @@
+/* File: device.c
+ *
+ * Device ownership layer, allows several Lua states (tracks workers) to
+ * share one driver instance per physical device.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "device.h"
+
+/* Lua states that can watch a device at once */
+#define DEVICE_SUBSCRIBERS 16
+
+struct _device_events_t {
+    int fd; /* eventfd, readable while events are pending */
+};
+
+struct _device_t {
+    char *name; /* unique device name, e.g. the spidev path */
+    void *handle; /* driver handle shared by all users */
+    int refs; /* number of users holding a claim */
+    pthread_mutex_t lock; /* serializes device access, recursive */
+    bool op_busy; /* an async operation owns the device, under lock */
+    pthread_t op_owner; /* thread running the operation */
+    const void *op_tag; /* driver userdata that started it */
+    device_events_t *events[DEVICE_SUBSCRIBERS]; /* of the states watching, under devices_lock */
+    int event_refs[DEVICE_SUBSCRIBERS];
+    device_t *next;
+};
+
+/*
+ * Registry fields of the events and the handlers of a Lua state. Drivers
+ * built as modules carry their own copy of this file, so the keys are
+ * strings rather than addresses.
+ */
+#define DEVICE_EVENTS_KEY "device.events"
+#define DEVICE_HANDLERS_KEY "device.handlers"
+
+/* Poll interval while an async operation owns a device */
+#define DEVICE_RETRY_NS 1000000
+/* waitSeconds counts in track time, which the scheduler keeps in milliseconds */
+#define DEVICE_TRACK_UNITS_PER_SECOND 1000.0
+
+static device_t *devices = NULL;
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Returns the registry entry for name, creates it on first use.
+ * The driver handle is NULL until the first claimer sets it.
+ */
+device_t * device_claim(const char *name)
+{
+    device_t *self;
+    pthread_mutexattr_t attr;
+
+    pthread_mutex_lock(&devices_lock);
+    for (self = devices; self != NULL; self = self->next) {
+        if (strcmp(self->name, name) == 0)
+            break;
+    }
+    if (self == NULL) {
+        self = (device_t *) calloc(1, sizeof (device_t));
+        if (self == NULL) {
+            pthread_mutex_unlock(&devices_lock);
+            return NULL;
+        }
+        self->name = strdup(name);
+        /* a locked method may trigger __gc of another object of the device */
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&self->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        self->next = devices;
+        devices = self;
+    }
+    self->refs++;
+    pthread_mutex_unlock(&devices_lock);
+    return self;
+}
+
+/*
+ * Drops a claim, the entry is removed with the last claim. The last user
+ * has to destroy the driver handle before.
+ */
+void device_release(device_t **self_p)
+{
+    device_t **link;
+
+    assert (self_p);
+    if (*self_p) {
+        device_t *self = *self_p;
+        pthread_mutex_lock(&devices_lock);
+        if (--self->refs == 0) {
+            for (link = &devices; *link != NULL; link = &(*link)->next) {
+                if (*link == self) {
+                    *link = self->next;
+                    break;
+                }
+            }
+            pthread_mutex_destroy(&self->lock);
+            free(self->name);
+            free(self);
+        }
+        pthread_mutex_unlock(&devices_lock);
+        *self_p = NULL;
+    }
+}
+
+int device_refs(device_t *self)
+{
+    int refs;
+
+    pthread_mutex_lock(&devices_lock);
+    refs = self->refs;
+    pthread_mutex_unlock(&devices_lock);
+    return refs;
+}
+
+void * device_handle(device_t *self)
+{
+    return self->handle;
+}
+
+void device_set_handle(device_t *self, void *handle)
+{
+    self->handle = handle;
+}
+
+void device_lock(device_t *self)
+{
+    pthread_mutex_lock(&self->lock);
+}
+
+void device_unlock(device_t *self)
+{
+    pthread_mutex_unlock(&self->lock);
+}
+
+/*
+ * Waits with the lock held until no async operation of another thread owns
+ * the device. One of the calling thread can't end meanwhile, returns -1.
+ */
+static int device_wait_idle(device_t *self)
+{
+    const struct timespec retry = {.tv_sec = 0, .tv_nsec = DEVICE_RETRY_NS};
+
+    while (self->op_busy) {
+        if (pthread_equal(self->op_owner, pthread_self()))
+            return -1;
+        device_unlock(self);
+        nanosleep(&retry, NULL);
+        device_lock(self);
+    }
+    return 0;
+}
+
+/*
+ * L runs in a coroutine the scheduler resumes after a waitSeconds
+ */
+static bool device_can_yield(lua_State *L)
+{
+    bool can_yield;
+
+    if (!lua_isyieldable(L))
+        return false;
+    lua_getglobal(L, "waitSeconds");
+    can_yield = lua_isfunction(L, -1);
+    lua_pop(L, 1);
+    return can_yield;
+}
+
+/*
+ * Calls the method in upvalue 1 with the device lock held. The lock is
+ * released before an error is propagated. While an async operation owns
+ * the device a coroutine yields and tries again, so the operation, maybe
+ * of another coroutine of the same thread, can go on. Elsewhere the call
+ * waits for it, unless the operation runs in a coroutine of the same
+ * thread.
+ */
+static int device_locked_call_k(lua_State *L, int status, lua_KContext ctx)
+{
+    device_t **ud, *dev = NULL;
+
+    (void)status;
+    /* userdata of device drivers start with their device_t pointer */
+    ud = (device_t **)luaL_testudata(L, 1, lua_tostring(L, lua_upvalueindex(2)));
+    if (ud)
+        dev = *ud;
+    if (dev) {
+        device_lock(dev);
+        if (dev->op_busy && device_can_yield(L)) {
+            device_unlock(dev);
+            return device_wait(L, DEVICE_RETRY_NS / 1e9, ctx, device_locked_call_k);
+        }
+        if (device_wait_idle(dev) < 0) {
+            device_unlock(dev);
+            return luaL_error(L, "device %s is busy", dev->name);
+        }
+    }
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+    if (dev)
+        device_unlock(dev);
+    if (status != LUA_OK)
+        return lua_error(L);
+    return lua_gettop(L);
+}
+
+static int device_locked_call(lua_State *L)
+{
+    return device_locked_call_k(L, LUA_OK, 0);
+}
+
+/*
+ * Like luaL_setfuncs, but every method is serialized on the device lock of
+ * the userdata it is called on. The userdata of metatable tname must start
+ * with a device_t pointer. __gc is registered as is, it has to handle the
+ * lock itself since it may release the device.
+ */
+void device_setfuncs(lua_State *L, const char *tname, const luaL_Reg *l)
+{
+    for (; l->name != NULL; l++) {
+        if (strcmp(l->name, "__gc") == 0) {
+            lua_pushcfunction(L, l->func);
+        } else {
+            lua_pushcfunction(L, l->func);
+            lua_pushstring(L, tname);
+            lua_pushcclosure(L, device_locked_call, 2);
+        }
+        lua_setfield(L, -2, l->name);
+    }
+}
+
+device_events_t * device_events_new(void)
+{
+    device_events_t *self = (device_events_t *) calloc(1, sizeof (device_events_t));
+
+    if (self == NULL)
+        return NULL;
+    self->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (self->fd < 0) {
+        free(self);
+        return NULL;
+    }
+    return self;
+}
+
+/*
+ * Destructor, drivers must not post to the events any more
+ */
+void device_events_destroy(device_events_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        device_events_t *self = *self_p;
+        close(self->fd);
+        free(self);
+        *self_p = NULL;
+    }
+}
+
+int device_events_fd(device_events_t *self)
+{
+    return self->fd;
+}
+
+void device_events_attach(device_events_t *self, lua_State *L)
+{
+    lua_pushlightuserdata(L, self);
+    lua_setfield(L, LUA_REGISTRYINDEX, DEVICE_EVENTS_KEY);
+}
+
+/*
+ * Events of the Lua state, NULL if its actor doesn't poll for events
+ */
+device_events_t * device_events_get(lua_State *L)
+{
+    device_events_t *self;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, DEVICE_EVENTS_KEY);
+    self = (device_events_t *) lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return self;
+}
+
+void device_events_post(device_events_t *self)
+{
+    uint64_t one = 1;
+
+    /* a full counter still wakes the reader */
+    if (write(self->fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+/*
+ * Runs all handlers once, returns the number of handlers that failed
+ */
+int device_events_dispatch(device_events_t *self, lua_State *L)
+{
+    uint64_t count;
+    int errors = 0;
+
+    if (read(self->fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+    lua_getfield(L, LUA_REGISTRYINDEX, DEVICE_HANDLERS_KEY);
+    if (lua_istable(L, -1)) {
+        lua_pushnil(L);
+        while (lua_next(L, -2) != 0) {
+            if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+                lua_pop(L, 1);
+                errors++;
+            }
+        }
+    }
+    lua_pop(L, 1);
+    return errors;
+}
+
+void device_events_set_handler(lua_State *L, const char *key)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, DEVICE_HANDLERS_KEY);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, DEVICE_HANDLERS_KEY);
+    }
+    lua_insert(L, -2);
+    lua_setfield(L, -2, key);
+    lua_pop(L, 1);
+}
+
+/*
+ * Adds a reference of the events to the device, device_notify posts to
+ * every subscribed events. Returns -1 if there are too many subscribers.
+ */
+int device_subscribe(device_t *self, device_events_t *events)
+{
+    int i, slot = -1;
+
+    pthread_mutex_lock(&devices_lock);
+    for (i = 0; i < DEVICE_SUBSCRIBERS; i++) {
+        if (self->events[i] == events) {
+            slot = i;
+            break;
+        }
+        if ((slot < 0) && (self->events[i] == NULL))
+            slot = i;
+    }
+    if (slot >= 0) {
+        self->events[slot] = events;
+        self->event_refs[slot]++;
+    }
+    pthread_mutex_unlock(&devices_lock);
+    return slot < 0? -1: 0;
+}
+
+void device_unsubscribe(device_t *self, device_events_t *events)
+{
+    int i;
+
+    pthread_mutex_lock(&devices_lock);
+    for (i = 0; i < DEVICE_SUBSCRIBERS; i++)
+        if ((self->events[i] == events) && (--self->event_refs[i] == 0))
+            self->events[i] = NULL;
+    pthread_mutex_unlock(&devices_lock);
+}
+
+void device_notify(device_t *self)
+{
+    int i;
+
+    pthread_mutex_lock(&devices_lock);
+    for (i = 0; i < DEVICE_SUBSCRIBERS; i++)
+        if (self->events[i] != NULL)
+            device_events_post(self->events[i]);
+    pthread_mutex_unlock(&devices_lock);
+}
+
+/*
+ * Takes the device for an async operation, with the lock held. Fails while
+ * another operation owns it.
+ */
+int device_op_begin(device_t *self, const void *tag)
+{
+    if (self->op_busy)
+        return -1;
+    self->op_busy = true;
+    self->op_owner = pthread_self();
+    self->op_tag = tag;
+    return 0;
+}
+
+void device_op_end(device_t *self)
+{
+    self->op_busy = false;
+    self->op_tag = NULL;
+}
+
+/*
+ * Ends the operation started with tag, if any. A coroutine that is never
+ * resumed again leaves its operation behind, the driver drops it when the
+ * userdata is collected.
+ */
+void device_op_cancel(device_t *self, const void *tag)
+{
+    device_lock(self);
+    if (self->op_busy && (self->op_tag == tag))
+        device_op_end(self);
+    device_unlock(self);
+}
+
+bool device_op_busy(device_t *self)
+{
+    return self->op_busy;
+}
+
+int device_wait(lua_State *L, double seconds, lua_KContext ctx, lua_KFunction k)
+{
+    struct timespec ts;
+
+    /* methods called through lua_pcall, e.g. the lock trampoline, can't yield */
+    if (device_can_yield(L)) {
+        lua_getglobal(L, "waitSeconds");
+        lua_pushnumber(L, seconds * DEVICE_TRACK_UNITS_PER_SECOND);
+        lua_callk(L, 1, 0, ctx, k);
+        return k(L, LUA_OK, ctx);
+    }
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+    return k(L, LUA_OK, ctx);
+}
+
+int device_retry(lua_State *L, device_t *self, lua_KContext ctx, lua_KFunction k)
+{
+    int idle;
+
+    /* a sleeping retry would not let the owner go on */
+    if (device_can_yield(L))
+        return device_wait(L, DEVICE_RETRY_NS / 1e9, ctx, k);
+    device_lock(self);
+    idle = device_wait_idle(self);
+    device_unlock(self);
+    if (idle < 0)
+        return luaL_error(L, "device %s is busy", self->name);
+    return k(L, LUA_OK, ctx);
+}
+
+void device_setfuncs_async(lua_State *L, const luaL_Reg *l)
+{
+    for (; l->name != NULL; l++) {
+        lua_pushcfunction(L, l->func);
+        lua_setfield(L, -2, l->name);
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef _DEVICE_H_
+#define _DEVICE_H_
+#include <stdbool.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+/*
+ * Process wide registry of hardware devices. Every Lua state that opens a
+ * device claims it by name and shares the driver handle created by the first
+ * claimer. Calls from different Lua states are serialized on the device lock.
+ */
+
+//  Opaque class structures to allow forward references
+typedef struct _device_t device_t;
+
+device_t * device_claim(const char *name);
+void device_release(device_t **self_p);
+int device_refs(device_t *self);
+void * device_handle(device_t *self);
+void device_set_handle(device_t *self, void *handle);
+void device_lock(device_t *self);
+void device_unlock(device_t *self);
+void device_setfuncs(lua_State *L, const char *tname, const luaL_Reg *l);
+
+/*
+ * Device events: driver threads wake the actor running a Lua state without
+ * touching the state. The actor creates the events of its state, attaches
+ * them and polls their fd. Any thread may post, the actor then calls
+ * device_events_dispatch, which runs the handlers registered on the state
+ * with device_events_set_handler.
+ */
+typedef struct _device_events_t device_events_t;
+
+device_events_t * device_events_new(void);
+void device_events_destroy(device_events_t **self_p);
+int device_events_fd(device_events_t *self);
+void device_events_attach(device_events_t *self, lua_State *L);
+device_events_t * device_events_get(lua_State *L);
+void device_events_post(device_events_t *self);
+int device_events_dispatch(device_events_t *self, lua_State *L);
+/* Pops a function, or nil to remove the handler, and registers it as key */
+void device_events_set_handler(lua_State *L, const char *key);
+/* Events of the Lua states watching a device, counted per subscription */
+int device_subscribe(device_t *self, device_events_t *events);
+void device_unsubscribe(device_t *self, device_events_t *events);
+void device_notify(device_t *self);
+
+/*
+ * Async operations: a method that waits for the hardware is split into
+ * phases chained by continuations. Each phase takes the device lock
+ * itself, device_op_begin keeps other callers out across the waits.
+ * device_wait waits the given time in seconds and runs the next phase.
+ * Inside a coroutine it yields through waitSeconds, converted to track time
+ * (milliseconds), so other tracks run until the
+ * scheduler resumes it, elsewhere it sleeps. device_retry waits while an
+ * operation of someone else owns the device, then runs k to try again.
+ * The tag, the driver userdata, lets device_op_cancel drop an operation
+ * whose coroutine was abandoned.
+ * Async methods yield, so they are registered with device_setfuncs_async
+ * rather than through the lock trampoline. Methods of the trampoline that
+ * find an operation owning the device yield and retry the same way.
+ */
+int device_op_begin(device_t *self, const void *tag);
+void device_op_end(device_t *self);
+void device_op_cancel(device_t *self, const void *tag);
+bool device_op_busy(device_t *self);
+int device_wait(lua_State *L, double seconds, lua_KContext ctx, lua_KFunction k);
+int device_retry(lua_State *L, device_t *self, lua_KContext ctx, lua_KFunction k);
+void device_setfuncs_async(lua_State *L, const luaL_Reg *l);
+#endif
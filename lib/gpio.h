@@ -0,0 +1,36 @@
+#ifndef _GPIO_LINES_H_
+#define _GPIO_LINES_H_
+
+/*
+ * Output lines on GPIO character devices (/dev/gpiochipN).
+ *
+ * All lines are requested once when the group is created. Lines of the same
+ * chip share one line handle, so setting any number of them takes a single
+ * ioctl per chip. Line i of the group is bit i of the value masks.
+ *
+ * A line is looked up by its name first. Unnamed lines are found by their
+ * sysfs GPIO number, through the label and base of the chip it falls in,
+ * so the numbering of the chips doesn't matter. Lines of a chip that are
+ * exported through sysfs already can't be requested (EBUSY), they are
+ * driven through their sysfs value files instead.
+ */
+
+#define GPIO_LINES_MAX 32
+
+typedef struct {
+    const char *name; /* line name, e.g. from the device tree, or NULL */
+    unsigned int gpio; /* sysfs GPIO number, used if no line has the name */
+    int value; /* value the line is driven to when requested */
+} gpio_line_t;
+
+//  Opaque class structures to allow forward references
+typedef struct _gpio_lines_t gpio_lines_t;
+
+gpio_lines_t *gpio_lines_create(const char *consumer, const gpio_line_t *lines, unsigned int n);
+void gpio_lines_destroy(gpio_lines_t **self_p);
+/* Drive the lines selected by mask to the bits of values. On an error
+ * gpio_lines_get keeps the old values of the chips that failed. */
+int gpio_lines_set(gpio_lines_t *self, unsigned int mask, unsigned int values);
+/* Values the lines are driven to */
+unsigned int gpio_lines_get(gpio_lines_t *self);
+#endif
@@ -0,0 +1,337 @@
+/* File: gpio_core.c
+ *
+ * Output lines on GPIO character devices, see gpio.h
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include "gpio.h"
+
+#define GPIO_DEV_DIR "/dev"
+#define GPIO_SYSFS_DIR "/sys/class/gpio"
+
+typedef struct {
+    unsigned int chip;
+    int fd; /* line handle of all lines of the group on this chip */
+    unsigned int nlines;
+    unsigned int index[GPIO_LINES_MAX]; /* bit in the group of every line */
+    unsigned int offset[GPIO_LINES_MAX]; /* line offset on the chip */
+    /* sysfs value files, if the lines are exported and fd is -1 */
+    int value_fd[GPIO_LINES_MAX];
+} gpio_chip_t;
+
+struct _gpio_lines_t {
+    gpio_chip_t chips[GPIO_LINES_MAX];
+    unsigned int nchips;
+    unsigned int values; /* values the lines are driven to */
+};
+
+static int gpio_chip_open(unsigned int chip)
+{
+    char devname[32];
+
+    snprintf(devname, sizeof(devname), GPIO_DEV_DIR "/gpiochip%u", chip);
+    return open(devname, O_RDONLY);
+}
+
+/*
+ * Calls match on every /dev/gpiochipN until it returns true, returns -1 if
+ * it never does
+ */
+static int gpio_chip_find(bool (*match)(int fd, const void *arg, unsigned int *offset),
+        const void *arg, unsigned int *chip, unsigned int *offset)
+{
+    struct dirent *entry;
+    DIR *d;
+    int fd, ret = -1;
+
+    d = opendir(GPIO_DEV_DIR);
+    if (d == NULL)
+        return -1;
+    while ((ret < 0) && ((entry = readdir(d)) != NULL)) {
+        if (sscanf(entry->d_name, "gpiochip%u", chip) != 1)
+            continue;
+        fd = gpio_chip_open(*chip);
+        if (fd < 0)
+            continue;
+        if (match(fd, arg, offset))
+            ret = 0;
+        close(fd);
+    }
+    closedir(d);
+    return ret;
+}
+
+static bool gpio_match_name(int fd, const void *arg, unsigned int *offset)
+{
+    struct gpiochip_info chip_info;
+    struct gpioline_info line_info;
+    unsigned int i;
+
+    if (ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &chip_info) < 0)
+        return false;
+    for (i = 0; i < chip_info.lines; i++) {
+        memset(&line_info, 0, sizeof(line_info));
+        line_info.line_offset = i;
+        if (ioctl(fd, GPIO_GET_LINEINFO_IOCTL, &line_info) < 0)
+            continue;
+        if (strcmp(line_info.name, arg) == 0) {
+            *offset = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool gpio_match_label(int fd, const void *arg, unsigned int *offset)
+{
+    struct gpiochip_info chip_info;
+
+    (void)offset;
+    if (ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &chip_info) < 0)
+        return false;
+    return strcmp(chip_info.label, arg) == 0;
+}
+
+static int gpio_read_sysfs(const char *chip_dir, const char *attr, char *buf, size_t len)
+{
+    char fname[128];
+    int fd;
+    ssize_t ret;
+
+    snprintf(fname, sizeof(fname), GPIO_SYSFS_DIR "/%s/%s", chip_dir, attr);
+    fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    ret = read(fd, buf, len - 1);
+    close(fd);
+    if (ret < 0)
+        return -1;
+    buf[ret] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+/*
+ * The sysfs chip whose range holds the GPIO number gives the label and the
+ * offset, the character device is the one with the same label
+ */
+static int gpio_find_number(unsigned int gpio, unsigned int *chip, unsigned int *offset)
+{
+    char label[32] = "", buf[16];
+    struct dirent *entry;
+    unsigned int base, ngpio;
+    DIR *d;
+
+    d = opendir(GPIO_SYSFS_DIR);
+    if (d == NULL)
+        return -1;
+    while ((label[0] == '\0') && ((entry = readdir(d)) != NULL)) {
+        if (sscanf(entry->d_name, "gpiochip%u", &base) != 1)
+            continue;
+        if ((gpio_read_sysfs(entry->d_name, "ngpio", buf, sizeof(buf)) < 0)
+                || (sscanf(buf, "%u", &ngpio) != 1))
+            continue;
+        if ((gpio < base) || (gpio >= base + ngpio))
+            continue;
+        if (gpio_read_sysfs(entry->d_name, "label", label, sizeof(label)) < 0)
+            label[0] = '\0';
+        *offset = gpio - base;
+    }
+    closedir(d);
+    if (label[0] == '\0')
+        return -1;
+    return gpio_chip_find(gpio_match_label, label, chip, offset);
+}
+
+static int gpio_line_resolve(const gpio_line_t *line, unsigned int *chip, unsigned int *offset)
+{
+    if ((line->name != NULL)
+            && (gpio_chip_find(gpio_match_name, line->name, chip, offset) == 0))
+        return 0;
+    return gpio_find_number(line->gpio, chip, offset);
+}
+
+/*
+ * Lines exported through sysfs are driven through their value files
+ */
+static int gpio_chip_use_sysfs(gpio_chip_t *chip, const gpio_line_t *lines)
+{
+    char fname[64];
+    unsigned int i;
+
+    for (i = 0; i < chip->nlines; i++) {
+        const gpio_line_t *line = &lines[chip->index[i]];
+        int fd;
+
+        snprintf(fname, sizeof(fname), GPIO_SYSFS_DIR "/gpio%u/direction", line->gpio);
+        fd = open(fname, O_WRONLY);
+        if ((fd < 0) || (write(fd, line->value? "high": "low", line->value? 4: 3) < 0)) {
+            perror("can't set direction of exported gpio line");
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+        close(fd);
+        snprintf(fname, sizeof(fname), GPIO_SYSFS_DIR "/gpio%u/value", line->gpio);
+        chip->value_fd[i] = open(fname, O_WRONLY);
+        if (chip->value_fd[i] < 0) {
+            perror("can't open value of exported gpio line");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+gpio_lines_t *gpio_lines_create(const char *consumer, const gpio_line_t *lines, unsigned int n)
+{
+    struct gpiohandle_request req;
+    unsigned int i, j, chip_num, offset;
+    int fd, ret;
+    gpio_lines_t *self;
+
+    if (n > GPIO_LINES_MAX)
+        return NULL;
+    self = (gpio_lines_t *) calloc(1, (sizeof (gpio_lines_t)));
+    if (!self)
+        return NULL;
+    /* group the lines by chip */
+    for (i = 0; i < n; i++) {
+        if (gpio_line_resolve(&lines[i], &chip_num, &offset) < 0) {
+            fprintf(stderr, "can't find gpio line %s (gpio%u)\n",
+                    lines[i].name != NULL? lines[i].name: "", lines[i].gpio);
+            gpio_lines_destroy(&self);
+            return NULL;
+        }
+        for (j = 0; j < self->nchips; j++)
+            if (self->chips[j].chip == chip_num)
+                break;
+        if (j == self->nchips) {
+            self->chips[j].chip = chip_num;
+            self->chips[j].fd = -1;
+            memset(self->chips[j].value_fd, -1, sizeof(self->chips[j].value_fd));
+            self->nchips++;
+        }
+        self->chips[j].offset[self->chips[j].nlines] = offset;
+        self->chips[j].index[self->chips[j].nlines++] = i;
+        if (lines[i].value)
+            self->values |= 1 << i;
+    }
+    for (j = 0; j < self->nchips; j++) {
+        gpio_chip_t *chip = &self->chips[j];
+
+        fd = gpio_chip_open(chip->chip);
+        if (fd < 0) {
+            perror("can't open gpio chip");
+            gpio_lines_destroy(&self);
+            return NULL;
+        }
+        memset(&req, 0, sizeof(req));
+        req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+        req.lines = chip->nlines;
+        for (i = 0; i < chip->nlines; i++) {
+            req.lineoffsets[i] = chip->offset[i];
+            req.default_values[i] = lines[chip->index[i]].value ? 1 : 0;
+        }
+        strncpy(req.consumer_label, consumer, sizeof(req.consumer_label) - 1);
+        ret = ioctl(fd, GPIO_GET_LINEHANDLE_IOCTL, &req);
+        if ((ret < 0) && (errno == EBUSY)) {
+            fprintf(stderr, "gpio lines of gpiochip%u are in use, trying sysfs\n", chip->chip);
+            ret = gpio_chip_use_sysfs(chip, lines);
+            req.fd = -1;
+        }
+        close(fd);
+        if (ret < 0) {
+            perror("can't request gpio lines");
+            gpio_lines_destroy(&self);
+            return NULL;
+        }
+        chip->fd = req.fd;
+    }
+    return self;
+}
+
+/*
+ * Destructor, the lines keep their values
+ */
+void gpio_lines_destroy(gpio_lines_t **self_p)
+{
+    unsigned int i, j;
+
+    assert (self_p);
+    if (*self_p) {
+        gpio_lines_t *self = *self_p;
+        for (j = 0; j < self->nchips; j++) {
+            if (self->chips[j].fd >= 0)
+                close(self->chips[j].fd);
+            for (i = 0; i < self->chips[j].nlines; i++)
+                if (self->chips[j].value_fd[i] >= 0)
+                    close(self->chips[j].value_fd[i]);
+        }
+        free(self);
+        *self_p = NULL;
+    }
+}
+
+static int gpio_chip_set_sysfs(gpio_chip_t *chip, unsigned int values)
+{
+    unsigned int i;
+    char c;
+
+    for (i = 0; i < chip->nlines; i++) {
+        c = (values >> chip->index[i]) & 1? '1': '0';
+        if (pwrite(chip->value_fd[i], &c, 1, 0) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int gpio_lines_set(gpio_lines_t *self, unsigned int mask, unsigned int values)
+{
+    struct gpiohandle_data data;
+    unsigned int i, j, chip_mask;
+    int ret = 0, r;
+
+    values = (self->values & ~mask) | (values & mask);
+    for (j = 0; j < self->nchips; j++) {
+        gpio_chip_t *chip = &self->chips[j];
+
+        chip_mask = 0;
+        for (i = 0; i < chip->nlines; i++)
+            chip_mask |= 1 << chip->index[i];
+        /* chips without changed lines are left alone */
+        if ((chip_mask & (self->values ^ values)) == 0)
+            continue;
+        if (chip->fd < 0)
+            r = gpio_chip_set_sysfs(chip, values);
+        else {
+            memset(&data, 0, sizeof(data));
+            for (i = 0; i < chip->nlines; i++)
+                data.values[i] = (values >> chip->index[i]) & 1;
+            r = ioctl(chip->fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data);
+        }
+        if (r < 0) {
+            perror("can't set gpio lines");
+            ret = -1;
+            continue;
+        }
+        self->values = (self->values & ~chip_mask) | (values & chip_mask);
+    }
+    return ret;
+}
+
+unsigned int gpio_lines_get(gpio_lines_t *self)
+{
+    return self->values;
+}
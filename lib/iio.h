@@ -0,0 +1,30 @@
+#ifndef _IIO_H_
+#define _IIO_H_
+#include <stddef.h>
+
+/*
+ * Triggered buffer capture from an industrial I/O (IIO) ADC.
+ *
+ * The character device /dev/iio:deviceN stays open for the lifetime of the
+ * buffer. Once started the buffer stays enabled, reads drop the scans
+ * queued meanwhile and wait for n new scans of one channel. The trigger
+ * has to be assigned to the device beforehand (trigger/current_trigger),
+ * start fails at once if it doesn't run. Its sampling frequency can be set
+ * per start.
+ */
+
+//  Opaque class structures to allow forward references
+typedef struct _iio_buffer_t iio_buffer_t;
+
+iio_buffer_t *iio_buffer_create(int dev_num, int channel);
+void iio_buffer_destroy(iio_buffer_t **self_p);
+/* Enables the buffer for reads of up to n samples at rate Hz, rate 0 keeps
+ * the current rate. Does nothing if it is enabled like that already. */
+int iio_buffer_start(iio_buffer_t *self, size_t n, unsigned int rate);
+void iio_buffer_stop(iio_buffer_t *self);
+/* Reads n new raw samples from the started buffer. Returns the number of
+ * samples read or -1, on a timeout the buffer is stopped */
+int iio_buffer_read(iio_buffer_t *self, int *samples, size_t n);
+/* iio_buffer_start and iio_buffer_read */
+int iio_buffer_capture(iio_buffer_t *self, int *samples, size_t n, unsigned int rate);
+#endif
@@ -0,0 +1,371 @@
+/* File: iio_core.c
+ *
+ * Triggered buffer capture from an IIO ADC through its character device,
+ * see iio.h
+ */
+
+#define _GNU_SOURCE  // stdio.h to include asprintf
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+
+#include "iio.h"
+
+#define IIO_SYSFS_DIR "/sys/bus/iio/devices"
+
+/* Time to wait for the first scan when the rate is not known */
+#define IIO_TIMEOUT_MS 1000
+/* Least time to wait for scans at a known rate */
+#define IIO_MIN_TIMEOUT_MS 10
+
+/* Scans read with one read() call */
+#define IIO_READ_SCANS 1024
+
+struct _iio_buffer_t {
+    char *sysfs_dir; /* /sys/bus/iio/devices/iio:deviceN */
+    int fd; /* /dev/iio:deviceN */
+    /* scan element format of the channel, e.g. "be:s16/16>>0" */
+    bool big_endian;
+    bool is_signed;
+    unsigned int realbits;
+    unsigned int storagebits;
+    unsigned int shift;
+    unsigned char *data; /* read buffer for IIO_READ_SCANS scans */
+    bool enabled; /* buffer/enable is set */
+    size_t length; /* buffer/length while enabled */
+    double rate; /* scans per second while enabled, 0 if not known */
+};
+
+static int iio_write_attr(const char *dir, const char *attr, const char *value)
+{
+    char *fname;
+    int fd, ret;
+
+    if (asprintf(&fname, "%s/%s", dir, attr) < 0)
+        return -1;
+    fd = open(fname, O_WRONLY);
+    free(fname);
+    if (fd < 0)
+        return -1;
+    ret = write(fd, value, strlen(value));
+    close(fd);
+    return ret < 0? -1: 0;
+}
+
+static int iio_write_attr_int(const char *dir, const char *attr, unsigned int value)
+{
+    char buf[16];
+
+    snprintf(buf, sizeof(buf), "%u", value);
+    return iio_write_attr(dir, attr, buf);
+}
+
+static int iio_read_attr(const char *dir, const char *attr, char *buf, size_t len)
+{
+    char *fname;
+    int fd;
+    ssize_t ret;
+
+    if (asprintf(&fname, "%s/%s", dir, attr) < 0)
+        return -1;
+    fd = open(fname, O_RDONLY);
+    free(fname);
+    if (fd < 0)
+        return -1;
+    ret = read(fd, buf, len - 1);
+    close(fd);
+    if (ret < 0)
+        return -1;
+    buf[ret] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+/*
+ * Only the requested channel is enabled, so a scan holds a single sample
+ * and needs no alignment.
+ */
+static int iio_enable_channel(iio_buffer_t *self, int channel)
+{
+    char *dir, *attr;
+    struct dirent *entry;
+    DIR *d;
+    int ret;
+
+    if (asprintf(&dir, "%s/scan_elements", self->sysfs_dir) < 0)
+        return -1;
+    d = opendir(dir);
+    if (d == NULL) {
+        perror("iio device has no scan elements");
+        free(dir);
+        return -1;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len > 3 && strcmp(entry->d_name + len - 3, "_en") == 0)
+            iio_write_attr(dir, entry->d_name, "0");
+    }
+    closedir(d);
+    if (asprintf(&attr, "in_voltage%d_en", channel) < 0) {
+        free(dir);
+        return -1;
+    }
+    ret = iio_write_attr(dir, attr, "1");
+    free(attr);
+    free(dir);
+    return ret;
+}
+
+static int iio_read_format(iio_buffer_t *self, int channel)
+{
+    char *attr, buf[32], endian, sign;
+    int ret;
+
+    if (asprintf(&attr, "scan_elements/in_voltage%d_type", channel) < 0)
+        return -1;
+    ret = iio_read_attr(self->sysfs_dir, attr, buf, sizeof(buf));
+    free(attr);
+    if (ret < 0)
+        return -1;
+    if (sscanf(buf, "%ce:%c%u/%u>>%u", &endian, &sign,
+                &self->realbits, &self->storagebits, &self->shift) != 5)
+        return -1;
+    if ((self->storagebits % 8) || (self->storagebits > 64) || (self->realbits > self->storagebits))
+        return -1;
+    self->big_endian = endian == 'b';
+    self->is_signed = sign == 's';
+    return 0;
+}
+
+/*
+ * sysfs directory of the current trigger, NULL if there is none. *found is
+ * false if the device has no trigger interface at all.
+ */
+static char *iio_trigger_dir(iio_buffer_t *self, bool *found)
+{
+    char trigger[64], name[64], *dir = NULL;
+    struct dirent *entry;
+    DIR *d;
+
+    *found = iio_read_attr(self->sysfs_dir, "trigger/current_trigger", trigger, sizeof(trigger)) == 0;
+    if (!*found || (trigger[0] == '\0') || ((d = opendir(IIO_SYSFS_DIR)) == NULL))
+        return NULL;
+    while ((dir == NULL) && ((entry = readdir(d)) != NULL)) {
+        if (strncmp(entry->d_name, "trigger", 7) != 0)
+            continue;
+        if (asprintf(&dir, "%s/%s", IIO_SYSFS_DIR, entry->d_name) < 0) {
+            dir = NULL;
+            break;
+        }
+        if ((iio_read_attr(dir, "name", name, sizeof(name)) < 0) || (strcmp(name, trigger) != 0)) {
+            free(dir);
+            dir = NULL;
+        }
+    }
+    closedir(d);
+    return dir;
+}
+
+/*
+ * The sampling frequency lives with the trigger (e.g. an hrtimer trigger)
+ * or, for self clocked ADCs, with the device.
+ */
+static int iio_set_rate(iio_buffer_t *self, unsigned int rate)
+{
+    bool found;
+    char *dir = iio_trigger_dir(self, &found);
+    int ret = -1;
+
+    if (dir != NULL)
+        ret = iio_write_attr_int(dir, "sampling_frequency", rate);
+    free(dir);
+    if (ret < 0)
+        ret = iio_write_attr_int(self->sysfs_dir, "sampling_frequency", rate);
+    return ret;
+}
+
+/*
+ * Checks that scans arrive without being asked for and reads their rate,
+ * 0 if unknown. A sysfs trigger only fires on trigger_now, an hrtimer
+ * trigger at a rate of 0 not at all. A device without trigger interface
+ * clocks itself.
+ */
+static bool iio_trigger_running(iio_buffer_t *self, double *rate)
+{
+    char buf[32], *dir, *attr_dir;
+    bool found, running = true;
+
+    *rate = 0.0;
+    dir = iio_trigger_dir(self, &found);
+    if (found && (dir == NULL))
+        return false;
+    attr_dir = (dir != NULL) ? dir : self->sysfs_dir;
+    if ((dir != NULL) && (iio_read_attr(dir, "trigger_now", buf, sizeof(buf)) == 0))
+        running = false;
+    else if (iio_read_attr(attr_dir, "sampling_frequency", buf, sizeof(buf)) == 0) {
+        *rate = atof(buf);
+        running = *rate > 0.0;
+    }
+    free(dir);
+    return running;
+}
+
+static int iio_convert(iio_buffer_t *self, const unsigned char *scan)
+{
+    unsigned int i, bytes = self->storagebits / 8;
+    uint64_t val = 0;
+
+    for (i = 0; i < bytes; i++) {
+        if (self->big_endian)
+            val = (val << 8) | scan[i];
+        else
+            val |= (uint64_t)scan[i] << (8 * i);
+    }
+    val >>= self->shift;
+    if (self->realbits < 64) {
+        val &= ((uint64_t)1 << self->realbits) - 1;
+        /* sign extend */
+        if (self->is_signed && (val >> (self->realbits - 1)))
+            return (int)((int64_t)val - ((int64_t)1 << self->realbits));
+    }
+    return (int)val;
+}
+
+iio_buffer_t *iio_buffer_create(int dev_num, int channel)
+{
+    char *devname;
+    iio_buffer_t *self = (iio_buffer_t *) calloc(1, (sizeof (iio_buffer_t)));
+
+    if (!self)
+        return NULL;
+    self->fd = -1;
+    if (asprintf(&self->sysfs_dir, "%s/iio:device%d", IIO_SYSFS_DIR, dev_num) < 0) {
+        self->sysfs_dir = NULL;
+        iio_buffer_destroy(&self);
+        return NULL;
+    }
+    iio_write_attr(self->sysfs_dir, "buffer/enable", "0");
+    if ((iio_read_format(self, channel) < 0) || (iio_enable_channel(self, channel) < 0)) {
+        iio_buffer_destroy(&self);
+        return NULL;
+    }
+    self->data = (unsigned char *) malloc(IIO_READ_SCANS * self->storagebits / 8);
+    if (asprintf(&devname, "/dev/iio:device%d", dev_num) < 0) {
+        iio_buffer_destroy(&self);
+        return NULL;
+    }
+    self->fd = open(devname, O_RDONLY | O_NONBLOCK);
+    free(devname);
+    if ((self->fd < 0) || (self->data == NULL)) {
+        perror("can't open iio character device");
+        iio_buffer_destroy(&self);
+        return NULL;
+    }
+    return self;
+}
+
+/*
+ * Destructor
+ */
+void iio_buffer_destroy(iio_buffer_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        iio_buffer_t *self = *self_p;
+        iio_buffer_stop(self);
+        if (self->fd >= 0)
+            close(self->fd);
+        free(self->data);
+        free(self->sysfs_dir);
+        free(self);
+        *self_p = NULL;
+    }
+}
+
+int iio_buffer_start(iio_buffer_t *self, size_t n, unsigned int rate)
+{
+    if (n < IIO_READ_SCANS)
+        n = IIO_READ_SCANS;
+    if (self->enabled && (n <= self->length) && ((rate == 0) || (rate == self->rate)))
+        return 0;
+    iio_buffer_stop(self);
+    if ((rate > 0) && (iio_set_rate(self, rate) < 0))
+        perror("can't set iio sampling frequency");
+    if (!iio_trigger_running(self, &self->rate)) {
+        fprintf(stderr, "iio device %s has no running trigger\n", self->sysfs_dir);
+        return -1;
+    }
+    iio_write_attr_int(self->sysfs_dir, "buffer/length", n);
+    if (iio_write_attr(self->sysfs_dir, "buffer/enable", "1") < 0) {
+        perror("can't enable iio buffer");
+        return -1;
+    }
+    self->enabled = true;
+    self->length = n;
+    return 0;
+}
+
+void iio_buffer_stop(iio_buffer_t *self)
+{
+    if (!self->enabled)
+        return;
+    iio_write_attr(self->sysfs_dir, "buffer/enable", "0");
+    self->enabled = false;
+}
+
+int iio_buffer_read(iio_buffer_t *self, int *samples, size_t n)
+{
+    size_t count = 0, bytes = self->storagebits / 8;
+    struct pollfd pfd = {.fd = self->fd, .events = POLLIN};
+    int timeout_ms = IIO_TIMEOUT_MS;
+    ssize_t len;
+
+    if (!self->enabled)
+        return -1;
+    if (self->rate > 0.0) {
+        /* twice the time the scans should take */
+        timeout_ms = (int)(2000.0 * n / self->rate);
+        if (timeout_ms < IIO_MIN_TIMEOUT_MS)
+            timeout_ms = IIO_MIN_TIMEOUT_MS;
+    }
+    /* drop the scans queued meanwhile */
+    while (read(self->fd, self->data, IIO_READ_SCANS * bytes) > 0)
+        ;
+    while (count < n) {
+        size_t want = n - count < IIO_READ_SCANS? n - count: IIO_READ_SCANS;
+        unsigned char *scan;
+
+        if (poll(&pfd, 1, timeout_ms) <= 0) {
+            perror("timeout reading iio buffer");
+            break;
+        }
+        len = read(self->fd, self->data, want * bytes);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            perror("can't read from iio buffer");
+            break;
+        }
+        for (scan = self->data; scan + bytes <= self->data + len; scan += bytes)
+            samples[count++] = iio_convert(self, scan);
+    }
+    /* the trigger stopped, the next start checks it again */
+    if (count < n)
+        iio_buffer_stop(self);
+    return count > 0? (int)count: -1;
+}
+
+int iio_buffer_capture(iio_buffer_t *self, int *samples, size_t n, unsigned int rate)
+{
+    if (iio_buffer_start(self, n, rate) < 0)
+        return -1;
+    return iio_buffer_read(self, samples, n);
+}
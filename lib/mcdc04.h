@@ -12,6 +12,12 @@
 #define MCDC04_VERSION \
     MCDC04_MAKE_VERSION(MCDC04_VERSION_MAJOR, MCDC04_VERSION_MINOR, MCDC04_VERSION_PATCH)
 #define PMU_MAX_CHANNEL 3
+/* Output registers OUT0..OUT3 and OUTINT, indexed by register address */
+#define MCDC04_OUTPUTS 5
+/* Output register of each colour channel, the same for every read path */
+#define MCDC04_OUT_X 3
+#define MCDC04_OUT_Y 1
+#define MCDC04_OUT_Z 2
 //  Opaque class structures to allow forward references
 typedef struct _mcdc04_t mcdc04_t;
 
@@ -22,5 +28,42 @@ void mcdc04_set_iref(mcdc04_t *self, int val);
 void mcdc04_set_tint(mcdc04_t *self, int val);
 void mcdc04_read_raw(mcdc04_t *self, unsigned int ch, unsigned int *val);
 void mcdc04_trigger(mcdc04_t *self);
+/*
+ * mcdc04_trigger in two steps, so the conversion time can be spent
+ * elsewhere: start, wait mcdc04_get_tconv seconds, finish
+ */
+void mcdc04_trigger_start(mcdc04_t *self);
+int mcdc04_trigger_finish(mcdc04_t *self);
+double mcdc04_get_tconv(mcdc04_t *self);
+/*
+ * Continuous (CONT) mode: conversions run back to back, the latest result
+ * is read with mcdc04_read_xyz once per integration time
+ */
+int mcdc04_start_continuous(mcdc04_t *self);
+void mcdc04_stop_continuous(mcdc04_t *self);
+int mcdc04_read_xyz(mcdc04_t *self, unsigned int *x, unsigned int *y, unsigned int *z);
+/* Colour channels of the last read, without bus access */
+void mcdc04_get_xyz(mcdc04_t *self, unsigned int *x, unsigned int *y, unsigned int *z);
+unsigned int mcdc04_get_tint_ms(mcdc04_t *self);
+/*
+ * Gain steps, iref and tint settings from the lowest gain 0 on. Automatic
+ * gain keeps the highest channel between MCDC04_GAIN_LOW and
+ * MCDC04_GAIN_HIGH counts.
+ */
+#define MCDC04_GAIN_STEPS 9
+#define MCDC04_GAIN_LOW (65535 / 3)
+#define MCDC04_GAIN_HIGH (2 * 65535 / 3)
+void mcdc04_set_gain(mcdc04_t *self, int gain_idx);
+/* Counts per unit light of a gain step */
+double mcdc04_gain_factor(int gain_idx);
+/* Gain step for a light level in counts per gain factor, -1 if it is too
+ * bright for the lowest and MCDC04_GAIN_STEPS if too dark for the highest */
+int mcdc04_gain_predict(double level);
+/*
+ * All output registers in a single I2C transfer, out has MCDC04_OUTPUTS
+ * entries. mcdc04_get_all returns those of the last read without bus access.
+ */
+int mcdc04_read_all(mcdc04_t *self, unsigned int *out);
+void mcdc04_get_all(mcdc04_t *self, unsigned int *out);
 int luaopen_mcdc04(lua_State *L);
 #endif
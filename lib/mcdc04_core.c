@@ -99,6 +99,7 @@ struct light_t {
     unsigned int ciex;
     unsigned int ciey;
     unsigned int ciez;
+    unsigned int out[MCDC04_OUTPUTS]; /* OUT0..OUTINT of the last read */
 };
 
 /*
@@ -120,6 +121,7 @@ struct _mcdc04_t {
     int adc_tint_state; /* ADC integration time state, any out of 0..10 */
     struct timespec adc_tconv; /* Waiting time before conversion data are valid */ 
     struct light_t last_val;
+    int no_burst; /* adapter can't do combined transfers, read word by word */
 };
 
 mcdc04_t *mcdc04_create(int i2cbus, int address)
@@ -254,14 +256,86 @@ static void mcdc04_wait_for_ready(mcdc04_t *self)
  * Fetches conversion results as 16 bit adc value.
  * Ensures device is still in measurement state
  */
-static void mcdc04_fetch_data(mcdc04_t *self)
+static int mcdc04_fetch_data(mcdc04_t *self)
 {
+    unsigned int out[MCDC04_OUTPUTS];
+
+    return mcdc04_read_all(self, out);
+}
+
+/*
+ * Reads OUT0..OUTINT in one combined transfer: register address write,
+ * repeated start, 16 bit little endian words.
+ */
+static int mcdc04_read_burst(mcdc04_t *self, unsigned int *out)
+{
+    __u8 reg = MCDC04_ADDR_OUT0;
+    __u8 buf[2 * MCDC04_OUTPUTS];
+    struct i2c_msg msgs[2] = {
+        {.addr = self->dev_address, .flags = 0, .len = 1, .buf = &reg},
+        {.addr = self->dev_address, .flags = I2C_M_RD, .len = sizeof(buf), .buf = buf},
+    };
+    struct i2c_rdwr_ioctl_data xfer = {.msgs = msgs, .nmsgs = 2};
+    int i;
+
+    if (ioctl(self->dev_file, I2C_RDWR, &xfer) < 0)
+        return -1;
+    for (i = 0; i < MCDC04_OUTPUTS; i++)
+        out[i] = buf[2 * i] | (buf[2 * i + 1] << 8);
+    return 0;
+}
+
+/*
+ * Reads OUT0..OUTINT word by word, for SMBus only adapters
+ */
+static int mcdc04_read_words(mcdc04_t *self, unsigned int *out)
+{
+    int i, val, ret = 0;
+
     /* Output registers are 16 bit wide -> use word data functions */
-    
-    self->last_val.ciex = i2c_smbus_read_word_data(self->dev_file, MCDC04_ADDR_OUT1);
-    self->last_val.ciey = i2c_smbus_read_word_data(self->dev_file, MCDC04_ADDR_OUT3);
-    self->last_val.ciez = i2c_smbus_read_word_data(self->dev_file, MCDC04_ADDR_OUT2);
-    return;
+    for (i = 0; i < MCDC04_OUTPUTS; i++) {
+        val = i2c_smbus_read_word_data(self->dev_file, MCDC04_ADDR_OUT0 + i);
+        if (val < 0)
+            ret = -1;
+        out[i] = val < 0 ? 0 : val;
+    }
+    return ret;
+}
+
+/*
+ * Reads all output registers of the measurement state and keeps them as
+ * the last conversion result
+ */
+int mcdc04_read_all(mcdc04_t *self, unsigned int *out)
+{
+    int ret = -1;
+
+    if (!self->no_burst) {
+        ret = mcdc04_read_burst(self, out);
+        if ((ret < 0) && ((errno == EOPNOTSUPP) || (errno == EINVAL))) {
+            fprintf(stderr, "Warning: i2c adapter can't do combined transfers\n");
+            self->no_burst = 1;
+        }
+    }
+    if (self->no_burst)
+        ret = mcdc04_read_words(self, out);
+    if (ret < 0) {
+        fprintf(stderr, "Error: read of output registers failed\n");
+        return -1;
+    }
+    memcpy(self->last_val.out, out, sizeof(self->last_val.out));
+    self->last_val.ciex = out[MCDC04_OUT_X];
+    self->last_val.ciey = out[MCDC04_OUT_Y];
+    self->last_val.ciez = out[MCDC04_OUT_Z];
+    return 0;
+}
+
+/*
+ * Output registers of the last read, OUT0..OUTINT
+ */
+void mcdc04_get_all(mcdc04_t *self, unsigned int *out)
+{
+    memcpy(out, self->last_val.out, sizeof(self->last_val.out));
 }
 
 /*
@@ -336,6 +410,47 @@ void mcdc04_set_tint(mcdc04_t *self, int val)
     }
 }
 
+/* iref and tint settings of the gain steps */
+static const int gain_iref_tbl[MCDC04_GAIN_STEPS] = {2, 2, 1, 1, 0, 0, 0, 0, 0};
+static const int gain_tint_tbl[MCDC04_GAIN_STEPS] = {6, 7, 6, 7, 6, 7, 8, 9, 10};
+/* reference currents of the iref settings in nA */
+static const int iref_na_tbl[] = {20, 80, 320, 1280, 5120};
+
+/*
+ * Sets reference current and integration time of a gain step
+ */
+void mcdc04_set_gain(mcdc04_t *self, int gain_idx)
+{
+    mcdc04_set_iref(self, gain_iref_tbl[gain_idx]);
+    mcdc04_set_tint(self, gain_tint_tbl[gain_idx]);
+}
+
+/*
+ * Integration time over reference current
+ */
+double mcdc04_gain_factor(int gain_idx)
+{
+    return (double)(1 << gain_tint_tbl[gain_idx]) / iref_na_tbl[gain_iref_tbl[gain_idx]];
+}
+
+/*
+ * Highest gain that keeps level below the band top. The steps are a factor
+ * of two apart, as the band is wide, so that puts it into the band.
+ */
+int mcdc04_gain_predict(double level)
+{
+    int i;
+
+    if (level * mcdc04_gain_factor(0) >= MCDC04_GAIN_HIGH)
+        return -1;
+    if (level * mcdc04_gain_factor(MCDC04_GAIN_STEPS - 1) < MCDC04_GAIN_LOW)
+        return MCDC04_GAIN_STEPS;
+    for (i = MCDC04_GAIN_STEPS - 1; i > 0; i--)
+        if (level * mcdc04_gain_factor(i) < MCDC04_GAIN_HIGH)
+            break;
+    return i;
+}
+
 /*
  * updates the ADC configuration settings to the chip register
  */
@@ -354,22 +469,107 @@ static void mcdc04_update_adc_conf(mcdc04_t *self)
 }
 
 void mcdc04_trigger(mcdc04_t *self)
+{
+    mcdc04_trigger_start(self);
+    mcdc04_wait_for_ready(self);
+    mcdc04_trigger_finish(self);
+}
+
+/*
+ * starts a single conversion, the result is valid after mcdc04_get_tconv
+ */
+void mcdc04_trigger_start(mcdc04_t *self)
 {
     mcdc04_update_adc_conf(self);
     mcdc04_start_measure(self);
-    mcdc04_wait_for_ready(self);
-    mcdc04_fetch_data(self);
+}
+
+/*
+ * reads the result of the conversion started by mcdc04_trigger_start
+ */
+int mcdc04_trigger_finish(mcdc04_t *self)
+{
+    int ret = mcdc04_fetch_data(self);
+
+    mcdc04_stop_measure(self);
+    return ret;
+}
+
+/*
+ * waiting time before conversion data are valid, in seconds
+ */
+double mcdc04_get_tconv(mcdc04_t *self)
+{
+    return self->adc_tconv.tv_sec + self->adc_tconv.tv_nsec / 1e9;
+}
+
+
+/*
+ * Writes the measurement mode bits of CREGH, in config state only
+ */
+static int mcdc04_write_mode(mcdc04_t *self, unsigned int mode)
+{
+    self->reg_cregh = (self->reg_cregh & ~MCDC04_MASK_CREGH_MODE) | mode;
+    if (i2c_smbus_write_byte_data(self->dev_file, MCDC04_ADDR_CREGH, self->reg_cregh) < 0) {
+        fprintf(stderr, "Error: write to CREGH register failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * starts conversions back to back, a new result is available every
+ * integration time
+ */
+int mcdc04_start_continuous(mcdc04_t *self)
+{
+    mcdc04_update_adc_conf(self);
+    if (mcdc04_write_mode(self, MCDC04_MODE_CONT) < 0)
+        return -1;
+    mcdc04_start_measure(self);
+    return 0;
+}
+
+/*
+ * stops continuous conversions, mcdc04_trigger works again afterwards
+ */
+void mcdc04_stop_continuous(mcdc04_t *self)
+{
     mcdc04_stop_measure(self);
+    mcdc04_write_mode(self, MCDC04_MODE_CMD);
+}
+
+/*
+ * reads the latest conversion result in continuous mode
+ */
+int mcdc04_read_xyz(mcdc04_t *self, unsigned int *x, unsigned int *y, unsigned int *z)
+{
+    int ret = mcdc04_fetch_data(self);
+
+    mcdc04_get_xyz(self, x, y, z);
+    return ret;
+}
+
+void mcdc04_get_xyz(mcdc04_t *self, unsigned int *x, unsigned int *y, unsigned int *z)
+{
+    *x = self->last_val.ciex;
+    *y = self->last_val.ciey;
+    *z = self->last_val.ciez;
 }
 
+/*
+ * integration time in milli seconds, the conversion period in continuous mode
+ */
+unsigned int mcdc04_get_tint_ms(mcdc04_t *self)
+{
+    return 1 << (self->adc_tint_state & MCDC04_MASK_CREGL_T);
+}
 
 void mcdc04_read_raw(mcdc04_t *self, unsigned int ch, unsigned int *val)
 {
     *val = 0;
-    switch(ch) {
-        case 1: *val = self->last_val.ciex; break;
-        case 3: *val = self->last_val.ciey; break;
-        case 2: *val = self->last_val.ciez; break;
-        default: fprintf(stderr, "Error: channel must be a number 0..3\n");
-    }
+    if ((ch >= 1) && (ch <= 3))
+        *val = self->last_val.out[ch];
+    else
+        fprintf(stderr, "Error: channel must be a number 0..3\n");
 }
@@ -1,5 +1,9 @@
 #define LUA_LIB
+#define _GNU_SOURCE  // stdio.h to include asprintf
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <stdio.h>
@@ -9,42 +13,106 @@
 #include <fcntl.h>
 #include <time.h>
 #include "mcdc04.h"
-
-#define CIEX 3
-#define CIEY 1
-#define CIEZ 2
-#define TRD  0
+#include "device.h"
+#include "ring.h"
+#include "colour.h"
 
 #define ARRAYSIZE(arr) (sizeof(arr) / sizeof(arr[0]))
 
+/* Samples kept by continuous acquisition, a power of two */
+#define ACQ_RING 1024
+/* the result is read this long after the end of an integration */
+#define ACQ_READ_DELAY_US 500
+/*
+ * The sensor converts on its own clock. Reads come at ACQ_PACE_PERCENT of
+ * the integration time, so no conversion is missed. A read that finds the
+ * previous result again is dropped and repeated ACQ_RETRY_DIV-th of a
+ * period later. Equal results are a new conversion once more than
+ * ACQ_SAME_PERCENT of a period passed.
+ */
+#define ACQ_PACE_PERCENT 98
+#define ACQ_RETRY_DIV 4
+#define ACQ_SAME_PERCENT 110
+/* wait for a sample outside of a coroutine, in integration times */
+#define ACQ_WAIT_PERIODS 4
+
+/* Gain control: readings taken as saturated and the gain steps dropped on
+ * saturation, see mcdc04_gain_predict for the band */
+#define GAIN_SATURATED 65000
+#define GAIN_SATURATED_STEP 3
+
+/* Calibration matrices kept, one per spatial channel */
+#define CAL_CHANNELS 16
+/* Samples per call of calibrate */
+#define CAL_MAX_SAMPLES (1 << 24)
+
+/* Phases of the async methods, the low bits of the continuation context */
+#define OP_ACQUIRE 0
+#define OP_START 1
+#define OP_FINISH 2
+#define OP_PHASES 4
+#define OP_CTX(arg, phase) ((lua_KContext)(arg) * OP_PHASES + (phase))
+
+typedef struct {
+    int64_t time_us; /* CLOCK_MONOTONIC, when the result was read */
+    uint16_t x, y, z;
+} lmcdc04_sample_t;
+
+/*
+ * Continuous acquisition of a sensor. The thread takes the device lock per
+ * read only. Samples go to a single writer ring, readers copy without a
+ * lock and drop what the writer may have overwritten meanwhile.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock; /* guards stop and the condition */
+    pthread_cond_t wake;
+    bool running; /* thread is created and not joined, atomic */
+    bool stop;
+    unsigned int period_ms; /* integration time */
+    device_t *dev;
+    uint64_t errors; /* failed reads, atomic */
+    uint64_t duplicates; /* reads of a result already kept, atomic */
+    ring_t *ring; /* lmcdc04_sample_t */
+} lmcdc04_acq_t;
+
+/* Handle of the shared device */
 typedef struct {
     mcdc04_t *s;
-    double **m; /* 3-by-3 calibration matrix */
-    /* Calibrated color coordinate according to CIE 1931, 2 observer */
+    lmcdc04_acq_t *acq; /* NULL until continuous acquisition is first started */
+    int gain_idx; /* gain set by set_gain or auto_adjust_gain, -1 if unknown */
+    double level; /* highest channel at unit gain of the last reading, 0 if unknown */
+} lmcdc04_sensor_t;
+
+typedef struct {
+    device_t *dev; /* shared device, must be the first member */
+    lmcdc04_sensor_t *sensor;
+    mcdc04_t *s; /* sensor->s */
+    char *dev_name;
+    device_events_t *events; /* events of the Lua state subscribed to the samples, if any */
+    /* 3-by-3 calibration matrix per channel, row major, raw to CIE 1931
+     * XYZ, 2 degree observer */
+    double cal[CAL_CHANNELS][9];
 } lmcdc04_userdata_t;
 
-const int iref_tbl[] = {2, 2, 1, 1, 0, 0, 0, 0, 0};
-const int tint_tbl[] = {6, 7, 6, 7, 6, 7, 8, 9, 10};
+/* Fields of the calibrate result, by colour kernel output */
+static const char *col_names[COLOUR_NUM] = {"X", "Y", "Z", "x", "y", "u", "v", "cct"};
+
 
-static void matrix_init(double ***A, int r, int c)
+static void cal_init(lmcdc04_userdata_t *su)
 {
-    int i, j;
-    *A = (double **)malloc(sizeof(double *)*r);
-    for( i = 0; i< r; i++) {
-        (*A)[i] = (double *)malloc(sizeof(double) *c);
-        for( j = 0; j < c; j++) {
-            if (i == j)
-                (*A)[i][j] = 1.0;
-            else
-                (*A)[i][j] = 0.0;
-        }
-    }
+    int ch;
+
+    memset(su->cal, 0, sizeof(su->cal));
+    for (ch = 0; ch < CAL_CHANNELS; ch++)
+        su->cal[ch][0] = su->cal[ch][4] = su->cal[ch][8] = 1.0;
 }
 
 static int lmcdc04_new(lua_State *L)
 {
     lmcdc04_userdata_t *su;
     int i2cbus, address;
+    char dev_name[32];
 
     i2cbus = luaL_checkinteger(L, 1);
     address = luaL_checkinteger(L, 2);
@@ -53,7 +121,11 @@ static int lmcdc04_new(lua_State *L)
      * the member of the userdata in case initialization fails in some way. If
      * that happens we want the userdata to be in a consistent state for __gc. */
     su       = (lmcdc04_userdata_t *)lua_newuserdata(L, sizeof(*su));
+    su->dev  = NULL;
+    su->sensor = NULL;
     su->s    = NULL;
+    su->dev_name = NULL;
+    su->events = NULL;
 
     /* Add the metatable to the stack. */
     luaL_getmetatable(L, "Lmcdc04");
@@ -72,22 +144,445 @@ static int lmcdc04_new(lua_State *L)
         return 1;
     }
 
-    /* Create the data that comprises the userdata (the mcdc04 state). */
-    su->s    = mcdc04_create(i2cbus, address);
-    matrix_init(&(su->m), 3, 3);
+    /* Create the data that comprises the userdata (the mcdc04 state),
+     * the sensor is shared by all Lua states */
+    snprintf(dev_name, sizeof(dev_name), "i2c-%d-0x%02x", i2cbus, address);
+    su->dev  = device_claim(dev_name);
+    if (su->dev == NULL)
+        return luaL_error(L, "can't claim device %s", dev_name);
+    su->dev_name = strdup(dev_name);
+    device_lock(su->dev);
+    su->sensor = device_handle(su->dev);
+    if (su->sensor == NULL) {
+        su->sensor = (lmcdc04_sensor_t *)calloc(1, sizeof(lmcdc04_sensor_t));
+        if (su->sensor == NULL) {
+            device_unlock(su->dev);
+            return luaL_error(L, "can't create sensor %s", dev_name);
+        }
+        su->sensor->s = mcdc04_create(i2cbus, address);
+        /* the power on gain is none of the table */
+        su->sensor->gain_idx = -1;
+        device_set_handle(su->dev, su->sensor);
+    }
+    su->s    = su->sensor->s;
+    device_unlock(su->dev);
+    cal_init(su);
 
     return 1;
 }
 
+static int64_t acq_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool acq_running(lmcdc04_sensor_t *sensor)
+{
+    return (sensor->acq != NULL) && __atomic_load_n(&sensor->acq->running, __ATOMIC_ACQUIRE);
+}
+
+static void acq_deadline_add(struct timespec *deadline, int64_t ns)
+{
+    deadline->tv_sec += ns / 1000000000;
+    deadline->tv_nsec += ns % 1000000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/*
+ * Whether a read found the result of the last kept sample again
+ */
+static bool acq_duplicate(const lmcdc04_sample_t *last, const lmcdc04_sample_t *sample,
+        unsigned int period_ms)
+{
+    if ((last->time_us == 0) || (last->x != sample->x) || (last->y != sample->y)
+            || (last->z != sample->z))
+        return false;
+    return (sample->time_us - last->time_us) * 100 < (int64_t)period_ms * 10 * ACQ_SAME_PERCENT;
+}
+
+static void *acq_run(void *arg)
+{
+    lmcdc04_sensor_t *sensor = arg;
+    lmcdc04_acq_t *acq = sensor->acq;
+    lmcdc04_sample_t sample, last = {0};
+    unsigned int x, y, z;
+    struct timespec deadline;
+    int64_t pace_ns, next_ns;
+    int ret;
+
+    pace_ns = (int64_t)acq->period_ms * 10000 * ACQ_PACE_PERCENT;
+    next_ns = pace_ns;
+    /* results are read in phase with the conversions */
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    acq_deadline_add(&deadline, ACQ_READ_DELAY_US * 1000);
+    pthread_mutex_lock(&acq->lock);
+    while (!acq->stop) {
+        acq_deadline_add(&deadline, next_ns);
+        while (!acq->stop && (pthread_cond_timedwait(&acq->wake, &acq->lock, &deadline) == 0))
+            ;
+        if (acq->stop)
+            break;
+        pthread_mutex_unlock(&acq->lock);
+
+        device_lock(acq->dev);
+        ret = mcdc04_read_xyz(sensor->s, &x, &y, &z);
+        device_unlock(acq->dev);
+        next_ns = pace_ns;
+        if (ret < 0) {
+            __atomic_add_fetch(&acq->errors, 1, __ATOMIC_RELAXED);
+        } else {
+            sample.time_us = acq_now_us();
+            sample.x = x;
+            sample.y = y;
+            sample.z = z;
+            if (acq_duplicate(&last, &sample, acq->period_ms)) {
+                /* read ahead of the conversion, try again shortly */
+                __atomic_add_fetch(&acq->duplicates, 1, __ATOMIC_RELAXED);
+                next_ns = (int64_t)acq->period_ms * 1000000 / ACQ_RETRY_DIV;
+            } else {
+                ring_push(acq->ring, &sample);
+                last = sample;
+                device_notify(acq->dev);
+            }
+        }
+        pthread_mutex_lock(&acq->lock);
+    }
+    pthread_mutex_unlock(&acq->lock);
+    return NULL;
+}
+
+/*
+ * Stops the thread and waits for it. The thread takes the device lock, so
+ * the caller must not hold it.
+ */
+static void acq_stop(lmcdc04_acq_t *acq)
+{
+    pthread_mutex_lock(&acq->lock);
+    acq->stop = true;
+    pthread_cond_signal(&acq->wake);
+    pthread_mutex_unlock(&acq->lock);
+    if (__atomic_load_n(&acq->running, __ATOMIC_ACQUIRE))
+        pthread_join(acq->thread, NULL);
+    __atomic_store_n(&acq->running, false, __ATOMIC_RELEASE);
+}
+
+static void acq_destroy(lmcdc04_sensor_t *sensor)
+{
+    lmcdc04_acq_t *acq = sensor->acq;
+
+    if (acq == NULL)
+        return;
+    if (acq_running(sensor)) {
+        acq_stop(acq);
+        device_lock(acq->dev);
+        mcdc04_stop_continuous(sensor->s);
+        device_unlock(acq->dev);
+    }
+    pthread_cond_destroy(&acq->wake);
+    pthread_mutex_destroy(&acq->lock);
+    ring_destroy(&acq->ring);
+    free(acq);
+    sensor->acq = NULL;
+}
+
+static int acq_push_sample(lua_State *L, const lmcdc04_sample_t *sample, uint64_t seq)
+{
+    lua_pushinteger(L, sample->x);
+    lua_pushinteger(L, sample->y);
+    lua_pushinteger(L, sample->z);
+    lua_pushnumber(L, sample->time_us / 1e6);
+    lua_pushinteger(L, seq);
+    return 5;
+}
+
+/*
+ * Device event handler of a Lua state, signals 'mcdc04_sample' if samples
+ * arrived since it ran last
+ */
+static int acq_handler(lua_State *L)
+{
+    lmcdc04_userdata_t *su = (lmcdc04_userdata_t *)lua_touserdata(L, lua_upvalueindex(1));
+    uint64_t head;
+
+    if ((su->sensor == NULL) || (su->sensor->acq == NULL))
+        return 0;
+    head = ring_head(su->sensor->acq->ring);
+    if ((lua_Integer)head == lua_tointeger(L, lua_upvalueindex(2)))
+        return 0;
+    lua_pushinteger(L, head);
+    lua_replace(L, lua_upvalueindex(2));
+    lua_getglobal(L, "signal");
+    lua_pushstring(L, "mcdc04_sample");
+    lua_call(L, 1, 0);
+    return 0;
+}
+
+/*
+ * Lets the actor of the Lua state signal 'mcdc04_sample' on new samples
+ */
+static void acq_subscribe(lua_State *L, lmcdc04_userdata_t *su, int index)
+{
+    char *key;
+
+    if ((su->events != NULL) || ((su->events = device_events_get(L)) == NULL))
+        return;
+    if (device_subscribe(su->dev, su->events) < 0) {
+        su->events = NULL;
+        luaL_error(L, "too many Lua states watch the sensor");
+    }
+    if (asprintf(&key, "mcdc04:%s", su->dev_name) < 0)
+        return;
+    lua_pushvalue(L, index);
+    lua_pushinteger(L, ring_head(su->sensor->acq->ring));
+    lua_pushcclosure(L, acq_handler, 2);
+    device_events_set_handler(L, key);
+    free(key);
+}
+
+/** start_continuous
+ * \brief: starts continuous (CONT mode) acquisition in the background with
+ * the current gain, one sample per integration time
+ *
+ * Every Lua state that started the acquisition gets signal('mcdc04_sample')
+ * on new samples. measure and the gain methods are refused until
+ * stop_continuous.
+ */
+static int lmcdc04_start_continuous(lua_State *L)
+{
+    lmcdc04_userdata_t *su;
+    lmcdc04_acq_t *acq;
+    pthread_condattr_t attr;
+
+    su = (lmcdc04_userdata_t *)luaL_checkudata(L, 1, "Lmcdc04");
+    if (su->sensor->acq == NULL) {
+        acq = (lmcdc04_acq_t *)calloc(1, sizeof(lmcdc04_acq_t));
+        if (acq != NULL)
+            acq->ring = ring_create(ACQ_RING, sizeof(lmcdc04_sample_t));
+        if ((acq == NULL) || (acq->ring == NULL)) {
+            free(acq);
+            return luaL_error(L, "can't create acquisition");
+        }
+        pthread_mutex_init(&acq->lock, NULL);
+        /* deadlines are on the monotonic clock */
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&acq->wake, &attr);
+        pthread_condattr_destroy(&attr);
+        acq->dev = su->dev;
+        su->sensor->acq = acq;
+    }
+    acq = su->sensor->acq;
+    if (!acq_running(su->sensor)) {
+        if (mcdc04_start_continuous(su->s) < 0)
+            return luaL_error(L, "can't start continuous conversions");
+        acq->period_ms = mcdc04_get_tint_ms(su->s);
+        acq->stop = false;
+        if (pthread_create(&acq->thread, NULL, acq_run, su->sensor) != 0) {
+            mcdc04_stop_continuous(su->s);
+            return luaL_error(L, "can't start acquisition thread");
+        }
+        __atomic_store_n(&acq->running, true, __ATOMIC_RELEASE);
+    }
+    acq_subscribe(L, su, 1);
+    return 0;
+}
+
+/** stop_continuous
+ * \brief: stops continuous acquisition, the samples are kept
+ */
+static int lmcdc04_stop_continuous(lua_State *L)
+{
+    lmcdc04_userdata_t *su;
+
+    su = (lmcdc04_userdata_t *)luaL_checkudata(L, 1, "Lmcdc04");
+    if (!acq_running(su->sensor))
+        return 0;
+    /* the thread may be waiting for the lock this method runs under */
+    device_unlock(su->dev);
+    acq_stop(su->sensor->acq);
+    device_lock(su->dev);
+    mcdc04_stop_continuous(su->s);
+    return 0;
+}
+
+/** latest
+ * \brief: the latest sample of continuous acquisition
+ * \return x, y, z raw values, time in seconds and sequence number of the
+ * sample, nil if there is none
+ */
+static int lmcdc04_latest(lua_State *L)
+{
+    lmcdc04_userdata_t *su;
+    lmcdc04_sample_t sample;
+    uint64_t head;
+
+    su = (lmcdc04_userdata_t *)luaL_checkudata(L, 1, "Lmcdc04");
+    if (su->sensor->acq == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    head = ring_head(su->sensor->acq->ring);
+    if (ring_get(su->sensor->acq->ring, head, &sample) < 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    return acq_push_sample(L, &sample, head);
+}
+
+/** window
+ * \brief: recent samples of continuous acquisition
+ * \param n the number of samples, optional, default all that are kept
+ * \param since only samples with a higher sequence number, optional
+ * \return a sequence of {x =, y =, z =, t = seconds, seq =}, oldest first
+ */
+static int lmcdc04_window(lua_State *L)
+{
+    lmcdc04_userdata_t *su;
+    lmcdc04_acq_t *acq;
+    lmcdc04_sample_t *copy;
+    uint64_t first;
+    lua_Integer n, since;
+    size_t count, i;
+
+    su = (lmcdc04_userdata_t *)luaL_checkudata(L, 1, "Lmcdc04");
+    n = luaL_optinteger(L, 2, ACQ_RING);
+    since = luaL_optinteger(L, 3, 0);
+    luaL_argcheck(L, n > 0, 2, "sample count out of range");
+    luaL_argcheck(L, since >= 0, 3, "negative sequence number");
+    acq = su->sensor->acq;
+    if (acq == NULL) {
+        lua_newtable(L);
+        return 1;
+    }
+    if (n > ACQ_RING)
+        n = ACQ_RING;
+    copy = (lmcdc04_sample_t *)lua_newuserdata(L, n * sizeof(lmcdc04_sample_t));
+    count = ring_window(acq->ring, n, since, copy, &first);
+
+    lua_createtable(L, count, 0);
+    for (i = 0; i < count; i++) {
+        lua_createtable(L, 0, 5);
+        lua_pushinteger(L, copy[i].x);
+        lua_setfield(L, -2, "x");
+        lua_pushinteger(L, copy[i].y);
+        lua_setfield(L, -2, "y");
+        lua_pushinteger(L, copy[i].z);
+        lua_setfield(L, -2, "z");
+        lua_pushnumber(L, copy[i].time_us / 1e6);
+        lua_setfield(L, -2, "t");
+        lua_pushinteger(L, first + i);
+        lua_setfield(L, -2, "seq");
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+/*
+ * Continuation of wait_sample, runs again whenever 'mcdc04_sample' was
+ * signalled
+ */
+static int lmcdc04_wait_sample_k(lua_State *L, int status, lua_KContext ctx)
+{
+    lmcdc04_userdata_t *su = (lmcdc04_userdata_t *)lua_touserdata(L, 1);
+    uint64_t seq = (uint64_t)ctx;
+    lmcdc04_sample_t sample;
+    struct timespec period;
+    uint64_t next;
+    int tries = 0;
+
+    (void)status;
+    for (;;) {
+        /* the oldest sample after seq that is still kept */
+        next = ring_next(su->sensor->acq->ring, seq);
+        if (next != 0) {
+            if (ring_get(su->sensor->acq->ring, next, &sample) == 0)
+                return acq_push_sample(L, &sample, next);
+            continue;
+        }
+        if (!acq_running(su->sensor) || (tries > ACQ_WAIT_PERIODS)) {
+            lua_pushnil(L);
+            return 1;
+        }
+        if (lua_isyieldable(L) && (su->events != NULL)) {
+            /* no longer than the call, the continuation re-checks */
+            lua_settop(L, 1);
+            lua_getglobal(L, "waitSignal");
+            lua_pushstring(L, "mcdc04_sample");
+            lua_callk(L, 1, 0, (lua_KContext)seq, lmcdc04_wait_sample_k);
+            continue;
+        }
+        /* main thread, or no actor to deliver the signal */
+        period.tv_sec = 0;
+        period.tv_nsec = 1000000L * su->sensor->acq->period_ms / 2 + 100000;
+        if (period.tv_nsec >= 1000000000) {
+            period.tv_sec = period.tv_nsec / 1000000000;
+            period.tv_nsec %= 1000000000;
+        }
+        nanosleep(&period, NULL);
+        tries++;
+    }
+}
+
+/** wait_sample
+ * \brief: waits for a sample of continuous acquisition newer than seq
+ * \param seq sequence number, optional, default the latest sample
+ * \return like latest, nil if acquisition is stopped
+ *
+ * Inside a coroutine the wait yields until signal('mcdc04_sample'), other
+ * tracks keep running meanwhile. Not serialized on the device lock, it
+ * only reads the ring.
+ */
+static int lmcdc04_wait_sample(lua_State *L)
+{
+    lmcdc04_userdata_t *su;
+    lua_Integer seq;
+
+    su = (lmcdc04_userdata_t *)luaL_checkudata(L, 1, "Lmcdc04");
+    if ((su->sensor == NULL) || (su->sensor->acq == NULL)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    seq = luaL_optinteger(L, 2, ring_head(su->sensor->acq->ring));
+    luaL_argcheck(L, seq >= 0, 2, "negative sequence number");
+    acq_subscribe(L, su, 1);
+    lua_settop(L, 1);
+    return lmcdc04_wait_sample_k(L, LUA_OK, (lua_KContext)seq);
+}
+
 static int lmcdc04_destroy(lua_State *L)
 {
     lmcdc04_userdata_t *su;
 
     su = (lmcdc04_userdata_t *)luaL_checkudata(L, 1, "Lmcdc04");
 
-    if (su->s != NULL)
-        mcdc04_destroy(&(su->s));
+    if (su->dev != NULL) {
+        device_op_cancel(su->dev, su);
+        if (su->events != NULL)
+            device_unsubscribe(su->dev, su->events);
+        su->events = NULL;
+        /* the acquisition thread takes the device lock, stop it before */
+        if ((su->sensor != NULL) && (device_refs(su->dev) == 1))
+            acq_destroy(su->sensor);
+        device_lock(su->dev);
+        /* the last user closes the sensor */
+        if ((device_refs(su->dev) == 1) && (su->sensor != NULL)) {
+            mcdc04_destroy(&(su->sensor->s));
+            free(su->sensor);
+            device_set_handle(su->dev, NULL);
+        }
+        device_unlock(su->dev);
+        device_release(&(su->dev));
+    }
+    su->sensor = NULL;
     su->s = NULL;
+    free(su->dev_name);
+    su->dev_name = NULL;
 
     return 0;
 }
@@ -131,142 +626,427 @@ static int lmcdc04_set_gain(lua_State *L)
 
     su = (lmcdc04_userdata_t *)luaL_checkudata(L, 1, "Lmcdc04");
     gain_idx = luaL_checknumber(L, 2); /* gain index, higher number mean higher gain */
-    mcdc04_set_iref(su->s, iref_tbl[gain_idx]);
-    mcdc04_set_tint(su->s, tint_tbl[gain_idx]);
+    luaL_argcheck(L, (gain_idx >= 0) && (gain_idx < MCDC04_GAIN_STEPS), 2, "gain index out of range");
+    if (acq_running(su->sensor))
+        return luaL_error(L, "continuous acquisition is running");
+    mcdc04_set_gain(su->s, gain_idx);
+    su->sensor->gain_idx = gain_idx;
     return 0;
 }
 
 static int lmcdc04_get_max_gain(lua_State *L)
 {
-    lua_pushinteger(L, ARRAYSIZE(iref_tbl) - 1);
+    lua_pushinteger(L, MCDC04_GAIN_STEPS - 1);
     return 1;
 }
 
 /*
- * Sets the ADC reference current, argument is iref in nano amp.
- * Will be mapped to nearest range value, lower than the val.
+ * Keeps the level of a reading for the next gain prediction
  */
-static int lmcdc04_auto_adjust_gain(lua_State *L)
+static void gain_record(lmcdc04_sensor_t *sensor, unsigned int maxval)
 {
-    unsigned int val, maxval;
-    int gain_idx;
-    lmcdc04_userdata_t *su;
+    if ((sensor->gain_idx < 0) || (maxval >= GAIN_SATURATED))
+        sensor->level = 0.0;
+    else
+        sensor->level = maxval / mcdc04_gain_factor(sensor->gain_idx);
+}
 
-    su = (lmcdc04_userdata_t *)luaL_checkudata(L, 1, "Lmcdc04");
-    /* the search in mid position of the gain */
-    gain_idx = ARRAYSIZE(iref_tbl) / 2;
+/*
+ * Highest of the color channels of the last conversion
+ */
+static unsigned int lmcdc04_max_raw(lmcdc04_userdata_t *su)
+{
+    unsigned int maxval;
+    unsigned int x, y, z;
 
-    while ((gain_idx >= 0) && (gain_idx < ARRAYSIZE(iref_tbl)))
-    {
+    mcdc04_get_xyz(su->s, &x, &y, &z);
+    maxval = x;
+    maxval = (maxval > y) ? maxval : y;
+    maxval = (maxval > z) ? maxval : z;
+    return maxval;
+}
+
+/*
+ * Takes the device for an async method, with the lock held. Returns 1
+ * when the caller has to retry later.
+ */
+static int lmcdc04_op_begin(lua_State *L, lmcdc04_userdata_t *su)
+{
+    if (acq_running(su->sensor)) {
+        device_unlock(su->dev);
+        return luaL_error(L, "continuous acquisition is running");
+    }
+    if (device_op_begin(su->dev, su) < 0) {
+        device_unlock(su->dev);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Reads the conversion of an async method, with the lock held. On failure
+ * the operation ends and the lock is released, -1 is returned.
+ */
+static int lmcdc04_op_finish(lmcdc04_userdata_t *su)
+{
+    if (mcdc04_trigger_finish(su->s) == 0)
+        return 0;
+    device_op_end(su->dev);
+    device_unlock(su->dev);
+    return -1;
+}
+
+/*
+ * Continuation of auto_adjust_gain, the context holds the phase and the
+ * gain index
+ */
+static int lmcdc04_auto_adjust_gain_k(lua_State *L, int status, lua_KContext ctx)
+{
+    lmcdc04_userdata_t *su = (lmcdc04_userdata_t *)lua_touserdata(L, 1);
+    lmcdc04_sensor_t *sensor = su->sensor;
+    int gain_idx = ctx / OP_PHASES, next;
+    unsigned int maxval;
+    double tconv;
+
+    switch (ctx % OP_PHASES) {
+    case OP_ACQUIRE:
+        device_lock(su->dev);
+        if (lmcdc04_op_begin(L, su))
+            return device_retry(L, su->dev, ctx, lmcdc04_auto_adjust_gain_k);
+        /* start with the gain the last reading asks for */
+        if (sensor->level > 0.0)
+            gain_idx = mcdc04_gain_predict(sensor->level);
+        else if (sensor->gain_idx >= 0)
+            gain_idx = sensor->gain_idx;
+        if (gain_idx < 0)
+            gain_idx = 0;
+        else if (gain_idx >= MCDC04_GAIN_STEPS)
+            gain_idx = MCDC04_GAIN_STEPS - 1;
+        device_unlock(su->dev);
+        /* fall through */
+    case OP_START:
+        device_lock(su->dev);
         /* set reference current and integration time */
-        mcdc04_set_iref(su->s, iref_tbl[gain_idx]);
-        mcdc04_set_tint(su->s, tint_tbl[gain_idx]);
+        mcdc04_set_gain(su->s, gain_idx);
+        sensor->gain_idx = gain_idx;
         /* do the measurement, reads all values at the same time */
-        mcdc04_trigger(su->s);
-        /* read back the results one at a time */
-        /* find maximum value over all color channels */
-        mcdc04_read_raw(su->s, CIEX, &val);
-        maxval = val;
-        mcdc04_read_raw(su->s, CIEY, &val);
-        maxval = (maxval > val) ? maxval : val;
-        mcdc04_read_raw(su->s, CIEZ, &val);
-        maxval = (maxval > val) ? maxval : val;
-
-        /* check value */
-        if (maxval <  (65535 / 3))
-            gain_idx++; /* level to small, increase gain */
-        else if (maxval < (2 * 65535 / 3))
-            break;
-        else
-            gain_idx--; /* level to big, decrease gain */
+        mcdc04_trigger_start(su->s);
+        tconv = mcdc04_get_tconv(su->s);
+        device_unlock(su->dev);
+        return device_wait(L, tconv, OP_CTX(gain_idx, OP_FINISH), lmcdc04_auto_adjust_gain_k);
     }
-    if (gain_idx >= ARRAYSIZE(iref_tbl))
-        gain_idx = -gain_idx + 1;
+    device_lock(su->dev);
+    if (lmcdc04_op_finish(su) < 0)
+        return luaL_error(L, "%s: reading the conversion failed", su->dev_name);
+    /* find maximum value over all color channels */
+    maxval = lmcdc04_max_raw(su);
+    gain_record(sensor, maxval);
+    if (maxval >= GAIN_SATURATED) {
+        /* the level is unknown, only a conversion at lower gain tells */
+        if (gain_idx > 0) {
+            gain_idx = (gain_idx > GAIN_SATURATED_STEP) ? gain_idx - GAIN_SATURATED_STEP : 0;
+            device_unlock(su->dev);
+            return lmcdc04_auto_adjust_gain_k(L, status, OP_CTX(gain_idx, OP_START));
+        }
+        next = -1; /* level to big even at the lowest gain */
+    } else if ((maxval >= MCDC04_GAIN_LOW) && (maxval < MCDC04_GAIN_HIGH))
+        next = gain_idx;
+    else
+        next = mcdc04_gain_predict(sensor->level);
+    /* the gain follows from the level, no further conversion */
+    gain_idx = next < 0 ? 0 : next >= MCDC04_GAIN_STEPS ? MCDC04_GAIN_STEPS - 1 : next;
+    if (gain_idx != sensor->gain_idx) {
+        mcdc04_set_gain(su->s, gain_idx);
+        sensor->gain_idx = gain_idx;
+    }
+    device_op_end(su->dev);
+    device_unlock(su->dev);
+    if (next >= MCDC04_GAIN_STEPS)
+        next = -next + 1;
 
-    lua_pushinteger(L, gain_idx);
+    lua_settop(L, 1);
+    lua_pushinteger(L, next);
     return 1;
 }
 
-static double vectors_dot_prod(const double *x, const double *y, int n)
+/** auto_adjust_gain
+ * \brief: sets the gain that puts the highest channel in the middle third
+ * of the ADC range
+ * \return the gain index, -1 if the light is too bright for the lowest
+ * gain, -get_max_gain() if too dark for the highest
+ *
+ * The gain is predicted from the level of the last reading of the sensor
+ * and the iref/tint scale factors, one conversion checks it. Only a
+ * saturated reading takes further conversions. Inside a coroutine every
+ * conversion yields, see measure.
+ */
+static int lmcdc04_auto_adjust_gain(lua_State *L)
 {
-    double res = 0.0;
-    int i;
-    for (i = 0; i < n; i++)
-    {
-        res += x[i] * y[i];
+    luaL_checkudata(L, 1, "Lmcdc04");
+    lua_settop(L, 1);
+    /* without a previous reading the search starts in mid position */
+    return lmcdc04_auto_adjust_gain_k(L, LUA_OK, OP_CTX(MCDC04_GAIN_STEPS / 2, OP_ACQUIRE));
+}
+
+/*
+ * Calibration channel argument. There is a matrix per channel, any other
+ * channel is an error.
+ */
+static int check_cal_channel(lua_State *L, int arg)
+{
+    lua_Integer ch = luaL_checkinteger(L, arg);
+
+    luaL_argcheck(L, (ch >= 0) && (ch < CAL_CHANNELS), arg, "calibration channel out of range");
+    return ch;
+}
+
+/** set_calibration
+ * \brief: sets the calibration matrix of a channel
+ * \param ch channel, 0 .. 15
+ * \param m 9 numbers, the 3-by-3 matrix row by row. Its columns weight
+ * the raw x, y and z of measure and window, OUT3, OUT1 and OUT2.
+ */
+static int lmcdc04_set_calibration(lua_State *L)
+{
+    lmcdc04_userdata_t *su;
+    double m[9];
+    int ch, i;
+
+    su = (lmcdc04_userdata_t *)luaL_checkudata(L, 1, "Lmcdc04");
+    ch = check_cal_channel(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    for (i = 0; i < 9; i++) {
+        lua_geti(L, 3, i + 1);
+        if (!lua_isnumber(L, -1))
+            return luaL_argerror(L, 3, "matrix needs 9 numbers");
+        m[i] = lua_tonumber(L, -1);
+        lua_pop(L, 1);
     }
-    return res;
+    memcpy(su->cal[ch], m, sizeof(m));
+    return 0;
 }
 
-static void matrix_vector_mult(const double **mat, const double *vec, double *result, int rows, int cols)
-{ // in matrix form: result = mat * vec;
-    int i;
-    for (i = 0; i < rows; i++)
-    {
-        result[i] = vectors_dot_prod(mat[i], vec, cols);
+/** get_calibration
+ * \brief: the calibration matrix of a channel, 9 numbers row by row
+ */
+static int lmcdc04_get_calibration(lua_State *L)
+{
+    lmcdc04_userdata_t *su;
+    int ch, i;
+
+    su = (lmcdc04_userdata_t *)luaL_checkudata(L, 1, "Lmcdc04");
+    ch = check_cal_channel(L, 2);
+    lua_createtable(L, 9, 0);
+    for (i = 0; i < 9; i++) {
+        lua_pushnumber(L, su->cal[ch][i]);
+        lua_rawseti(L, -2, i + 1);
     }
+    return 1;
 }
 
+/** apply_calibration
+ * \brief: calibrated colour of one raw sample, see calibrate
+ * \param ch calibration channel
+ * \param x, y, z raw values
+ * \return X, Y, Z and the chromaticity x, y, z
+ */
 static int lmcdc04_apply_calibration(lua_State *L)
 {
-    int ch;
-    double val, sum, s[3], t[3];
     lmcdc04_userdata_t *su;
+    double s[3], t[COLOUR_NUM];
+    double *raw[3] = {&s[0], &s[1], &s[2]}, *out[COLOUR_NUM];
+    int ch, c;
 
     su = (lmcdc04_userdata_t *)luaL_checkudata(L, 1, "Lmcdc04");
-    ch = luaL_checkinteger(L, 2); /* channel number, calibration has spatial components */
-    val = luaL_checknumber(L, 3); /*  */
-    sum = val;
-    s[0] = val;
-    val = luaL_checknumber(L, 4); /*  */
-    sum += val;
-    s[1] = val;
-    val = luaL_checknumber(L, 5); /*  */
-    sum += val;
-    s[2] = val;
-    matrix_vector_mult((const double **)(su->m), (const double *)s, t, 3, 3);
-    lua_pushnumber(L, t[0]);
-    lua_pushnumber(L, t[1]);
-    lua_pushnumber(L, t[2]);
-    lua_pushnumber(L, t[0]/sum);
-    lua_pushnumber(L, t[1]/sum);
-    lua_pushnumber(L, t[2]/sum);
+    ch = check_cal_channel(L, 2); /* channel number, calibration has spatial components */
+    for (c = 0; c < 3; c++)
+        s[c] = luaL_checknumber(L, 3 + c);
+    for (c = 0; c < COLOUR_NUM; c++)
+        out[c] = &t[c];
+    colour_kernel(su->cal[ch], raw, out, 1);
+    lua_pushnumber(L, t[COLOUR_X]);
+    lua_pushnumber(L, t[COLOUR_Y]);
+    lua_pushnumber(L, t[COLOUR_Z]);
+    lua_pushnumber(L, t[COLOUR_XC]);
+    lua_pushnumber(L, t[COLOUR_YC]);
+    lua_pushnumber(L, 1.0 - t[COLOUR_XC] - t[COLOUR_YC]);
     return 6;
 }
-static int lmcdc04_measure(lua_State *L)
+
+/*
+ * Raw value of sample i of the calibrate arguments, either one sequence of
+ * {x =, y =, z =} at arg or three sequences from arg on
+ */
+static double calibrate_raw(lua_State *L, int arg, bool split, int c, size_t i)
+{
+    static const char *fields[3] = {"x", "y", "z"};
+    double val;
+
+    if (split)
+        lua_geti(L, arg + c, i + 1);
+    else {
+        lua_geti(L, arg, i + 1);
+        if (!lua_istable(L, -1))
+            luaL_error(L, "sample %d is no table", (int)i + 1);
+        lua_getfield(L, -1, fields[c]);
+        lua_remove(L, -2);
+    }
+    if (!lua_isnumber(L, -1))
+        luaL_error(L, "sample %d has no number %s", (int)i + 1, fields[c]);
+    val = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return val;
+}
+
+/** calibrate
+ * \brief: calibrated colour of many raw samples at once
+ * \param ch calibration channel
+ * \param samples a sequence of {x =, y =, z =}, e.g. from window, or three
+ * sequences xs, ys, zs
+ * \return {X =, Y =, Z =, x =, y =, u =, v =, cct =}, a sequence each with
+ * CIE XYZ, xy, u'v' and the correlated colour temperature in K
+ */
+static int lmcdc04_calibrate(lua_State *L)
 {
-    unsigned int val;
-    double x, y, z, sum = 0.0;
     lmcdc04_userdata_t *su;
+    double *buf, *raw[3], *out[COLOUR_NUM];
+    bool split;
+    size_t n, i;
+    int ch, c;
+
     su = (lmcdc04_userdata_t *)luaL_checkudata(L, 1, "Lmcdc04");
+    ch = check_cal_channel(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    split = !lua_isnoneornil(L, 4);
+    n = luaL_len(L, 3);
+    if (split) {
+        luaL_checktype(L, 4, LUA_TTABLE);
+        luaL_checktype(L, 5, LUA_TTABLE);
+        luaL_argcheck(L, ((size_t)luaL_len(L, 4) == n) && ((size_t)luaL_len(L, 5) == n),
+                5, "sequences differ in length");
+    }
+    luaL_argcheck(L, n <= CAL_MAX_SAMPLES, 3, "too many samples");
+    /* a userdata, so errors while reading the samples don't leak it */
+    buf = (double *)lua_newuserdata(L, (3 + COLOUR_NUM) * (n ? n : 1) * sizeof(double));
+    for (c = 0; c < 3; c++)
+        raw[c] = buf + c * n;
+    for (c = 0; c < COLOUR_NUM; c++)
+        out[c] = buf + (3 + c) * n;
+    for (i = 0; i < n; i++)
+        for (c = 0; c < 3; c++)
+            raw[c][i] = calibrate_raw(L, 3, split, c, i);
+
+    colour_kernel(su->cal[ch], raw, out, n);
 
-    mcdc04_trigger(su->s);
-    mcdc04_read_raw(su->s, CIEX, &val);
-    x = (double)val;
-    sum += x;
-    lua_pushinteger(L, val);
-    mcdc04_read_raw(su->s, CIEY, &val);
-    y = (double)val;
-    sum += y;
-    lua_pushinteger(L, val);
-    mcdc04_read_raw(su->s, CIEZ, &val);
-    z = (double)val;
-    sum += z;
-    lua_pushinteger(L, val);
-    lua_pushnumber(L, x/sum);
-    lua_pushnumber(L, y/sum);
-    lua_pushnumber(L, z/sum);
+    lua_createtable(L, 0, COLOUR_NUM);
+    for (c = 0; c < COLOUR_NUM; c++) {
+        lua_createtable(L, n, 0);
+        for (i = 0; i < n; i++) {
+            lua_pushnumber(L, out[c][i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_setfield(L, -2, col_names[c]);
+    }
+    return 1;
+}
+
+/** read_all
+ * \brief: output registers of the last conversion, read in one burst
+ * \return x, y, z raw values, OUT0 and OUTINT
+ */
+static int lmcdc04_read_all(lua_State *L)
+{
+    unsigned int out[MCDC04_OUTPUTS];
+    lmcdc04_userdata_t *su;
+
+    su = (lmcdc04_userdata_t *)luaL_checkudata(L, 1, "Lmcdc04");
+    mcdc04_get_all(su->s, out);
+    lua_pushinteger(L, out[MCDC04_OUT_X]);
+    lua_pushinteger(L, out[MCDC04_OUT_Y]);
+    lua_pushinteger(L, out[MCDC04_OUT_Z]);
+    lua_pushinteger(L, out[0]);
+    lua_pushinteger(L, out[MCDC04_OUTPUTS - 1]);
+    return 5;
+}
+
+/*
+ * Continuation of measure, the context holds the phase
+ */
+static int lmcdc04_measure_k(lua_State *L, int status, lua_KContext ctx)
+{
+    lmcdc04_userdata_t *su = (lmcdc04_userdata_t *)lua_touserdata(L, 1);
+    unsigned int val[3];
+    double sum, tconv;
+
+    (void)status;
+    device_lock(su->dev);
+    if (ctx == OP_ACQUIRE) {
+        if (lmcdc04_op_begin(L, su))
+            return device_retry(L, su->dev, ctx, lmcdc04_measure_k);
+        mcdc04_trigger_start(su->s);
+        tconv = mcdc04_get_tconv(su->s);
+        device_unlock(su->dev);
+        return device_wait(L, tconv, OP_FINISH, lmcdc04_measure_k);
+    }
+    if (lmcdc04_op_finish(su) < 0)
+        return luaL_error(L, "%s: reading the conversion failed", su->dev_name);
+    mcdc04_get_xyz(su->s, &val[0], &val[1], &val[2]);
+    gain_record(su->sensor, lmcdc04_max_raw(su));
+    device_op_end(su->dev);
+    device_unlock(su->dev);
+
+    lua_settop(L, 1);
+    sum = (double)val[0] + val[1] + val[2];
+    lua_pushinteger(L, val[0]);
+    lua_pushinteger(L, val[1]);
+    lua_pushinteger(L, val[2]);
+    lua_pushnumber(L, val[0]/sum);
+    lua_pushnumber(L, val[1]/sum);
+    lua_pushnumber(L, val[2]/sum);
     return 6;
 }
 
+/** measure
+ * \brief: single conversion
+ * \return x, y, z raw values and x, y, z normalized to their sum
+ *
+ * Inside a coroutine the conversion time yields, other tracks run until
+ * the scheduler resumes the coroutine. Elsewhere it sleeps.
+ */
+static int lmcdc04_measure(lua_State *L)
+{
+    luaL_checkudata(L, 1, "Lmcdc04");
+    lua_settop(L, 1);
+    return lmcdc04_measure_k(L, LUA_OK, OP_ACQUIRE);
+}
+
 static const luaL_Reg lmcdc04_methods[] = {
     {"set_gain", lmcdc04_set_gain},
     {"set_measure_mode", lmcdc04_set_measure_mode},
     {"get_max_gain", lmcdc04_get_max_gain},
-    {"auto_adjust_gain", lmcdc04_auto_adjust_gain},
+    {"read_all", lmcdc04_read_all},
+    {"start_continuous", lmcdc04_start_continuous},
+    {"stop_continuous", lmcdc04_stop_continuous},
+    {"latest", lmcdc04_latest},
+    {"window", lmcdc04_window},
+    {"__gc", lmcdc04_destroy},
+    {NULL, NULL}
+};
+
+/* Calibration is kept per Lua state and needs no device access */
+static const luaL_Reg lmcdc04_cal_methods[] = {
     {"apply_calibration", lmcdc04_apply_calibration},
+    {"set_calibration", lmcdc04_set_calibration},
+    {"get_calibration", lmcdc04_get_calibration},
+    {"calibrate", lmcdc04_calibrate},
+    {NULL, NULL}
+};
+
+/* Methods that yield, not serialized through the device lock trampoline */
+static const luaL_Reg lmcdc04_async_methods[] = {
     {"measure", lmcdc04_measure},
-    {"__gc", lmcdc04_destroy},
+    {"auto_adjust_gain", lmcdc04_auto_adjust_gain},
+    {"wait_sample", lmcdc04_wait_sample},
     {NULL, NULL}
 };
 
@@ -288,8 +1068,12 @@ int luaopen_mcdc04(lua_State *L){
      */
     lua_setfield(L, -2, "__index");
 
-    /* Set the methods to the metatable that should be accessed via object:func */
-    luaL_setfuncs(L, lmcdc04_methods, 0);
+    /* Set the methods to the metatable that should be accessed via object:func,
+     * calls from different Lua states are serialized on the device lock */
+    device_setfuncs(L, "Lmcdc04", lmcdc04_methods);
+    /* waits yield, they can't run under the device lock */
+    device_setfuncs_async(L, lmcdc04_async_methods);
+    luaL_setfuncs(L, lmcdc04_cal_methods, 0);
 
     /* Register the object.func functions into the table that is at the top of the
      *      * stack. */
@@ -0,0 +1,33 @@
+#ifndef _RING_H_
+#define _RING_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Single writer ring of fixed size entries, e.g. the samples of an
+ * acquisition thread.
+ *
+ * Entries are numbered in push order, the first one is 1. The writer never
+ * waits, readers copy without a lock and drop what the writer may have
+ * overwritten meanwhile. The slot the writer fills next is not readable,
+ * so a ring of size entries keeps size - 1 of them.
+ */
+
+//  Opaque class structures to allow forward references
+typedef struct _ring_t ring_t;
+
+/* size entries of entry_size bytes, size is a power of two */
+ring_t *ring_create(size_t size, size_t entry_size);
+void ring_destroy(ring_t **self_p);
+/* Writer only */
+void ring_push(ring_t *self, const void *entry);
+/* Number of the latest entry, 0 if none */
+uint64_t ring_head(ring_t *self);
+/* Copies entry seq, -1 if it isn't written yet or was overwritten */
+int ring_get(ring_t *self, uint64_t seq, void *entry);
+/* Oldest entry newer than seq that is still kept, 0 if there is none */
+uint64_t ring_next(ring_t *self, uint64_t seq);
+/* Copies the latest n entries newer than since, oldest first. Returns their
+ * number, *first is the number of the first one */
+size_t ring_window(ring_t *self, size_t n, uint64_t since, void *entries, uint64_t *first);
+#endif
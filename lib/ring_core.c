@@ -0,0 +1,133 @@
+/* File: ring_core.c
+ *
+ * Single writer ring with lock free readers, see ring.h
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "ring.h"
+
+struct _ring_t {
+    size_t size; /* entries, a power of two */
+    size_t entry_size;
+    uint64_t head; /* entries pushed, atomic */
+    unsigned char *data;
+};
+
+ring_t *ring_create(size_t size, size_t entry_size)
+{
+    ring_t *self;
+
+    if ((size < 2) || (size & (size - 1)) || (entry_size == 0))
+        return NULL;
+    self = (ring_t *) calloc(1, (sizeof (ring_t)));
+    if (!self)
+        return NULL;
+    self->size = size;
+    self->entry_size = entry_size;
+    self->data = (unsigned char *) calloc(size, entry_size);
+    if (!self->data) {
+        ring_destroy(&self);
+        return NULL;
+    }
+    return self;
+}
+
+/*
+ * Destructor, no reader or writer may use the ring anymore
+ */
+void ring_destroy(ring_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        ring_t *self = *self_p;
+        free(self->data);
+        free(self);
+        *self_p = NULL;
+    }
+}
+
+static unsigned char *ring_slot(ring_t *self, uint64_t seq)
+{
+    return self->data + ((seq - 1) & (self->size - 1)) * self->entry_size;
+}
+
+/*
+ * Oldest entry that can't be overwritten while head is the latest, the
+ * writer may be filling the slot of head + 1 - size
+ */
+static uint64_t ring_oldest(ring_t *self, uint64_t head)
+{
+    return (head + 2 > self->size) ? head + 2 - self->size : 1;
+}
+
+void ring_push(ring_t *self, const void *entry)
+{
+    uint64_t head = __atomic_load_n(&self->head, __ATOMIC_RELAXED);
+
+    memcpy(ring_slot(self, head + 1), entry, self->entry_size);
+    __atomic_store_n(&self->head, head + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t ring_head(ring_t *self)
+{
+    return __atomic_load_n(&self->head, __ATOMIC_ACQUIRE);
+}
+
+int ring_get(ring_t *self, uint64_t seq, void *entry)
+{
+    uint64_t head = ring_head(self);
+
+    if ((seq == 0) || (seq > head) || (seq < ring_oldest(self, head)))
+        return -1;
+    memcpy(entry, ring_slot(self, seq), self->entry_size);
+    /* the writer may have got to it meanwhile */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&self->head, __ATOMIC_RELAXED);
+    return (seq < ring_oldest(self, head)) ? -1 : 0;
+}
+
+uint64_t ring_next(ring_t *self, uint64_t seq)
+{
+    uint64_t head = ring_head(self), oldest;
+
+    if (head <= seq)
+        return 0;
+    oldest = ring_oldest(self, head);
+    return (seq + 1 > oldest) ? seq + 1 : oldest;
+}
+
+size_t ring_window(ring_t *self, size_t n, uint64_t since, void *entries, uint64_t *first)
+{
+    uint64_t head = ring_head(self), from, valid, seq;
+    unsigned char *out = entries;
+    size_t count;
+
+    *first = 0;
+    if ((n == 0) || (head <= since))
+        return 0;
+    from = (head > n) ? head - n + 1 : 1;
+    if (from <= since)
+        from = since + 1;
+    if (from < ring_oldest(self, head))
+        from = ring_oldest(self, head);
+    for (seq = from; seq <= head; seq++)
+        memcpy(out + (seq - from) * self->entry_size, ring_slot(self, seq), self->entry_size);
+    /* entries the writer got to meanwhile may be torn */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    valid = ring_oldest(self, __atomic_load_n(&self->head, __ATOMIC_RELAXED));
+    if (valid > head)
+        return 0;
+    count = head - from + 1;
+    if (valid > from) {
+        count -= valid - from;
+        memmove(out, out + (valid - from) * self->entry_size, count * self->entry_size);
+        from = valid;
+    }
+    *first = from;
+    return count;
+}
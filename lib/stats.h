@@ -0,0 +1,16 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+/*
+ * Statistics of raw ADC conversions
+ */
+
+/* Mean and standard deviation of n raw levels */
+void stats_mean_std(const int *raw, int n, double *mean, double *std);
+/*
+ * Outlier rejection, reject is 'none', 'median' or 'trim'. Sorts raw in
+ * place, points kept to the first sample that is kept and returns their
+ * number.
+ */
+int stats_reject(int *raw, int n, const char *reject, double trim, int **kept);
+#endif
@@ -0,0 +1,80 @@
+/* File: stats_core.c
+ *
+ * Statistics of raw ADC conversions, see stats.h
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "stats.h"
+
+/* Least rejection limit, the quantization of the conversions */
+#define STATS_LSB 1.0
+
+static int compare_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * The sums are taken over integers relative to the first sample, the loop
+ * has no dependencies besides the two reductions and is vectorized by the
+ * compiler.
+ */
+void stats_mean_std(const int *raw, int n, double *mean, double *std)
+{
+    int64_t sum = 0, sumsq = 0;
+    int i, x0 = raw[0];
+    double var;
+
+    for (i = 0; i < n; i++) {
+        int64_t d = raw[i] - x0;
+        sum += d;
+        sumsq += d * d;
+    }
+    *mean = x0 + (double)sum / n;
+    var = (n > 1) ? ((double)sumsq - (double)sum * sum / n) / (n - 1) : 0.0;
+    *std = (var > 0.0) ? sqrt(var) : 0.0;
+}
+
+/*
+ * 'median': samples further than 3 sigma from the median are dropped,
+ *  sigma is estimated from the median absolute deviation. The limit is one
+ *  LSB at least, with more than half of the samples on the median the MAD
+ *  is 0 and would drop the plain conversion noise.
+ * 'trim': the lowest and highest fraction trim of the samples are dropped.
+ */
+int stats_reject(int *raw, int n, const char *reject, double trim, int **kept)
+{
+    int i, k, median, *dev;
+    double limit;
+
+    *kept = raw;
+    if ((n < 3) || (strcmp(reject, "none") == 0))
+        return n;
+    qsort(raw, n, sizeof(int), compare_int);
+    if (strcmp(reject, "trim") == 0) {
+        k = (int)(n * trim);
+        *kept = raw + k;
+        return n - 2 * k;
+    }
+    median = raw[n / 2];
+    dev = (int *)malloc(n * sizeof(int));
+    if (dev == NULL)
+        return n;
+    for (i = 0; i < n; i++)
+        dev[i] = abs(raw[i] - median);
+    qsort(dev, n, sizeof(int), compare_int);
+    /* 1.4826 * MAD estimates sigma of normally distributed samples */
+    limit = 3.0 * 1.4826 * dev[n / 2];
+    free(dev);
+    if (limit < STATS_LSB)
+        limit = STATS_LSB;
+    for (i = 0, k = 0; i < n; i++)
+        if (abs(raw[i] - median) <= limit)
+            raw[k++] = raw[i];
+    return k;
+}
@@ -9,8 +9,10 @@
 #include <fcntl.h>
 #include <time.h>
 #include "tlc5948a.h"
+#include "device.h"
 
 typedef struct {
+    device_t *dev; /* shared device, must be the first member */
     tlc5948a_t *s;
     char *spi_name;
 } ltlc5948a_userdata_t;
@@ -29,6 +31,7 @@ static int ltlc5948a_new(lua_State *L)
      * the member of the userdata in case initialization fails in some way. If
      * that happens we want the userdata to be in a consistent state for __gc. */
     su       = (ltlc5948a_userdata_t *)lua_newuserdata(L, sizeof(*su));
+    su->dev  = NULL;
     su->s    = NULL;
     su->spi_name = NULL;
 
@@ -37,8 +40,18 @@ static int ltlc5948a_new(lua_State *L)
     /* Set the metatable on the userdata. */
     lua_setmetatable(L, -2);
 
-    /* Create the data that comprises the userdata (the tlc5948a state). */
-    su->s    = tlc5948a_create(spi_name);
+    /* Create the data that comprises the userdata (the tlc5948a state),
+     * the led driver is shared by all Lua states */
+    su->dev  = device_claim(spi_name);
+    if (su->dev == NULL)
+        return luaL_error(L, "can't claim device %s", spi_name);
+    device_lock(su->dev);
+    su->s    = device_handle(su->dev);
+    if (su->s == NULL) {
+        su->s    = tlc5948a_create(spi_name);
+        device_set_handle(su->dev, su->s);
+    }
+    device_unlock(su->dev);
     su->spi_name = strdup(spi_name);
 
     return 1;
@@ -50,8 +63,16 @@ static int ltlc5948a_destroy(lua_State *L)
 
     su = (ltlc5948a_userdata_t *)luaL_checkudata(L, 1, "Ltlc5948a");
 
-    if (su->s != NULL)
-        tlc5948a_destroy(&(su->s));
+    if (su->dev != NULL) {
+        device_lock(su->dev);
+        /* the last user closes the led driver */
+        if ((device_refs(su->dev) == 1) && (su->s != NULL)) {
+            tlc5948a_destroy(&(su->s));
+            device_set_handle(su->dev, NULL);
+        }
+        device_unlock(su->dev);
+        device_release(&(su->dev));
+    }
     su->s = NULL;
 
     if (su->spi_name != NULL)
@@ -134,8 +155,9 @@ int luaopen_tlc5948a(lua_State *L){
      */
     lua_setfield(L, -2, "__index");
 
-    /* Set the methods to the metatable that should be accessed via object:func */
-    luaL_setfuncs(L, ltlc5948a_methods, 0);
+    /* Set the methods to the metatable that should be accessed via object:func,
+     * calls from different Lua states are serialized on the device lock */
+    device_setfuncs(L, "Ltlc5948a", ltlc5948a_methods);
 
     /* Register the object.func functions into the table that is at the top of the
      *      * stack. */
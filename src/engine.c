@@ -1,10 +1,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
+#include "engine.h"
+
+/* Registry key of the compiled chunk cache of a Lua state */
+#define ENGINE_CACHE_KEY "engine.cache"
 
 static const char *progname = "lua";
 /*
@@ -80,21 +85,243 @@ int engine_dofile (lua_State *L, const char *name, char *errbuf) {
 }
 
 
-int engine_dostring (lua_State *L, const char *s, const char *name, char *errbuf, int concurrent) {
+/*
+ ** Compiled chunk cache. Chunks sent with RUN and RUN_COOP are compiled
+ ** once and the resulting functions are kept in the registry. Entries are
+ ** found through a hash table keyed by a hash of the chunk text and name,
+ ** and kept in LRU order, the least recently used chunk is dropped when the
+ ** cache is full.
+ */
+typedef struct engine_chunk_s {
+    struct engine_chunk_s *prev;
+    struct engine_chunk_s *next;
+    struct engine_chunk_s *bucket_next; /* Next chunk in the same bucket */
+    uint64_t hash;              /* FNV-1a hash of the chunk text */
+    int concurrent;             /* Chunk is wrapped in 'runProcess()' */
+    char *name;                 /* Chunk name, e.g. the track */
+    size_t len;
+    char *source;               /* Chunk text, to rule out collisions */
+    int ref;                    /* Compiled function in the registry */
+} engine_chunk_t;
+
+typedef struct {
+    engine_chunk_t *head;       /* Most recently used */
+    engine_chunk_t *tail;       /* Least recently used */
+    engine_chunk_t **buckets;   /* Hash table, a power of two of chains */
+    size_t nbuckets;
+    size_t entries;
+    size_t capacity;
+    unsigned long hits;
+    unsigned long misses;
+} engine_cache_t;
+
+static int cache_gc (lua_State *L) {
+    engine_cache_t *cache = (engine_cache_t *)lua_touserdata(L, 1);
+    engine_chunk_t *chunk = cache->head;
+    while (chunk) {
+        engine_chunk_t *next = chunk->next;
+        free(chunk->name);
+        free(chunk->source);
+        free(chunk);
+        chunk = next;
+    }
+    cache->head = cache->tail = NULL;
+    cache->entries = 0;
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->nbuckets = 0;
+    return 0;
+}
+
+/*
+ ** Get the cache of this Lua state, create it on first use
+ */
+static engine_cache_t *cache_get (lua_State *L) {
+    engine_cache_t *cache;
+    if (lua_getfield(L, LUA_REGISTRYINDEX, ENGINE_CACHE_KEY) == LUA_TUSERDATA) {
+        cache = (engine_cache_t *)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return cache;
+    }
+    lua_pop(L, 1);
+    cache = (engine_cache_t *)lua_newuserdata(L, sizeof(engine_cache_t));
+    memset(cache, 0, sizeof(engine_cache_t));
+    cache->capacity = ENGINE_CACHE_SIZE;
+    /* About one entry per bucket when full */
+    for (cache->nbuckets = 1; cache->nbuckets < cache->capacity; cache->nbuckets *= 2)
+        ;
+    cache->buckets = (engine_chunk_t **)calloc(cache->nbuckets, sizeof(engine_chunk_t *));
+    if (cache->buckets == NULL)
+        cache->capacity = 0;
+    lua_newtable(L);
+    lua_pushcfunction(L, cache_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, ENGINE_CACHE_KEY);
+    return cache;
+}
+
+static uint64_t cache_hash (const char *s, size_t len, const char *name,
+        int concurrent) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)s[i];
+        hash *= 1099511628211ULL;
+    }
+    for (i = 0; name[i]; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash ^ (uint64_t)(concurrent != 0);
+}
+
+static void cache_unlink (engine_cache_t *cache, engine_chunk_t *chunk) {
+    if (chunk->prev) chunk->prev->next = chunk->next;
+    else cache->head = chunk->next;
+    if (chunk->next) chunk->next->prev = chunk->prev;
+    else cache->tail = chunk->prev;
+    chunk->prev = chunk->next = NULL;
+}
+
+static void cache_push_front (engine_cache_t *cache, engine_chunk_t *chunk) {
+    chunk->next = cache->head;
+    if (cache->head) cache->head->prev = chunk;
+    cache->head = chunk;
+    if (!cache->tail) cache->tail = chunk;
+}
+
+static engine_chunk_t **cache_bucket (engine_cache_t *cache, uint64_t hash) {
+    return &cache->buckets[hash & (cache->nbuckets - 1)];
+}
+
+static engine_chunk_t *cache_lookup (engine_cache_t *cache, uint64_t hash,
+        const char *s, size_t len, const char *name, int concurrent) {
+    engine_chunk_t *chunk;
+    if (cache->capacity == 0) return NULL;
+    for (chunk = *cache_bucket(cache, hash); chunk; chunk = chunk->bucket_next) {
+        if (chunk->hash == hash && chunk->len == len
+                && chunk->concurrent == concurrent
+                && memcmp(chunk->source, s, len) == 0
+                && strcmp(chunk->name, name) == 0) {
+            if (chunk != cache->head) {
+                cache_unlink(cache, chunk);
+                cache_push_front(cache, chunk);
+            }
+            return chunk;
+        }
+    }
+    return NULL;
+}
+
+/*
+ ** Remember the compiled function on top of the stack, the stack is left
+ ** untouched
+ */
+static void cache_insert (lua_State *L, engine_cache_t *cache, uint64_t hash,
+        const char *s, size_t len, const char *name, int concurrent) {
+    engine_chunk_t *chunk;
+    if (cache->capacity == 0) return;
+    if (cache->entries >= cache->capacity) {
+        engine_chunk_t **link;
+        chunk = cache->tail;
+        for (link = cache_bucket(cache, chunk->hash); *link != chunk; link = &(*link)->bucket_next)
+            ;
+        *link = chunk->bucket_next;
+        cache_unlink(cache, chunk);
+        luaL_unref(L, LUA_REGISTRYINDEX, chunk->ref);
+        free(chunk->name);
+        free(chunk->source);
+        free(chunk);
+        cache->entries--;
+    }
+    chunk = (engine_chunk_t *)calloc(1, sizeof(engine_chunk_t));
+    if (chunk == NULL) return;
+    chunk->source = (char *)malloc(len);
+    chunk->name = strdup(name);
+    if (chunk->source == NULL || chunk->name == NULL) {
+        free(chunk->name);
+        free(chunk->source);
+        free(chunk);
+        return;
+    }
+    memcpy(chunk->source, s, len);
+    chunk->hash = hash;
+    chunk->concurrent = concurrent;
+    chunk->len = len;
+    lua_pushvalue(L, -1);
+    chunk->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    cache_push_front(cache, chunk);
+    chunk->bucket_next = *cache_bucket(cache, hash);
+    *cache_bucket(cache, hash) = chunk;
+    cache->entries++;
+}
+
+/*
+ ** Reader feeding 'runProcess(' chunk ')' to lua_load piece by piece, so
+ ** the wrapped chunk never has to be assembled in memory
+ */
+typedef struct {
+    const char *parts[3];
+    size_t sizes[3];
+    int next;
+} wrap_reader_t;
+
+static const char *wrap_reader (lua_State *L, void *data, size_t *size) {
+    wrap_reader_t *reader = (wrap_reader_t *)data;
+    (void)L;
+    if (reader->next >= 3) {
+        *size = 0;
+        return NULL;
+    }
+    *size = reader->sizes[reader->next];
+    return reader->parts[reader->next++];
+}
+
+static int load_chunk (lua_State *L, const char *s, size_t len,
+        const char *name, int concurrent) {
     if (concurrent) {
         // It is assumed that s contains a lua function
         // Wrap this function with 'runProcess(s)' and do the call
-        const char *chunkprep = "runProcess(";
-        const char *chunkapp = ")";
-
-        /* Wrap 'runProcess()' arround the chunk of Lua code received */
-        char *lchunk = (char *)malloc(strlen(s) 
-                + strlen(chunkprep) + strlen(chunkapp) + 1);
-        strcpy(lchunk, chunkprep);
-        strcat(lchunk, s);
-        strcat(lchunk, chunkapp);
-        return dochunkcoop(L, luaL_loadbuffer(L, lchunk, strlen(lchunk), name), errbuf);
+        wrap_reader_t reader = {
+            { "runProcess(", s, ")" },
+            { strlen("runProcess("), len, 1 },
+            0
+        };
+        return lua_load(L, wrap_reader, &reader, name, NULL);
+    }
+    /* Text or precompiled chunks, like luaL_loadbuffer */
+    return luaL_loadbufferx(L, s, len, name, NULL);
+}
+
+int engine_dostring (lua_State *L, const char *s, const char *name, char *errbuf, int concurrent) {
+    size_t len = strlen(s);
+    engine_cache_t *cache = cache_get(L);
+    uint64_t hash = cache_hash(s, len, name, concurrent);
+    engine_chunk_t *chunk = cache_lookup(cache, hash, s, len, name, concurrent);
+    int status;
+
+    if (chunk) {
+        cache->hits++;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, chunk->ref);
+        status = LUA_OK;
     }
+    else {
+        cache->misses++;
+        status = load_chunk(L, s, len, name, concurrent);
+        if (status == LUA_OK)
+            cache_insert(L, cache, hash, s, len, name, concurrent);
+    }
+    if (concurrent)
+        return dochunkcoop(L, status, errbuf);
     else
-        return dochunk(L, luaL_loadbuffer(L, s, strlen(s), name), errbuf);
+        return dochunk(L, status, errbuf);
+}
+
+void engine_cache_stats (lua_State *L, engine_cache_stats_t *stats) {
+    engine_cache_t *cache = cache_get(L);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->entries = cache->entries;
+    stats->capacity = cache->capacity;
 }
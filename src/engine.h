@@ -1,5 +1,19 @@
 #ifndef __ENGINE_INCLUDE_H__
 #define __ENGINE_INCLUDE_H__
+
+/* Number of compiled chunks kept per Lua state */
+#ifndef ENGINE_CACHE_SIZE
+#define ENGINE_CACHE_SIZE 64
+#endif
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    size_t entries;
+    size_t capacity;
+} engine_cache_stats_t;
+
 int engine_dofile (lua_State *L, const char *name, char *errbuf);
 int engine_dostring (lua_State *L, const char *s, const char *name, char *errbuf, int concurrent); 
+void engine_cache_stats (lua_State *L, engine_cache_stats_t *stats);
 #endif
@@ -0,0 +1,324 @@
+/*
+ * Streaming JSON encoding of Lua and jansson values, see jsonenc.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <jansson.h>
+#include "jsonenc.h"
+
+/* Nesting limit for tables */
+#define JE_MAX_DEPTH 32
+
+/* Enough digits that every double reads back to the same value */
+#define JE_NUMBER_FORMAT "%.17g"
+
+/* Longest text of a number written by this encoder */
+#define JE_NUMBER_SIZE 32
+
+void je_reset (je_buffer_t *buf)
+{
+    buf->len = 0;
+    buf->failed = false;
+}
+
+void je_free (je_buffer_t *buf)
+{
+    free (buf->data);
+    buf->data = NULL;
+    buf->len = buf->size = 0;
+}
+
+/*
+ ** Make room for size more bytes, returns the write position or NULL
+ */
+static char *s_reserve (je_buffer_t *buf, size_t size)
+{
+    if (buf->failed)
+        return NULL;
+    if (buf->len + size > buf->size) {
+        size_t newsize = buf->size ? buf->size : 4096;
+        while (newsize < buf->len + size)
+            newsize *= 2;
+        char *data = (char *) realloc (buf->data, newsize);
+        if (data == NULL) {
+            buf->failed = true;
+            return NULL;
+        }
+        buf->data = data;
+        buf->size = newsize;
+    }
+    return buf->data + buf->len;
+}
+
+void je_write_raw (je_buffer_t *buf, const char *text, size_t len)
+{
+    char *dest = s_reserve (buf, len);
+    if (dest) {
+        memcpy (dest, text, len);
+        buf->len += len;
+    }
+}
+
+static void s_write_char (je_buffer_t *buf, char c)
+{
+    char *dest = s_reserve (buf, 1);
+    if (dest) {
+        *dest = c;
+        buf->len++;
+    }
+}
+
+void je_write_str (je_buffer_t *buf, const char *value, size_t len)
+{
+    static const char hex [] = "0123456789abcdef";
+    //  Worst case every byte becomes a \u00XX escape
+    char *dest = s_reserve (buf, len * 6 + 2);
+    size_t i;
+
+    if (!dest)
+        return;
+    *dest++ = '"';
+    for (i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) value [i];
+        switch (c) {
+            case '"':  *dest++ = '\\'; *dest++ = '"'; break;
+            case '\\': *dest++ = '\\'; *dest++ = '\\'; break;
+            case '\b': *dest++ = '\\'; *dest++ = 'b'; break;
+            case '\f': *dest++ = '\\'; *dest++ = 'f'; break;
+            case '\n': *dest++ = '\\'; *dest++ = 'n'; break;
+            case '\r': *dest++ = '\\'; *dest++ = 'r'; break;
+            case '\t': *dest++ = '\\'; *dest++ = 't'; break;
+            default:
+                if (c < 0x20) {
+                    memcpy (dest, "\\u00", 4);
+                    dest [4] = hex [c >> 4];
+                    dest [5] = hex [c & 0x0f];
+                    dest += 6;
+                }
+                else
+                    *dest++ = (char) c;
+        }
+    }
+    *dest++ = '"';
+    buf->len = dest - buf->data;
+}
+
+static void s_write_integer (je_buffer_t *buf, long long value)
+{
+    char *dest = s_reserve (buf, JE_NUMBER_SIZE);
+    if (dest)
+        buf->len += snprintf (dest, JE_NUMBER_SIZE, "%lld", value);
+}
+
+static void s_write_double (je_buffer_t *buf, double value)
+{
+    //  JSON has no NaN or infinity
+    if (!isfinite (value)) {
+        je_write_raw (buf, "null", 4);
+        return;
+    }
+    char *dest = s_reserve (buf, JE_NUMBER_SIZE);
+    if (dest)
+        buf->len += snprintf (dest, JE_NUMBER_SIZE, JE_NUMBER_FORMAT, value);
+}
+
+/*
+ ** Lua values
+ */
+static void s_encode_lua (je_buffer_t *buf, lua_State *L, int idx, int depth);
+
+static void s_encode_number (je_buffer_t *buf, lua_State *L, int idx)
+{
+    if (lua_isinteger (L, idx))
+        s_write_integer (buf, (long long) lua_tointeger (L, idx));
+    else
+        s_write_double (buf, (double) lua_tonumber (L, idx));
+}
+
+/*
+ ** Object keys must be strings, numbers and booleans are converted without
+ ** calling lua_tostring, which would change the key in the table
+ */
+static bool s_is_key (lua_State *L, int idx)
+{
+    int type = lua_type (L, idx);
+    return type == LUA_TSTRING || type == LUA_TNUMBER || type == LUA_TBOOLEAN;
+}
+
+static void s_encode_key (je_buffer_t *buf, lua_State *L, int idx)
+{
+    size_t len;
+    const char *key;
+    switch (lua_type (L, idx)) {
+        case LUA_TSTRING:
+            key = lua_tolstring (L, idx, &len);
+            je_write_str (buf, key, len);
+            break;
+        case LUA_TNUMBER:
+            s_write_char (buf, '"');
+            s_encode_number (buf, L, idx);
+            s_write_char (buf, '"');
+            break;
+        default:
+            if (lua_toboolean (L, idx))
+                je_write_raw (buf, "\"true\"", 6);
+            else
+                je_write_raw (buf, "\"false\"", 7);
+            break;
+    }
+}
+
+static void s_encode_table (je_buffer_t *buf, lua_State *L, int idx, int depth)
+{
+    size_t len = lua_rawlen (L, idx);
+    size_t count = 0;
+    size_t i;
+    bool sequence = len > 0;
+
+    if (len > 0) {
+        //  A table with keys 1..n only is a sequence. The length of a
+        //  table with holes is any border, so every key is checked
+        lua_pushnil (L);
+        while (lua_next (L, idx)) {
+            count++;
+            if (sequence) {
+                lua_Integer key = lua_isinteger (L, -2) ? lua_tointeger (L, -2) : 0;
+                sequence = key >= 1 && (size_t) key <= len;
+            }
+            lua_pop (L, 1);
+        }
+    }
+    if (sequence && count == len) {
+        //  Fast path for arrays of numbers, e.g. sample buffers
+        bool numbers = true;
+        for (i = 1; i <= len && numbers; i++) {
+            numbers = lua_rawgeti (L, idx, (lua_Integer) i) == LUA_TNUMBER;
+            lua_pop (L, 1);
+        }
+        s_write_char (buf, '[');
+        for (i = 1; i <= len; i++) {
+            if (i > 1)
+                s_write_char (buf, ',');
+            lua_rawgeti (L, idx, (lua_Integer) i);
+            if (numbers)
+                s_encode_number (buf, L, -1);
+            else
+                s_encode_lua (buf, L, lua_gettop (L), depth + 1);
+            lua_pop (L, 1);
+        }
+        s_write_char (buf, ']');
+        return;
+    }
+    s_write_char (buf, '{');
+    count = 0;
+    lua_pushnil (L);
+    while (lua_next (L, idx)) {
+        //  Keys that are tables, functions etc. are left out
+        if (s_is_key (L, -2)) {
+            if (count++)
+                s_write_char (buf, ',');
+            s_encode_key (buf, L, -2);
+            s_write_char (buf, ':');
+            s_encode_lua (buf, L, lua_gettop (L), depth + 1);
+        }
+        lua_pop (L, 1);
+    }
+    s_write_char (buf, '}');
+}
+
+static void s_encode_lua (je_buffer_t *buf, lua_State *L, int idx, int depth)
+{
+    switch (lua_type (L, idx)) {
+        case LUA_TBOOLEAN:
+            if (lua_toboolean (L, idx))
+                je_write_raw (buf, "true", 4);
+            else
+                je_write_raw (buf, "false", 5);
+            break;
+        case LUA_TNUMBER:
+            s_encode_number (buf, L, idx);
+            break;
+        case LUA_TSTRING: {
+            size_t len;
+            const char *value = lua_tolstring (L, idx, &len);
+            je_write_str (buf, value, len);
+            break;
+        }
+        case LUA_TTABLE:
+            if (depth < JE_MAX_DEPTH) {
+                luaL_checkstack (L, 3, "json encoder");
+                s_encode_table (buf, L, idx, depth);
+            }
+            else
+                je_write_raw (buf, "null", 4);
+            break;
+        default:
+            je_write_raw (buf, "null", 4);
+            break;
+    }
+}
+
+void je_encode_lua (je_buffer_t *buf, lua_State *L, int idx)
+{
+    s_encode_lua (buf, L, lua_absindex (L, idx), 0);
+}
+
+/*
+ ** jansson values
+ */
+void je_encode_json (je_buffer_t *buf, const json_t *json)
+{
+    switch (json_typeof (json)) {
+        case JSON_OBJECT: {
+            const char *key;
+            json_t *value;
+            bool first = true;
+            s_write_char (buf, '{');
+            json_object_foreach ((json_t *) json, key, value) {
+                if (!first)
+                    s_write_char (buf, ',');
+                je_write_str (buf, key, strlen (key));
+                s_write_char (buf, ':');
+                je_encode_json (buf, value);
+                first = false;
+            }
+            s_write_char (buf, '}');
+            break;
+        }
+        case JSON_ARRAY: {
+            size_t index;
+            json_t *value;
+            s_write_char (buf, '[');
+            json_array_foreach (json, index, value) {
+                if (index)
+                    s_write_char (buf, ',');
+                je_encode_json (buf, value);
+            }
+            s_write_char (buf, ']');
+            break;
+        }
+        case JSON_STRING:
+            je_write_str (buf, json_string_value (json), json_string_length (json));
+            break;
+        case JSON_INTEGER:
+            s_write_integer (buf, (long long) json_integer_value (json));
+            break;
+        case JSON_REAL:
+            s_write_double (buf, json_real_value (json));
+            break;
+        case JSON_TRUE:
+            je_write_raw (buf, "true", 4);
+            break;
+        case JSON_FALSE:
+            je_write_raw (buf, "false", 5);
+            break;
+        default:
+            je_write_raw (buf, "null", 4);
+            break;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef __JSONENC_INCLUDE_H__
+#define __JSONENC_INCLUDE_H__
+
+/*
+ * Streaming JSON encoder for the tracks protocol.
+ *
+ * Values are written as text straight into a buffer that is kept and
+ * reused from reply to reply, so encoding a reply does not allocate once
+ * the buffer has grown to the size of the largest reply.
+ */
+
+#include <stdbool.h>
+#include <lua.h>
+#include <jansson.h>
+
+typedef struct {
+    char *data;                 //  Encoded text, not null terminated
+    size_t len;                 //  Bytes used
+    size_t size;                //  Bytes allocated
+    bool failed;                //  Out of memory while encoding
+} je_buffer_t;
+
+//  Empty the buffer, keeping its memory
+void je_reset (je_buffer_t *buf);
+
+//  Free the memory of the buffer
+void je_free (je_buffer_t *buf);
+
+void je_write_raw (je_buffer_t *buf, const char *text, size_t len);
+void je_write_str (je_buffer_t *buf, const char *value, size_t len);
+
+//  Encode the Lua value at idx. Integers, floats and booleans are written
+//  as JSON numbers and booleans, sequences as arrays and other tables as
+//  objects. Numeric keys are written as strings without touching the
+//  table. Functions, userdata and threads are written as null.
+void je_encode_lua (je_buffer_t *buf, lua_State *L, int idx);
+
+//  Encode a jansson value
+void je_encode_json (je_buffer_t *buf, const json_t *json);
+
+#endif
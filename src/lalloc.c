@@ -0,0 +1,202 @@
+/*
+ * Pooled lua_Alloc, see lalloc.h
+ *
+ * Lua passes the size of a block whenever it frees or resizes it, so the
+ * size class of a block is known without a header. Freed small blocks go
+ * to the free list of their class and are reused first; the arena chunks
+ * themselves are only returned to the system when the allocator is
+ * destroyed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "lalloc.h"
+
+/* Size classes are multiples of LALLOC_STEP up to LALLOC_MAX_POOLED */
+#define LALLOC_STEP 16
+#define LALLOC_MAX_POOLED 256
+#define LALLOC_CLASSES (LALLOC_MAX_POOLED / LALLOC_STEP)
+
+/* Size of the arena chunks small blocks are carved from */
+#define LALLOC_CHUNK_SIZE (64 * 1024)
+
+typedef struct lalloc_block_s {
+    struct lalloc_block_s *next;
+} lalloc_block_t;
+
+/* Chunk header, padded so blocks keep the alignment of malloc */
+typedef union lalloc_chunk_u {
+    union lalloc_chunk_u *next;
+    char pad [LALLOC_STEP];
+} lalloc_chunk_t;
+
+struct _lalloc_t {
+    lalloc_block_t *free_list [LALLOC_CLASSES];
+    lalloc_chunk_t *chunks;     /* All arena chunks */
+    char *arena;                /* Unused rest of the newest chunk */
+    size_t arena_left;
+    size_t strays;              /* malloc'd blocks Lua knows by a pooled size */
+    lalloc_stats_t stats;
+};
+
+lalloc_t *lalloc_new (void)
+{
+    return (lalloc_t *) calloc (1, sizeof (lalloc_t));
+}
+
+void lalloc_destroy (lalloc_t **self_p)
+{
+    if (*self_p) {
+        lalloc_t *self = *self_p;
+        while (self->chunks) {
+            lalloc_chunk_t *next = self->chunks->next;
+            free (self->chunks);
+            self->chunks = next;
+        }
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+static inline size_t s_class (size_t size)
+{
+    return (size - 1) / LALLOC_STEP;
+}
+
+static void *s_pool_alloc (lalloc_t *self, size_t size)
+{
+    size_t index = s_class (size);
+    size_t block_size = (index + 1) * LALLOC_STEP;
+    lalloc_block_t *block = self->free_list [index];
+
+    if (block) {
+        self->free_list [index] = block->next;
+        return block;
+    }
+    if (self->arena_left < block_size) {
+        //  The rest of the old chunk is too small and stays unused
+        lalloc_chunk_t *chunk = (lalloc_chunk_t *) malloc (LALLOC_CHUNK_SIZE);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = self->chunks;
+        self->chunks = chunk;
+        self->arena = (char *) (chunk + 1);
+        self->arena_left = LALLOC_CHUNK_SIZE - sizeof (lalloc_chunk_t);
+        self->stats.arena += LALLOC_CHUNK_SIZE;
+    }
+    block = (lalloc_block_t *) self->arena;
+    self->arena += block_size;
+    self->arena_left -= block_size;
+    return block;
+}
+
+/*
+ ** Does the block lie in one of the arena chunks?
+ */
+static int s_pool_owns (lalloc_t *self, void *ptr)
+{
+    lalloc_chunk_t *chunk;
+    for (chunk = self->chunks; chunk; chunk = chunk->next)
+        if ((char *) ptr >= (char *) chunk
+                && (char *) ptr < (char *) chunk + LALLOC_CHUNK_SIZE)
+            return 1;
+    return 0;
+}
+
+static void s_pool_free (lalloc_t *self, void *ptr, size_t size)
+{
+    size_t index = s_class (size);
+    lalloc_block_t *block = (lalloc_block_t *) ptr;
+    block->next = self->free_list [index];
+    self->free_list [index] = block;
+}
+
+static void *s_alloc (lalloc_t *self, size_t size)
+{
+    void *ptr;
+    if (size <= LALLOC_MAX_POOLED)
+        ptr = s_pool_alloc (self, size);
+    else {
+        ptr = malloc (size);
+        self->stats.large++;
+    }
+    if (ptr) {
+        self->stats.bytes += size;
+        self->stats.blocks++;
+        self->stats.allocations++;
+        if (self->stats.bytes > self->stats.high_water)
+            self->stats.high_water = self->stats.bytes;
+    }
+    return ptr;
+}
+
+static void s_free (lalloc_t *self, void *ptr, size_t size)
+{
+    //  Only look for the owner while a stray block is around
+    if (size <= LALLOC_MAX_POOLED && self->strays && !s_pool_owns (self, ptr)) {
+        self->strays--;
+        free (ptr);
+    }
+    else
+    if (size <= LALLOC_MAX_POOLED)
+        s_pool_free (self, ptr, size);
+    else
+        free (ptr);
+    self->stats.bytes -= size;
+    self->stats.blocks--;
+}
+
+void *lalloc_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    lalloc_t *self = (lalloc_t *) ud;
+    void *newptr;
+
+    //  For new blocks osize is the type of the object, not a size
+    if (ptr == NULL)
+        return nsize ? s_alloc (self, nsize) : NULL;
+    if (nsize == 0) {
+        s_free (self, ptr, osize);
+        return NULL;
+    }
+    //  Large blocks are resized in place by realloc where possible
+    if (osize > LALLOC_MAX_POOLED && nsize > LALLOC_MAX_POOLED) {
+        newptr = realloc (ptr, nsize);
+        if (newptr == NULL && nsize < osize)
+            newptr = ptr;
+        if (newptr) {
+            self->stats.bytes = self->stats.bytes - osize + nsize;
+            if (self->stats.bytes > self->stats.high_water)
+                self->stats.high_water = self->stats.bytes;
+        }
+        return newptr;
+    }
+    //  A pooled block that stays in its size class is kept
+    if (osize <= LALLOC_MAX_POOLED && nsize <= LALLOC_MAX_POOLED
+            && s_class (osize) == s_class (nsize)) {
+        self->stats.bytes = self->stats.bytes - osize + nsize;
+        if (self->stats.bytes > self->stats.high_water)
+            self->stats.high_water = self->stats.bytes;
+        return ptr;
+    }
+    newptr = s_alloc (self, nsize);
+    if (newptr == NULL) {
+        //  Lua 5.3 assumes shrinking never fails, keep the bigger block.
+        //  A large block kept at a pooled size must go back to malloc
+        if (nsize < osize) {
+            if (osize > LALLOC_MAX_POOLED)
+                self->strays++;
+            self->stats.bytes = self->stats.bytes - osize + nsize;
+            return ptr;
+        }
+        return NULL;
+    }
+    memcpy (newptr, ptr, osize < nsize ? osize : nsize);
+    s_free (self, ptr, osize);
+    self->stats.allocations--;  /* A move is not a new allocation */
+    return newptr;
+}
+
+void lalloc_stats (lalloc_t *self, lalloc_stats_t *stats)
+{
+    *stats = self->stats;
+}
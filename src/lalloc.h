@@ -0,0 +1,36 @@
+#ifndef __LALLOC_INCLUDE_H__
+#define __LALLOC_INCLUDE_H__
+
+/*
+ * Pooled lua_Alloc for the tracks Lua states.
+ *
+ * Blocks up to LALLOC_MAX_POOLED bytes come from per size-class free lists
+ * carved out of large arena chunks, bigger blocks go to malloc. Every
+ * allocator serves exactly one Lua state and keeps counters for it.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct _lalloc_t lalloc_t;
+
+typedef struct {
+    size_t bytes;               //  Bytes in use by the Lua state
+    size_t high_water;          //  Largest value of bytes so far
+    size_t blocks;              //  Blocks in use by the Lua state
+    uint64_t allocations;       //  Blocks handed out since creation
+    uint64_t large;             //  Allocations too big for the pools
+    size_t arena;               //  Bytes held in arena chunks
+} lalloc_stats_t;
+
+lalloc_t *lalloc_new (void);
+
+//  Destroy the allocator, only after the Lua state using it was closed
+void lalloc_destroy (lalloc_t **self_p);
+
+//  The lua_Alloc function, pass the allocator as ud to lua_newstate
+void *lalloc_alloc (void *ud, void *ptr, size_t osize, size_t nsize);
+
+void lalloc_stats (lalloc_t *self, lalloc_stats_t *stats);
+
+#endif
@@ -37,6 +37,7 @@ static const char *host = "192.168.16.15";
 static const char *user = "root";
 static const char *password = "V0st!novaled#";
 static const char *database = "nlts";
+static int workers = 0;
 
 static  ldms_config_t *ldms_config;
 
@@ -93,11 +94,12 @@ static const char * get_mac_addr (void)
 
 static void print_usage(const char *prog)
 {
-    printf("Usage: %s [-vpuPh]\n", prog);
+    printf("Usage: %s [-vpuPwh]\n", prog);
     puts("  -v --verbose  Print debugging messages\n"
             "  -p --port     Port number to use for connection\n"
             "  -u --user     User for login if not current user\n"
             "  -P --password Password for login\n"
+            "  -w --workers  Number of Lua worker states (default 0)\n"
             "  -h --host     Connect to host\n"
         );
     exit(1);
@@ -112,11 +114,12 @@ static void parse_opts(int argc, char *argv[])
             { "password",   1, 0, 'p' },
             { "user",   1, 0, 'u' },
             { "host",   1, 0, 'h' },
+            { "workers",   1, 0, 'w' },
             { NULL, 0, 0, 0 },
         };
         int c;
 
-        c = getopt_long(argc, argv, "vP:p:u:h", lopts, NULL);
+        c = getopt_long(argc, argv, "vP:p:u:w:h", lopts, NULL);
 
         if (c == -1)
             break;
@@ -134,6 +137,9 @@ static void parse_opts(int argc, char *argv[])
             case 'P':
                 password = optarg;
                 break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
             default:
                 print_usage(argv[0]);
                 break;
@@ -179,6 +185,8 @@ static void ldms_start_lua_tracks (ldms_t *self)
     assert (self->lua_tracks);
     zsys_info ("Lua tracks service initialized");
 
+    if (workers > 0)
+        zsock_send (self->lua_tracks, "si", "WORKERS", workers);
     zsock_send (self->lua_tracks, "si", "CONFIGURE", LUA_TRACKS_PORT);
     char *hostname = zstr_recv (self->lua_tracks);
     if (!*hostname) {
@@ -0,0 +1,398 @@
+/*
+ * MessagePack encoding of Lua and jansson values, see msgpack.h
+ */
+
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <jansson.h>
+#include "msgpack.h"
+
+/* Nesting limit for tables and decoded containers */
+#define MP_MAX_DEPTH 32
+
+static void s_put (mp_writer_t *w, const void *data, size_t size)
+{
+    if (w->data && w->pos + size <= w->size)
+        memcpy (w->data + w->pos, data, size);
+    w->pos += size;
+}
+
+static void s_put_be (mp_writer_t *w, uint8_t tag, uint64_t value, int bytes)
+{
+    uint8_t buf [9];
+    int i;
+    buf [0] = tag;
+    for (i = bytes; i > 0; i--) {
+        buf [i] = (uint8_t) value;
+        value >>= 8;
+    }
+    s_put (w, buf, bytes + 1);
+}
+
+void mp_write_nil (mp_writer_t *w)
+{
+    uint8_t tag = 0xc0;
+    s_put (w, &tag, 1);
+}
+
+void mp_write_bool (mp_writer_t *w, bool value)
+{
+    uint8_t tag = value ? 0xc3 : 0xc2;
+    s_put (w, &tag, 1);
+}
+
+void mp_write_int (mp_writer_t *w, int64_t value)
+{
+    if (value >= 0) {
+        if (value < 128) {
+            uint8_t tag = (uint8_t) value;
+            s_put (w, &tag, 1);
+        }
+        else if (value <= UINT8_MAX)
+            s_put_be (w, 0xcc, value, 1);
+        else if (value <= UINT16_MAX)
+            s_put_be (w, 0xcd, value, 2);
+        else if (value <= UINT32_MAX)
+            s_put_be (w, 0xce, value, 4);
+        else
+            s_put_be (w, 0xcf, value, 8);
+    }
+    else {
+        if (value >= -32) {
+            uint8_t tag = (uint8_t) (int8_t) value;
+            s_put (w, &tag, 1);
+        }
+        else if (value >= INT8_MIN)
+            s_put_be (w, 0xd0, (uint64_t) value, 1);
+        else if (value >= INT16_MIN)
+            s_put_be (w, 0xd1, (uint64_t) value, 2);
+        else if (value >= INT32_MIN)
+            s_put_be (w, 0xd2, (uint64_t) value, 4);
+        else
+            s_put_be (w, 0xd3, (uint64_t) value, 8);
+    }
+}
+
+void mp_write_double (mp_writer_t *w, double value)
+{
+    uint64_t bits;
+    memcpy (&bits, &value, sizeof (bits));
+    s_put_be (w, 0xcb, bits, 8);
+}
+
+void mp_write_str (mp_writer_t *w, const char *value, size_t len)
+{
+    if (len < 32) {
+        uint8_t tag = 0xa0 | (uint8_t) len;
+        s_put (w, &tag, 1);
+    }
+    else if (len <= UINT8_MAX)
+        s_put_be (w, 0xd9, len, 1);
+    else if (len <= UINT16_MAX)
+        s_put_be (w, 0xda, len, 2);
+    else
+        s_put_be (w, 0xdb, len, 4);
+    s_put (w, value, len);
+}
+
+void mp_write_array (mp_writer_t *w, uint32_t count)
+{
+    if (count < 16) {
+        uint8_t tag = 0x90 | (uint8_t) count;
+        s_put (w, &tag, 1);
+    }
+    else if (count <= UINT16_MAX)
+        s_put_be (w, 0xdc, count, 2);
+    else
+        s_put_be (w, 0xdd, count, 4);
+}
+
+void mp_write_map (mp_writer_t *w, uint32_t count)
+{
+    if (count < 16) {
+        uint8_t tag = 0x80 | (uint8_t) count;
+        s_put (w, &tag, 1);
+    }
+    else if (count <= UINT16_MAX)
+        s_put_be (w, 0xde, count, 2);
+    else
+        s_put_be (w, 0xdf, count, 4);
+}
+
+/*
+ ** Lua values
+ */
+static void s_encode_lua (mp_writer_t *w, lua_State *L, int idx, int depth);
+
+static void s_encode_table (mp_writer_t *w, lua_State *L, int idx, int depth)
+{
+    size_t len = lua_rawlen (L, idx);
+    uint32_t count = 0;
+    bool sequence = len > 0;
+
+    //  Count the keys, a table with keys 1..n only is a sequence. The
+    //  length of a table with holes is any border, so every key is checked
+    lua_pushnil (L);
+    while (lua_next (L, idx)) {
+        count++;
+        if (sequence) {
+            lua_Integer key = lua_isinteger (L, -2) ? lua_tointeger (L, -2) : 0;
+            sequence = key >= 1 && (size_t) key <= len;
+        }
+        lua_pop (L, 1);
+    }
+    if (sequence && count == len) {
+        size_t i;
+        mp_write_array (w, count);
+        for (i = 1; i <= len; i++) {
+            lua_rawgeti (L, idx, (lua_Integer) i);
+            s_encode_lua (w, L, lua_gettop (L), depth + 1);
+            lua_pop (L, 1);
+        }
+        return;
+    }
+    mp_write_map (w, count);
+    lua_pushnil (L);
+    while (lua_next (L, idx)) {
+        //  Keys keep their type, lua_tostring would convert them in place
+        s_encode_lua (w, L, lua_gettop (L) - 1, depth + 1);
+        s_encode_lua (w, L, lua_gettop (L), depth + 1);
+        lua_pop (L, 1);
+    }
+}
+
+static void s_encode_lua (mp_writer_t *w, lua_State *L, int idx, int depth)
+{
+    switch (lua_type (L, idx)) {
+        case LUA_TBOOLEAN:
+            mp_write_bool (w, lua_toboolean (L, idx));
+            break;
+        case LUA_TNUMBER:
+            if (lua_isinteger (L, idx))
+                mp_write_int (w, (int64_t) lua_tointeger (L, idx));
+            else
+                mp_write_double (w, (double) lua_tonumber (L, idx));
+            break;
+        case LUA_TSTRING: {
+            size_t len;
+            const char *value = lua_tolstring (L, idx, &len);
+            mp_write_str (w, value, len);
+            break;
+        }
+        case LUA_TTABLE:
+            if (depth < MP_MAX_DEPTH) {
+                luaL_checkstack (L, 3, "msgpack encoder");
+                s_encode_table (w, L, idx, depth);
+            }
+            else
+                mp_write_nil (w);
+            break;
+        default:
+            mp_write_nil (w);
+            break;
+    }
+}
+
+void mp_encode_lua (mp_writer_t *w, lua_State *L, int idx)
+{
+    s_encode_lua (w, L, lua_absindex (L, idx), 0);
+}
+
+/*
+ ** jansson values
+ */
+void mp_encode_json (mp_writer_t *w, const json_t *json)
+{
+    switch (json_typeof (json)) {
+        case JSON_OBJECT: {
+            const char *key;
+            json_t *value;
+            mp_write_map (w, (uint32_t) json_object_size (json));
+            json_object_foreach ((json_t *) json, key, value) {
+                mp_write_str (w, key, strlen (key));
+                mp_encode_json (w, value);
+            }
+            break;
+        }
+        case JSON_ARRAY: {
+            size_t index;
+            json_t *value;
+            mp_write_array (w, (uint32_t) json_array_size (json));
+            json_array_foreach (json, index, value)
+                mp_encode_json (w, value);
+            break;
+        }
+        case JSON_STRING:
+            mp_write_str (w, json_string_value (json), json_string_length (json));
+            break;
+        case JSON_INTEGER:
+            mp_write_int (w, (int64_t) json_integer_value (json));
+            break;
+        case JSON_REAL:
+            mp_write_double (w, json_real_value (json));
+            break;
+        case JSON_TRUE:
+            mp_write_bool (w, true);
+            break;
+        case JSON_FALSE:
+            mp_write_bool (w, false);
+            break;
+        default:
+            mp_write_nil (w);
+            break;
+    }
+}
+
+bool mp_is_map (const uint8_t *data, size_t size)
+{
+    return size > 0
+        && ((data [0] & 0xf0) == 0x80 || data [0] == 0xde || data [0] == 0xdf);
+}
+
+/*
+ ** Decoder
+ */
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+} mp_reader_t;
+
+static bool s_get_be (mp_reader_t *r, int bytes, uint64_t *value)
+{
+    int i;
+    if (r->size - r->pos < (size_t) bytes)
+        return false;
+    *value = 0;
+    for (i = 0; i < bytes; i++)
+        *value = (*value << 8) | r->data [r->pos++];
+    return true;
+}
+
+static json_t *s_decode (mp_reader_t *r, int depth);
+
+static json_t *s_decode_str (mp_reader_t *r, size_t len)
+{
+    if (r->size - r->pos < len)
+        return NULL;
+    json_t *value = json_stringn_nocheck ((const char *) r->data + r->pos, len);
+    r->pos += len;
+    return value;
+}
+
+static json_t *s_decode_array (mp_reader_t *r, uint32_t count, int depth)
+{
+    json_t *array = json_array ();
+    uint32_t i;
+    for (i = 0; array && i < count; i++) {
+        json_t *value = s_decode (r, depth + 1);
+        if (!value || json_array_append_new (array, value)) {
+            json_decref (array);
+            return NULL;
+        }
+    }
+    return array;
+}
+
+static json_t *s_decode_map (mp_reader_t *r, uint32_t count, int depth)
+{
+    json_t *object = json_object ();
+    uint32_t i;
+    for (i = 0; object && i < count; i++) {
+        json_t *key = s_decode (r, depth + 1);
+        json_t *value = key ? s_decode (r, depth + 1) : NULL;
+        if (!value || !json_is_string (key)) {
+            json_decref (value);
+            json_decref (key);
+            json_decref (object);
+            return NULL;
+        }
+        //  The value is consumed even if this fails
+        int rc = json_object_set_new (object, json_string_value (key), value);
+        json_decref (key);
+        if (rc) {
+            json_decref (object);
+            return NULL;
+        }
+    }
+    return object;
+}
+
+static json_t *s_decode (mp_reader_t *r, int depth)
+{
+    uint64_t value;
+    uint8_t tag;
+
+    if (depth > MP_MAX_DEPTH || r->pos >= r->size)
+        return NULL;
+    tag = r->data [r->pos++];
+    if (tag < 0x80)
+        return json_integer (tag);
+    if (tag >= 0xe0)
+        return json_integer ((int8_t) tag);
+    if ((tag & 0xf0) == 0x80)
+        return s_decode_map (r, tag & 0x0f, depth);
+    if ((tag & 0xf0) == 0x90)
+        return s_decode_array (r, tag & 0x0f, depth);
+    if ((tag & 0xe0) == 0xa0)
+        return s_decode_str (r, tag & 0x1f);
+
+    switch (tag) {
+        case 0xc0: return json_null ();
+        case 0xc2: return json_false ();
+        case 0xc3: return json_true ();
+        //  bin 8/16/32 and str 8/16/32
+        case 0xc4: case 0xd9:
+            return s_get_be (r, 1, &value) ? s_decode_str (r, value) : NULL;
+        case 0xc5: case 0xda:
+            return s_get_be (r, 2, &value) ? s_decode_str (r, value) : NULL;
+        case 0xc6: case 0xdb:
+            return s_get_be (r, 4, &value) ? s_decode_str (r, value) : NULL;
+        case 0xca: {
+            float real;
+            uint32_t bits;
+            if (!s_get_be (r, 4, &value))
+                return NULL;
+            bits = (uint32_t) value;
+            memcpy (&real, &bits, sizeof (real));
+            return json_real (real);
+        }
+        case 0xcb: {
+            double real;
+            if (!s_get_be (r, 8, &value))
+                return NULL;
+            memcpy (&real, &value, sizeof (real));
+            return json_real (real);
+        }
+        case 0xcc: return s_get_be (r, 1, &value) ? json_integer (value) : NULL;
+        case 0xcd: return s_get_be (r, 2, &value) ? json_integer (value) : NULL;
+        case 0xce: return s_get_be (r, 4, &value) ? json_integer (value) : NULL;
+        case 0xcf: return s_get_be (r, 8, &value) ? json_integer ((json_int_t) value) : NULL;
+        case 0xd0: return s_get_be (r, 1, &value) ? json_integer ((int8_t) value) : NULL;
+        case 0xd1: return s_get_be (r, 2, &value) ? json_integer ((int16_t) value) : NULL;
+        case 0xd2: return s_get_be (r, 4, &value) ? json_integer ((int32_t) value) : NULL;
+        case 0xd3: return s_get_be (r, 8, &value) ? json_integer ((int64_t) value) : NULL;
+        case 0xdc:
+            return s_get_be (r, 2, &value) ? s_decode_array (r, (uint32_t) value, depth) : NULL;
+        case 0xdd:
+            return s_get_be (r, 4, &value) ? s_decode_array (r, (uint32_t) value, depth) : NULL;
+        case 0xde:
+            return s_get_be (r, 2, &value) ? s_decode_map (r, (uint32_t) value, depth) : NULL;
+        case 0xdf:
+            return s_get_be (r, 4, &value) ? s_decode_map (r, (uint32_t) value, depth) : NULL;
+        default:
+            return NULL;            //  Extension types are not used
+    }
+}
+
+json_t *mp_decode_json (const uint8_t *data, size_t size)
+{
+    mp_reader_t reader = { data, size, 0 };
+    json_t *json = s_decode (&reader, 0);
+    if (json && reader.pos != size) {
+        json_decref (json);
+        json = NULL;
+    }
+    return json;
+}
@@ -0,0 +1,45 @@
+#ifndef __MSGPACK_INCLUDE_H__
+#define __MSGPACK_INCLUDE_H__
+
+/*
+ * Minimal MessagePack encoder and decoder for the tracks protocol.
+ *
+ * The writer either counts the bytes an encoding needs (data == NULL) or
+ * fills a buffer of known size, so a reply can be sized first and then be
+ * encoded straight into the data of a zframe_t.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <lua.h>
+#include <jansson.h>
+
+typedef struct {
+    uint8_t *data;              //  Output buffer, NULL to count bytes only
+    size_t size;                //  Size of the output buffer
+    size_t pos;                 //  Bytes written or needed so far
+} mp_writer_t;
+
+void mp_write_nil (mp_writer_t *w);
+void mp_write_bool (mp_writer_t *w, bool value);
+void mp_write_int (mp_writer_t *w, int64_t value);
+void mp_write_double (mp_writer_t *w, double value);
+void mp_write_str (mp_writer_t *w, const char *value, size_t len);
+void mp_write_array (mp_writer_t *w, uint32_t count);
+void mp_write_map (mp_writer_t *w, uint32_t count);
+
+//  Encode the Lua value at idx. Integers and floats keep their type,
+//  sequences become arrays, other tables become maps.
+void mp_encode_lua (mp_writer_t *w, lua_State *L, int idx);
+
+//  Encode a jansson value
+void mp_encode_json (mp_writer_t *w, const json_t *json);
+
+//  Does the buffer start with a MessagePack map (a JSON text never does)?
+bool mp_is_map (const uint8_t *data, size_t size);
+
+//  Decode a MessagePack buffer into a new jansson value, NULL if malformed.
+//  Map keys must be strings, binary data is decoded as a string.
+json_t *mp_decode_json (const uint8_t *data, size_t size);
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * Lua profiler for the tracks actor, see profiler.h
+ */
+
+#include <czmq.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <jansson.h>
+#include "profiler.h"
+
+/* Instructions between two count hooks */
+#define PROFILER_COUNT 1000
+
+/* Deepest stack kept in a folded key, and size of a key */
+#define PROFILER_MAX_DEPTH 32
+#define PROFILER_KEY_SIZE 1024
+
+typedef struct {
+    uint64_t instructions;
+    uint64_t wall_us;
+} profiler_entry_t;
+
+struct _profiler_t {
+    zhashx_t *entries;          /* profiler_entry_t per folded stack */
+    profiler_entry_t *current;  /* Stack running since the last event */
+    int64_t last;               /* Time of the last event in usecs */
+    bool running;               /* Inside profiler_enter/leave */
+    bool enabled;
+};
+
+/* Registry key of the profiler of a Lua state */
+static const char s_registry_key = 'P';
+
+static void s_entry_destroy (void **item)
+{
+    free (*item);
+    *item = NULL;
+}
+
+profiler_t *profiler_new (void)
+{
+    profiler_t *self = (profiler_t *) zmalloc (sizeof (profiler_t));
+    assert (self);
+    self->entries = zhashx_new ();
+    assert (self->entries);
+    zhashx_set_destructor (self->entries, s_entry_destroy);
+    return self;
+}
+
+void profiler_destroy (profiler_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        profiler_t *self = *self_p;
+        zhashx_destroy (&self->entries);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+/*
+ ** Build the folded stack of L, root first, skipping the innermost skip
+ ** frames
+ */
+static void s_folded_stack (lua_State *L, int skip, char *key, size_t size)
+{
+    lua_Debug frames [PROFILER_MAX_DEPTH];
+    int depth = 0;
+    size_t len = 0;
+
+    while (depth < PROFILER_MAX_DEPTH && lua_getstack (L, depth + skip, &frames [depth])) {
+        lua_getinfo (L, "Sn", &frames [depth]);
+        depth++;
+    }
+    key [0] = 0;
+    while (depth-- > 0 && len < size) {
+        lua_Debug *ar = &frames [depth];
+        int n;
+        if (*ar->what == 'C')
+            n = snprintf (key + len, size - len, "%s%s@[C]",
+                    len? ";": "", ar->name? ar->name: "?");
+        else
+            n = snprintf (key + len, size - len, "%s%s@%s:%d",
+                    len? ";": "", ar->name? ar->name: *ar->what == 'm'? "main": "?",
+                    ar->short_src, ar->linedefined);
+        if (n < 0)
+            break;
+        len += n;
+    }
+    //  Spaces separate the count in the folded format
+    for (len = 0; key [len]; len++)
+        if (key [len] == ' ')
+            key [len] = '_';
+}
+
+static profiler_entry_t *s_lookup (profiler_t *self, const char *key)
+{
+    profiler_entry_t *entry = (profiler_entry_t *) zhashx_lookup (self->entries, key);
+    if (!entry) {
+        entry = (profiler_entry_t *) zmalloc (sizeof (profiler_entry_t));
+        assert (entry);
+        zhashx_insert (self->entries, key, entry);
+    }
+    return entry;
+}
+
+/*
+ ** Give the time since the last event to the stack that was running
+ */
+static void s_account (profiler_t *self, int64_t now)
+{
+    if (self->running && self->current)
+        self->current->wall_us += now - self->last;
+    self->last = now;
+}
+
+static void s_hook (lua_State *L, lua_Debug *ar)
+{
+    char key [PROFILER_KEY_SIZE];
+    profiler_t *self;
+
+    lua_rawgetp (L, LUA_REGISTRYINDEX, &s_registry_key);
+    self = (profiler_t *) lua_touserdata (L, -1);
+    lua_pop (L, 1);
+    if (!self || !self->enabled) {
+        //  A coroutine that inherited the hooks drops them on its first
+        //  event after the profiler was stopped
+        lua_sethook (L, NULL, 0, 0);
+        return;
+    }
+    if (!self->running)
+        return;
+
+    s_account (self, zclock_usecs ());
+    if (ar->event == LUA_HOOKCOUNT) {
+        s_folded_stack (L, 0, key, sizeof (key));
+        self->current = s_lookup (self, key);
+        self->current->instructions += PROFILER_COUNT;
+    }
+    else
+    if (ar->event == LUA_HOOKRET) {
+        //  The returning function is still on the stack
+        s_folded_stack (L, 1, key, sizeof (key));
+        self->current = key [0]? s_lookup (self, key): NULL;
+    }
+    else {
+        s_folded_stack (L, 0, key, sizeof (key));
+        self->current = s_lookup (self, key);
+    }
+}
+
+void profiler_start (profiler_t *self, lua_State *L)
+{
+    lua_pushlightuserdata (L, self);
+    lua_rawsetp (L, LUA_REGISTRYINDEX, &s_registry_key);
+    lua_sethook (L, s_hook, LUA_MASKCALL | LUA_MASKRET | LUA_MASKCOUNT, PROFILER_COUNT);
+    self->enabled = true;
+}
+
+void profiler_stop (profiler_t *self, lua_State *L)
+{
+    //  Coroutines keep their hooks until their next event, s_hook clears
+    //  them then
+    if (L)
+        lua_sethook (L, NULL, 0, 0);
+    self->enabled = false;
+    self->current = NULL;
+}
+
+bool profiler_enabled (profiler_t *self)
+{
+    return self->enabled;
+}
+
+void profiler_reset (profiler_t *self)
+{
+    self->current = NULL;
+    zhashx_purge (self->entries);
+}
+
+void profiler_enter (profiler_t *self)
+{
+    self->last = zclock_usecs ();
+    self->current = NULL;
+    self->running = true;
+}
+
+void profiler_leave (profiler_t *self)
+{
+    s_account (self, zclock_usecs ());
+    self->current = NULL;
+    self->running = false;
+}
+
+typedef struct {
+    const char *track;
+    uint64_t instructions;
+    uint64_t wall_us;
+} profiler_track_t;
+
+static int s_compare_tracks (const void *a, const void *b)
+{
+    const profiler_track_t *ta = (const profiler_track_t *) a;
+    const profiler_track_t *tb = (const profiler_track_t *) b;
+    if (ta->wall_us != tb->wall_us)
+        return ta->wall_us < tb->wall_us? 1: -1;
+    if (ta->instructions != tb->instructions)
+        return ta->instructions < tb->instructions? 1: -1;
+    return strcmp (ta->track, tb->track);
+}
+
+json_t *profiler_report (profiler_t *self, size_t top, bool by_instructions)
+{
+    size_t count = zhashx_size (self->entries);
+    profiler_track_t *tracks = (profiler_track_t *) calloc (count + 1, sizeof (profiler_track_t));
+    size_t ntracks = 0;
+    char *folded = NULL;
+    size_t folded_size = 0;
+    FILE *out = open_memstream (&folded, &folded_size);
+    json_t *report = json_object ();
+    json_t *consumers = json_array ();
+    size_t index;
+
+    assert (tracks && out);
+    profiler_entry_t *entry = (profiler_entry_t *) zhashx_first (self->entries);
+    while (entry) {
+        const char *key = (const char *) zhashx_cursor (self->entries);
+        uint64_t weight = by_instructions? entry->instructions: entry->wall_us;
+        size_t track_len = strcspn (key, ";");
+        if (weight)
+            fprintf (out, "%s %" PRIu64 "\n", key, weight);
+
+        //  Sum up per track, the first frame of the folded stack
+        for (index = 0; index < ntracks; index++)
+            if (strncmp (tracks [index].track, key, track_len) == 0
+                    && tracks [index].track [track_len] == 0)
+                break;
+        if (index == ntracks) {
+            tracks [index].track = strndup (key, track_len);
+            ntracks++;
+        }
+        tracks [index].instructions += entry->instructions;
+        tracks [index].wall_us += entry->wall_us;
+        entry = (profiler_entry_t *) zhashx_next (self->entries);
+    }
+    fclose (out);
+
+    qsort (tracks, ntracks, sizeof (profiler_track_t), s_compare_tracks);
+    for (index = 0; index < ntracks; index++) {
+        if (index < top) {
+            json_t *consumer = json_object ();
+            json_object_set_new (consumer, "track", json_string (tracks [index].track));
+            json_object_set_new (consumer, "instructions", json_integer (tracks [index].instructions));
+            json_object_set_new (consumer, "wall_us", json_integer (tracks [index].wall_us));
+            json_array_append_new (consumers, consumer);
+        }
+        free ((char *) tracks [index].track);
+    }
+    free (tracks);
+
+    json_object_set_new (report, "enabled", self->enabled? json_true (): json_false ());
+    json_object_set_new (report, "top", consumers);
+    json_object_set_new (report, "weight", json_string (by_instructions? "instructions": "wall_us"));
+    json_object_set_new (report, "folded", json_stringn (folded, folded_size));
+    free (folded);
+    return report;
+}
@@ -0,0 +1,42 @@
+#ifndef __PROFILER_INCLUDE_H__
+#define __PROFILER_INCLUDE_H__
+
+/*
+ * Opt-in profiler for the tracks Lua state.
+ *
+ * Count, call and return hooks attribute executed instructions and wall
+ * time to the Lua stack that was running. The stack is kept in folded
+ * form ("track;caller;callee"), the first frame of a coroutine stack is
+ * the function given to runProcess. Its source is the chunk name, the
+ * "Track" (or "Affinity") of the RUN_COOP request, so it names the track.
+ * Coroutines inherit the hooks from the thread that creates them, only
+ * tracks started after the profiler are seen. Once stopped, they drop the
+ * hooks on their next event.
+ */
+
+#include <stdbool.h>
+#include <lua.h>
+#include <jansson.h>
+
+typedef struct _profiler_t profiler_t;
+
+profiler_t *profiler_new (void);
+void profiler_destroy (profiler_t **self_p);
+
+//  Install the hooks in L, again after L was re-created
+void profiler_start (profiler_t *self, lua_State *L);
+void profiler_stop (profiler_t *self, lua_State *L);
+bool profiler_enabled (profiler_t *self);
+
+//  Forget all samples
+void profiler_reset (profiler_t *self);
+
+//  Bracket every entry into Lua, time outside is not attributed
+void profiler_enter (profiler_t *self);
+void profiler_leave (profiler_t *self);
+
+//  Report the top consumers per track and a flame graph compatible folded
+//  dump, weighted by wall time in usecs or by instructions
+json_t *profiler_report (profiler_t *self, size_t top, bool by_instructions);
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * Timer bookkeeping for waitSeconds/wakeUpWaitingThreads
+ *
+ * Waiting coroutines are kept in a binary min-heap ordered by their wake-up
+ * time. The coroutines themselves are anchored in the Lua registry, the heap
+ * only stores the registry reference. A wake-up costs O(k log n) for the k
+ * coroutines that are due and does not create any Lua tables.
+ *
+ * A coroutine may be resumed by someone else while it waits, e.g. by
+ * coroutine.resume. Its heap entry is stale then and must not wake it a
+ * second time. The weak table of waiting coroutines maps each one to the
+ * sequence number of its live entry, and waitSeconds clears the mapping
+ * whenever the coroutine is resumed. Stale entries are dropped when they
+ * come up.
+ */
+
+#include <czmq.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "timers.h"
+
+#define TIMERS_INITIAL_CAPACITY 64
+
+typedef struct {
+    double deadline;            //  Track time the coroutine is due
+    uint64_t seq;               //  Insertion order, FIFO for equal deadlines
+    int ref;                    //  Registry reference of the coroutine
+} timers_entry_t;
+
+typedef struct {
+    timers_entry_t *heap;       //  Min-heap of waiting coroutines
+    size_t size;                //  Number of waiting coroutines
+    size_t capacity;            //  Allocated heap entries
+    double now;                 //  Current track time
+    uint64_t seq;               //  Next insertion sequence number
+} timers_t;
+
+static bool
+s_entry_before (const timers_entry_t *a, const timers_entry_t *b)
+{
+    if (a->deadline != b->deadline)
+        return a->deadline < b->deadline;
+    return a->seq < b->seq;
+}
+
+static int
+s_heap_push (timers_t *self, double deadline, int ref)
+{
+    if (self->size == self->capacity) {
+        size_t capacity = self->capacity? 2 * self->capacity: TIMERS_INITIAL_CAPACITY;
+        timers_entry_t *heap = (timers_entry_t *) realloc (self->heap,
+                capacity * sizeof (timers_entry_t));
+        if (!heap)
+            return -1;
+        self->heap = heap;
+        self->capacity = capacity;
+    }
+    timers_entry_t entry = { deadline, self->seq++, ref };
+    size_t child = self->size++;
+    while (child > 0) {
+        size_t parent = (child - 1) / 2;
+        if (!s_entry_before (&entry, &self->heap [parent]))
+            break;
+        self->heap [child] = self->heap [parent];
+        child = parent;
+    }
+    self->heap [child] = entry;
+    return 0;
+}
+
+static timers_entry_t
+s_heap_pop (timers_t *self)
+{
+    assert (self->size);
+    timers_entry_t top = self->heap [0];
+    timers_entry_t last = self->heap [--self->size];
+    size_t parent = 0;
+    while (true) {
+        size_t child = 2 * parent + 1;
+        if (child >= self->size)
+            break;
+        if (child + 1 < self->size
+        &&  s_entry_before (&self->heap [child + 1], &self->heap [child]))
+            child++;
+        if (!s_entry_before (&self->heap [child], &last))
+            break;
+        self->heap [parent] = self->heap [child];
+        parent = child;
+    }
+    if (self->size)
+        self->heap [parent] = last;
+    return top;
+}
+
+static int
+s_resume (lua_State *co, lua_State *from)
+{
+#if LUA_VERSION_NUM >= 504
+    int nresults;
+    return lua_resume (co, from, 0, &nresults);
+#else
+    return lua_resume (co, from, 0);
+#endif
+}
+
+//  Is the entry the live one of its coroutine? The coroutine is left on the
+//  stack of L.
+
+static bool
+s_entry_live (lua_State *L, const timers_entry_t *entry)
+{
+    lua_rawgeti (L, LUA_REGISTRYINDEX, entry->ref);
+    lua_pushvalue (L, -1);
+    lua_rawget (L, lua_upvalueindex (2));
+    bool live = lua_isinteger (L, -1)
+        && (uint64_t) lua_tointeger (L, -1) == entry->seq;
+    lua_pop (L, 1);
+    return live;
+}
+
+//  Continuation of waitSeconds, runs whoever resumed the coroutine. Its heap
+//  entry is stale from now on. Returns the values passed to resume.
+
+static int
+s_timers_wait_k (lua_State *L, int status, lua_KContext ctx)
+{
+    (void) status;
+    (void) ctx;
+    lua_pushthread (L);
+    lua_pushnil (L);
+    lua_rawset (L, lua_upvalueindex (2));
+    return lua_gettop (L);
+}
+
+//  waitSeconds(seconds): suspend the running coroutine until the track time
+//  has advanced by the given amount
+
+static int
+s_timers_wait (lua_State *L)
+{
+    timers_t *self = (timers_t *) lua_touserdata (L, lua_upvalueindex (1));
+    double seconds = luaL_checknumber (L, 1);
+
+    // If we're on the main process, which isn't a coroutine, we can't yield
+    if (lua_pushthread (L))
+        return luaL_error (L, "The main thread cannot wait!");
+    lua_pushvalue (L, -1);
+    int ref = luaL_ref (L, LUA_REGISTRYINDEX);
+    uint64_t seq = self->seq;
+    if (s_heap_push (self, self->now + seconds, ref) == -1) {
+        luaL_unref (L, LUA_REGISTRYINDEX, ref);
+        return luaL_error (L, "not enough memory to wait");
+    }
+    lua_pushinteger (L, (lua_Integer) seq);
+    lua_rawset (L, lua_upvalueindex (2));
+    //  Suspend the process, the coroutine is handed to the resumer
+    lua_settop (L, 0);
+    lua_pushthread (L);
+    return lua_yieldk (L, 1, 0, s_timers_wait_k);
+}
+
+//  wakeUpWaitingThreads(deltaTime): advance the track time and resume all
+//  coroutines that are due
+
+static int
+s_timers_wake (lua_State *L)
+{
+    timers_t *self = (timers_t *) lua_touserdata (L, lua_upvalueindex (1));
+    self->now += luaL_checknumber (L, 1);
+
+    //  Coroutines that wait again while being resumed are due next time
+    uint64_t horizon = self->seq;
+    while (self->size
+    &&     self->heap [0].deadline <= self->now
+    &&     self->heap [0].seq < horizon) {
+        timers_entry_t due = s_heap_pop (self);
+        bool live = s_entry_live (L, &due);
+        luaL_unref (L, LUA_REGISTRYINDEX, due.ref);
+        lua_State *co = lua_tothread (L, -1);
+        if (co && live && lua_status (co) == LUA_YIELD) {
+            //  Drop the values passed to yield before resuming
+            lua_settop (co, 0);
+            int status = s_resume (co, L);
+            if (status == LUA_YIELD)
+                lua_settop (co, 0);
+            else
+            if (status != LUA_OK)
+                zsys_warning ("tracks: coroutine failed: %s", lua_tostring (co, -1));
+        }
+        lua_pop (L, 1);
+    }
+    return 0;
+}
+
+//  nextWakeUpDelay(): time left until the earliest waiting coroutine is due,
+//  or nil if no coroutine waits on time
+
+static int
+s_timers_next (lua_State *L)
+{
+    timers_t *self = (timers_t *) lua_touserdata (L, lua_upvalueindex (1));
+    //  Stale entries would wake the scheduler for nothing
+    while (self->size) {
+        bool live = s_entry_live (L, &self->heap [0]);
+        lua_pop (L, 1);
+        if (live)
+            break;
+        timers_entry_t stale = s_heap_pop (self);
+        luaL_unref (L, LUA_REGISTRYINDEX, stale.ref);
+    }
+    if (self->size == 0)
+        return 0;
+    lua_pushnumber (L, self->heap [0].deadline - self->now);
+    return 1;
+}
+
+static int
+s_timers_destroy (lua_State *L)
+{
+    timers_t *self = (timers_t *) lua_touserdata (L, 1);
+    free (self->heap);
+    self->heap = NULL;
+    self->size = self->capacity = 0;
+    return 0;
+}
+
+static const luaL_Reg timers_functions[] = {
+    {"wait", s_timers_wait},
+    {"wake", s_timers_wake},
+    {"next", s_timers_next},
+    {NULL, NULL}
+};
+
+int luaopen_timers (lua_State *L)
+{
+    luaL_newlibtable (L, timers_functions);
+    //  Timer state is shared by all functions as upvalue
+    timers_t *self = (timers_t *) lua_newuserdata (L, sizeof (timers_t));
+    memset (self, 0, sizeof (timers_t));
+    lua_newtable (L);
+    lua_pushcfunction (L, s_timers_destroy);
+    lua_setfield (L, -2, "__gc");
+    lua_setmetatable (L, -2);
+    //  Waiting coroutines, weak so abandoned ones are collected
+    lua_newtable (L);
+    lua_newtable (L);
+    lua_pushliteral (L, "k");
+    lua_setfield (L, -2, "__mode");
+    lua_setmetatable (L, -2);
+    luaL_setfuncs (L, timers_functions, 2);
+    return 1;
+}
@@ -0,0 +1,4 @@
+#ifndef __TIMERS_INCLUDE_H__
+#define __TIMERS_INCLUDE_H__
+int luaopen_timers (lua_State *L);
+#endif
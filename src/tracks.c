@@ -3,11 +3,17 @@
  */
 
 #include <czmq.h>
+#include <sys/timerfd.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 #include <jansson.h>
 #include "engine.h"
+#include "timers.h"
+#include "msgpack.h"
+#include "jsonenc.h"
+#include "lalloc.h"
+#include "profiler.h"
 #include "../lib/se97.h"
 #include "../lib/tmp116.h"
 #include "../lib/pca9536.h"
@@ -18,6 +24,7 @@
 #include "../lib/id.h"
 #include "../lib/db.h"
 #include "../lib/dib.h"
+#include "../lib/device.h"
 
 #include "waitsupport.h"
 #include "ldms_init.h"
@@ -35,6 +42,22 @@
 #define NLTS_DB_PASS "V0st!novaled#"
 #define NLTS_DB_DATABASE   "nltsdb"
 
+#define TRACKS_TICK_INTERVAL 5LL     //  Tick period of the 'game loop' scheduler in ms
+#define TRACKS_JITTER_BUCKETS 16     //  Power-of-two microsecond jitter histogram
+
+//  Scheduler modes: a fixed rate tick or sleeping until the next deadline
+#define TRACKS_SCHEDULER_TICK  0
+#define TRACKS_SCHEDULER_EVENT 1
+
+//  Messages Lua may queue with publish() before new ones are dropped, and
+//  high water mark of the PUB socket per subscriber
+#define TRACKS_PUBLISH_QUEUE 1024
+#define TRACKS_PUBLISH_HWM 1000
+
+//  Reply encodings, the client picks one per request
+#define TRACKS_ENCODING_JSON 0
+#define TRACKS_ENCODING_MSGPACK 1
+
 #define LDMS_INIT_FILE "/usr/share/ldms/init.lua"
 #define LDMS_EXIT_FILE "/usr/share/ldms/exit.lua"
 
@@ -48,19 +71,47 @@
 
 typedef struct {
     zsock_t *pipe;              //  Actor command pipe
-    zsock_t *responder;         //  Responder socket for replies
-    zpoller_t *poller;          //  Poller for API and REP socket
+    zsock_t *responder;         //  ROUTER socket for client requests
+    zloop_t *loop;              //  Reactor for API pipe, REP socket and timer
+    int timer_fd;               //  timerfd armed for the next wake-up
+    device_events_t *events;    //  Wake-ups posted by device driver threads
     zmsg_t *reply;              //  Reply send back via REP socket
     json_t *root;               //  JSON object holding the reply
     lua_State *L;               //  Lua state
+    lalloc_t *alloc;            //  Pooled allocator of the Lua state
+    profiler_t *profiler;       //  Lua profiler, NULL until first started
     const char *lchunk;               //  Chunk of Lua code to be run
+    const char *ltrack;         //  Track of a RUN_COOP chunk, NULL if unnamed
     int port_nbr;               //  TCP port number to work on
-    int64_t currtime;           //  Current execution time 
-    int64_t nexttime;           //  Next execution time
+    int64_t lasttime;           //  Time of the last wake-up in usecs
+    int64_t deadline;           //  Time the timer is armed for in usecs, 0 if idle
     int64_t interval;           //  Lua track execution interval in ms
+    int scheduler;              //  TRACKS_SCHEDULER_TICK or TRACKS_SCHEDULER_EVENT
+    uint64_t wakeups;           //  Number of timer wake-ups
+    uint64_t jitter[TRACKS_JITTER_BUCKETS]; //  Wake-up latency histogram
+    zactor_t **workers;         //  Worker pool, each with its own Lua state
+    size_t nworkers;            //  Number of workers, 0 runs chunks locally
+    size_t next_worker;         //  Round robin position of the dispatcher
+    size_t *inflight;           //  Requests each worker has not replied to
+    zlist_t *backlog;           //  Requests waiting for an idle worker
+    zhashx_t *affinity;         //  Worker index + 1 per affinity key
+    zhashx_t *pending;          //  Reply envelopes of dispatched requests
+    uint64_t request_seq;       //  Last request id handed out
     bool terminated;            //  Did caller ask us to quit?
     bool verbose;               //  Verbose logging enabled?
     bool concurrent;            //  Can this chunk be executed as a track?
+    int encoding;               //  Reply encoding of the current request
+    int results_ref;            //  Lua results table of the current reply
+    je_buffer_t json;           //  Reused buffer for JSON replies
+    bool worker;                //  Actor is a worker of the pool
+    zsock_t *publisher;         //  PUB socket for results streamed by tracks
+    zlist_t *outbox;            //  Published messages waiting to be sent
+    bool flushing;              //  Outbox retry timer is running
+    uint64_t published;         //  Messages queued by publish()
+    uint64_t publish_sent;      //  Messages handed to the PUB socket or front
+    uint64_t publish_dropped;   //  Messages dropped because the outbox was full
+    uint64_t publish_blocked;   //  Flushes stopped by a full pipe
+    size_t publish_high_water;  //  Largest outbox size seen
 } self_t;
 
 static int lua_status_encode(json_t *object, const char *status, const char *errmsg)
@@ -69,18 +120,110 @@ static int lua_status_encode(json_t *object, const char *status, const char *err
     return json_object_set(object, "status", json_string(status));
 }
 
+//  --------------------------------------------------------------------------
+//  publish(topic, value) queues a message for the subscribers of the PUB
+//  socket: the topic frame followed by the value encoded as MessagePack.
+//  Returns false if the outbox is full and the message was dropped.
+
+static int
+s_lua_publish (lua_State *L)
+{
+    self_t *self = (self_t *) lua_touserdata(L, lua_upvalueindex(1));
+    const char *topic = luaL_checkstring(L, 1);
+    luaL_checkany(L, 2);
+
+    if (zlist_size (self->outbox) >= TRACKS_PUBLISH_QUEUE) {
+        self->publish_dropped++;
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    mp_writer_t writer = { NULL, 0, 0 };
+    mp_encode_lua (&writer, L, 2);
+    zframe_t *frame = zframe_new (NULL, writer.pos);
+    writer.data = zframe_data (frame);
+    writer.size = zframe_size (frame);
+    writer.pos = 0;
+    mp_encode_lua (&writer, L, 2);
+
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addstr (msg, topic);
+    zmsg_append (msg, &frame);
+    zlist_append (self->outbox, msg);
+    self->published++;
+    if (zlist_size (self->outbox) > self->publish_high_water)
+        self->publish_high_water = zlist_size (self->outbox);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static void
+s_self_close_lua (self_t *self)
+{
+    if (self->L != NULL) {
+        lua_close(self->L);
+        self->L = NULL;
+    }
+    //  The allocator goes last, lua_close frees through it
+    lalloc_destroy (&self->alloc);
+}
+
+static int
+s_lua_panic (lua_State *L)
+{
+    zsys_error ("tracks: unprotected error in Lua: %s", lua_tostring(L, -1));
+    return 0;                       //  Lua aborts
+}
+
 static void
 s_self_destroy (self_t **self_p)
 {
     assert (self_p);
     if (*self_p) {
         self_t *self = *self_p;
-        if (engine_dofile(self->L, LDMS_EXIT_FILE, NULL) != LUA_OK) {
-            zsys_error("could not load exit.lua");
+        if (self->L != NULL) {
+            if (engine_dofile(self->L, LDMS_EXIT_FILE, NULL) != LUA_OK) {
+                zsys_error("could not load exit.lua");
+            }
+        }
+        s_self_close_lua (self);
+        profiler_destroy (&self->profiler);
+        size_t index;
+        for (index = 0; index < self->nworkers; index++)
+            zactor_destroy (&self->workers [index]);
+        free (self->workers);
+        free (self->inflight);
+        if (self->backlog) {
+            zmsg_t *request = (zmsg_t *) zlist_pop (self->backlog);
+            while (request) {
+                zmsg_destroy (&request);
+                request = (zmsg_t *) zlist_pop (self->backlog);
+            }
+            zlist_destroy (&self->backlog);
+        }
+        zhashx_destroy (&self->affinity);
+        if (self->pending) {
+            zmsg_t *envelope = (zmsg_t *) zhashx_first (self->pending);
+            while (envelope) {
+                zmsg_destroy (&envelope);
+                envelope = (zmsg_t *) zhashx_next (self->pending);
+            }
+            zhashx_destroy (&self->pending);
+        }
+        if (self->outbox) {
+            zmsg_t *msg = (zmsg_t *) zlist_pop (self->outbox);
+            while (msg) {
+                zmsg_destroy (&msg);
+                msg = (zmsg_t *) zlist_pop (self->outbox);
+            }
+            zlist_destroy (&self->outbox);
         }
+        je_free (&self->json);
+        zsock_destroy(&self->publisher);
         zsock_destroy(&self->responder);
-        zpoller_destroy (&self->poller);
-        lua_close(self->L);
+        zloop_destroy (&self->loop);
+        close (self->timer_fd);
+        //  Drivers stop posting when their objects are collected
+        device_events_destroy (&self->events);
         free (self);
         *self_p = NULL;
     }
@@ -91,10 +234,18 @@ static int
 s_self_spawn_lua (self_t *self)
 {
     json_object_clear(self->root);
-    if (self->L != NULL) {
-        lua_close(self->L);
-    }
-    self->L = luaL_newstate();
+    s_self_close_lua(self);
+    //  Each state gets its own pooled allocator, coroutine-heavy tracks
+    //  allocate and free many small objects
+    self->alloc = lalloc_new ();
+    if (self->alloc)
+        self->L = lua_newstate(lalloc_alloc, self->alloc);
+    if (self->L)
+        lua_atpanic(self->L, s_lua_panic);
+    if (self->L)
+        device_events_attach(self->events, self->L);
+    if (self->L && self->profiler && profiler_enabled (self->profiler))
+        profiler_start (self->profiler, self->L);
 
     if (self->L == NULL) {
         zsys_error ("Not enough memory to create Lua state");
@@ -103,6 +254,13 @@ s_self_spawn_lua (self_t *self)
     } 
     /* Open standard Lua libraries */
     luaL_openlibs(self->L);
+    /* Timer heap backing waitSeconds and wakeUpWaitingThreads */
+    luaL_requiref(self->L, "timers", luaopen_timers, true);
+    lua_pop(self->L, 1);
+    /* Stream results to subscribers */
+    lua_pushlightuserdata(self->L, self);
+    lua_pushcclosure(self->L, s_lua_publish, 1);
+    lua_setglobal(self->L, "publish");
     /* Add state-based scripting support */
     if (engine_dostring(self->L, tracks_wait_support_lua_str, "tracks", NULL, false) != LUA_OK) {
         lua_status_encode(self->root, "error", "could not load wait_support.lua");
@@ -224,17 +382,145 @@ s_self_new (zsock_t *pipe)
     self->pipe = pipe;
     self->root = json_object();
     assert(self->root);
-    self->interval = 5LL;
-    //  Set-up poller
-    self->poller = zpoller_new (self->pipe, NULL);
-    assert (self->poller);
-    s_self_spawn_lua(self);
-    assert(self->L);
+    self->results_ref = LUA_NOREF;
+    self->outbox = zlist_new ();
+    assert (self->outbox);
+    self->interval = TRACKS_TICK_INTERVAL;
+    self->scheduler = TRACKS_SCHEDULER_EVENT;
+    //  Set-up reactor, the timer is armed by s_self_schedule
+    self->loop = zloop_new ();
+    assert (self->loop);
+    self->timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    assert (self->timer_fd >= 0);
+    self->events = device_events_new ();
+    assert (self->events);
+    //  The Lua state is spawned by the caller, unless a worker pool is used
     return self;
 }
 
+static int s_self_worker_ready (zloop_t *loop, zsock_t *reader, void *arg);
+static void s_worker (zsock_t *pipe, void *args);
+static void s_self_handle_request (self_t *self, json_t *root);
+static void s_self_send_reply (self_t *self, zsock_t *dest, zmsg_t **envelope_p);
+
+//  --------------------------------------------------------------------------
+//  Start a pool of workers, each running its own Lua state. Hardware is
+//  shared between them by the device layer (lib/device.c).
+
+static void
+s_self_start_workers (self_t *self, int nworkers)
+{
+    assert (self->nworkers == 0);
+    if (nworkers <= 0)
+        return;
+    //  Chunks are run by the workers only
+    s_self_close_lua (self);
+    self->workers = (zactor_t **) zmalloc (nworkers * sizeof (zactor_t *));
+    assert (self->workers);
+    self->inflight = (size_t *) zmalloc (nworkers * sizeof (size_t));
+    assert (self->inflight);
+    self->backlog = zlist_new ();
+    assert (self->backlog);
+    self->affinity = zhashx_new ();
+    assert (self->affinity);
+    self->pending = zhashx_new ();
+    assert (self->pending);
+    for (self->nworkers = 0; self->nworkers < (size_t) nworkers; self->nworkers++) {
+        zactor_t *worker = zactor_new (s_worker, (void *) (intptr_t) self->nworkers);
+        assert (worker);
+        if (self->verbose)
+            zstr_sendx (worker, "VERBOSE", NULL);
+        zloop_reader (self->loop, zactor_sock (worker), s_self_worker_ready, self);
+        self->workers [self->nworkers] = worker;
+    }
+    zsys_info ("tracks: started %d workers", nworkers);
+}
+
+//  --------------------------------------------------------------------------
+//  Next idle worker in round robin order, TRACKS_NO_WORKER if all are busy
+
+#define TRACKS_NO_WORKER ((size_t) -1)
+
+static size_t
+s_self_idle_worker (self_t *self)
+{
+    size_t count;
+    for (count = 0; count < self->nworkers; count++) {
+        size_t index = (self->next_worker + count) % self->nworkers;
+        if (self->inflight [index] == 0) {
+            self->next_worker = (index + 1) % self->nworkers;
+            return index;
+        }
+    }
+    return TRACKS_NO_WORKER;
+}
+
+//  --------------------------------------------------------------------------
+//  Pick the worker for a request. An explicit "Worker" index wins, requests
+//  with the same "Affinity" key (e.g. a track or channel name) always go to
+//  the same worker, queued up in its pipe. Everything else goes to an idle
+//  worker, or TRACKS_NO_WORKER if there is none. A new affinity key is bound
+//  to an idle worker if there is one.
+
+static size_t
+s_self_select_worker (self_t *self, json_t *root)
+{
+    size_t index;
+    json_t *worker = json_object_get(root, "Worker");
+    const char *affinity = json_string_value(json_object_get(root, "Affinity"));
+
+    if (json_is_integer(worker))
+        return (size_t) json_integer_value(worker) % self->nworkers;
+    if (affinity) {
+        void *item = zhashx_lookup (self->affinity, affinity);
+        if (item)
+            return (size_t) (intptr_t) item - 1;
+        index = s_self_idle_worker (self);
+        if (index == TRACKS_NO_WORKER) {
+            index = self->next_worker;
+            self->next_worker = (index + 1) % self->nworkers;
+        }
+        zhashx_insert (self->affinity, affinity, (void *) (intptr_t) (index + 1));
+        return index;
+    }
+    return s_self_idle_worker (self);
+}
+
+//  --------------------------------------------------------------------------
+//  Send a request ("REQUEST", id, JSON text) to a worker
+
+static void
+s_self_dispatch (self_t *self, size_t index, zmsg_t **request_p)
+{
+    if (self->verbose) {
+        zmsg_first (*request_p);
+        char *key = zframe_strdup (zmsg_next (*request_p));
+        zsys_info ("tracks: dispatch request %s to worker %zu", key, index);
+        zstr_free (&key);
+    }
+    self->inflight [index]++;
+    zmsg_send (request_p, self->workers [index]);
+}
+
 //  --------------------------------------------------------------------------
-//  Prepare responder socket to work on specified TCP port, reply hostname to
+//  Hand queued requests to the workers that became idle
+
+static void
+s_self_dispatch_backlog (self_t *self)
+{
+    while (zlist_size (self->backlog) > 0) {
+        size_t index = s_self_idle_worker (self);
+        if (index == TRACKS_NO_WORKER)
+            break;
+        zmsg_t *request = (zmsg_t *) zlist_pop (self->backlog);
+        s_self_dispatch (self, index, &request);
+    }
+}
+
+static int s_self_rep_ready (zloop_t *loop, zsock_t *reader, void *arg);
+
+//  --------------------------------------------------------------------------
+//  Prepare ROUTER socket to work on specified TCP port, reply hostname to
 //  pipe (or "" if this failed)
 
 static void
@@ -242,51 +528,27 @@ s_self_configure (self_t *self, int port_nbr)
 {
     assert (port_nbr);
     self->port_nbr = port_nbr;
-    self->responder = zsock_new_rep(zsys_sprintf("tcp://*:%d", self->port_nbr));
+    if (self->nworkers == 0 && self->L == NULL)
+        s_self_spawn_lua(self);
+    //  A ROUTER socket serves plain REQ clients as well as DEALER clients
+    //  with many requests in flight
+    self->responder = zsock_new_router(zsys_sprintf("tcp://*:%d", self->port_nbr));
     assert(self->responder);
     assert (zsock_resolve (self->responder) != self->responder);
-    assert (streq (zsock_type_str (self->responder), "REP"));
-    zpoller_add(self->poller, self->responder);
+    assert (streq (zsock_type_str (self->responder), "ROUTER"));
+    zloop_reader (self->loop, self->responder, s_self_rep_ready, self);
+    //  Results published by tracks go out on the next port
+    self->publisher = zsock_new (ZMQ_PUB);
+    assert (self->publisher);
+    zsock_set_sndhwm (self->publisher, TRACKS_PUBLISH_HWM);
+    if (zsock_bind (self->publisher, "tcp://*:%d", self->port_nbr + 1) == -1)
+        zsys_error ("tracks: cannot bind PUB socket to port %d", self->port_nbr + 1);
 
     zstr_send (self->pipe, zsock_endpoint(self->responder));
     if (streq (zsock_endpoint(self->responder), ""))
         zsys_error ("No reply interface found, (ZSYS_INTERFACE=%s)", zsys_interface ());
 }
 
-
-static json_t* lua_table_encode_json(lua_State *L, int index)
-{
-    json_t *root = json_object();
-    json_t *results = json_object();
-
-    // Push another reference to the table on top of the stack (so we know
-    // where it is, and this function can work for negative, positive and
-    // pseudo indices
-    lua_pushvalue(L, index);
-    // stack now contains: -1 => table
-    lua_pushnil(L);
-    // stack now contains: -1 => nil; -2 => table
-    while (lua_next(L, -2))
-    {
-        // stack now contains: -1 => value; -2 => key; -3 => table
-        // copy the key so that lua_tostring does not modify the original
-        lua_pushvalue(L, -2);
-        // stack now contains: -1 => key; -2 => value; -3 => key; -4 => table
-        const char *key = lua_tostring(L, -1);
-        const char *value = lua_tostring(L, -2);
-        json_object_set(results, key,  json_string(value));
-        // pop value + copy of key, leaving original key
-        lua_pop(L, 2);
-        // stack now contains: -1 => key; -2 => table
-    }
-    // stack now contains: -1 => table (when lua_next returns 0 it pops the key
-    // but does not push anything.)
-    // Pop table
-    lua_pop(L, 1);
-    json_object_set(root, "results", results);
-    // Stack is now the same as it was on entry to this function
-    return root;
-}
 static void stackDump (lua_State *L) {
     int i;
     int top = lua_gettop(L);
@@ -324,18 +586,27 @@ s_self_call_engine(self_t *self)
 
     if (self->verbose)
         zsys_info ("tracks: RUN \n%s", self->lchunk);
-    if (engine_dostring(self->L, self->lchunk, "lua_loop_actor", 
-                errmsg, self->concurrent) == LUA_OK) 
+    //  A track names its chunk, so its functions are told apart in
+    //  tracebacks and profiles
+    char *name = self->ltrack? zsys_sprintf ("=%s", self->ltrack): NULL;
+    if (self->profiler)
+        profiler_enter (self->profiler);
+    int rc = engine_dostring(self->L, self->lchunk, name? name: "lua_loop_actor",
+                errmsg, self->concurrent);
+    if (self->profiler)
+        profiler_leave (self->profiler);
+    zstr_free (&name);
+    if (rc == LUA_OK) 
     {
         if (self->verbose)
             zsys_info ("tracks: RUN successful, get results");
         /* Lua execution was successful */
         lua_getglobal(self->L, "results");
         int type = lua_type(self->L, -1);
-        /* we have results in a table */
+        /* we have results in a table, it is encoded when the reply is sent */
         if (type == LUA_TTABLE) {
-            self->root = lua_table_encode_json(self->L, -1);
-            /* Remove variable from top of Lua stack */
+            lua_pushvalue(self->L, -1);
+            self->results_ref = luaL_ref(self->L, LUA_REGISTRYINDEX);
         }
         /* no results available */
         else {
@@ -343,10 +614,6 @@ s_self_call_engine(self_t *self)
                 zsys_info("tracks: RUN successful, but no results");
             json_object_set(self->root, "results", json_object());
         }
-
-        if (self->verbose)
-            zsys_info ("tracks: RUN results send back to requestor %s\n", 
-                    json_dumps(self->root, 0));
         lua_status_encode(self->root, "ok", "");
         lua_pop(self->L, 1);
     } else {
@@ -357,20 +624,159 @@ s_self_call_engine(self_t *self)
     return 0;
 }
 
+//  Monotonic clock in usecs, same time base as the timerfd
+
+static int64_t
+s_now_usecs (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static int
 s_self_wake_waiting_threads(self_t *self)
 {
-    assert(self->L);
+    if (self->L == NULL)
+        return 0;                   //  Tracks run in the workers
+    int64_t now = s_now_usecs ();
+    double delta = self->interval;
+    // The tick scheduler advances the track time by a fixed interval, the
+    // event scheduler by the time that really passed since the last call
+    if (self->scheduler == TRACKS_SCHEDULER_EVENT)
+        delta = (now - self->lasttime) / 1000.0;
+    self->lasttime = now;
     // Execute all tracks, that need to be waken up
+    if (self->profiler)
+        profiler_enter (self->profiler);
     lua_getglobal(self->L, "wakeUpWaitingThreads"); /* function to be called */
-    lua_pushnumber(self->L, self->interval); /* 1st argument */
+    lua_pushnumber(self->L, delta); /* 1st argument */
     /* do the call (1 argument, 0 results) */
-    if (lua_pcall(self->L, 1, 0, 0) != LUA_OK)
+    if (lua_pcall(self->L, 1, 0, 0) != LUA_OK) {
         zsys_warning( "error running function `wakeUpWaitingThreads': %s",
                 lua_tostring(self->L, -1));
+        lua_pop(self->L, 1);
+    }
+    if (self->profiler)
+        profiler_leave (self->profiler);
     return 0;
 }
 
+//  --------------------------------------------------------------------------
+//  Arm the timer for the next wake-up. The tick scheduler fires every
+//  interval, the event scheduler only when the earliest waitSeconds deadline
+//  is due and stays disarmed while no track waits on time.
+
+static void
+s_self_schedule (self_t *self)
+{
+    struct itimerspec its = {{0, 0}, {0, 0}};
+    int64_t deadline = 0;
+
+    if (self->L == NULL)
+        return;                     //  Tracks run in the workers
+    if (self->scheduler == TRACKS_SCHEDULER_TICK) {
+        if (self->deadline)
+            return;                 //  Periodic timer is already running
+        deadline = s_now_usecs () + self->interval * 1000;
+        its.it_interval.tv_sec = self->interval / 1000;
+        its.it_interval.tv_nsec = (self->interval % 1000) * 1000000;
+    }
+    else {
+        lua_getglobal(self->L, "nextWakeUpDelay");
+        if (lua_pcall(self->L, 0, 1, 0) != LUA_OK) {
+            zsys_warning( "error running function `nextWakeUpDelay': %s",
+                    lua_tostring(self->L, -1));
+        }
+        else
+        if (lua_isnumber(self->L, -1)) {
+            double delay = lua_tonumber(self->L, -1);
+            //  Deadlines are relative to the track time of the last wake-up
+            deadline = self->lasttime + (int64_t) (delay * 1000.0);
+            if (deadline <= self->lasttime)
+                deadline = self->lasttime + 1;
+        }
+        lua_pop(self->L, 1);
+        if (deadline == self->deadline)
+            return;                 //  Already armed for this deadline
+    }
+    if (deadline) {
+        its.it_value.tv_sec = deadline / 1000000;
+        its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    }
+    if (timerfd_settime (self->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+        zsys_error ("tracks: could not arm timer: %s", strerror (errno));
+    self->deadline = deadline;
+}
+
+//  --------------------------------------------------------------------------
+//  Record how late the timer fired into the jitter histogram, bucket n
+//  counts latencies below 2^n usecs
+
+static void
+s_self_record_jitter (self_t *self, int64_t now)
+{
+    int64_t late = now - self->deadline;
+    int bucket = 0;
+    while (late > 0 && bucket < TRACKS_JITTER_BUCKETS - 1) {
+        late >>= 1;
+        bucket++;
+    }
+    self->jitter [bucket]++;
+    self->wakeups++;
+}
+
+static int
+s_self_encode_stats (self_t *self)
+{
+    json_t *results = json_object();
+    json_t *jitter = json_object();
+    int bucket;
+
+    json_object_clear(self->root);
+    for (bucket = 0; bucket < TRACKS_JITTER_BUCKETS; bucket++) {
+        char key [24];
+        snprintf (key, sizeof (key), "%lld", 1LL << bucket);
+        json_object_set_new(jitter, key, json_integer(self->jitter [bucket]));
+    }
+    json_object_set_new(results, "scheduler", json_string(
+                self->scheduler == TRACKS_SCHEDULER_EVENT? "event": "tick"));
+    json_object_set_new(results, "wakeups", json_integer(self->wakeups));
+    json_object_set_new(results, "jitter_us", jitter);
+    if (self->L != NULL) {
+        engine_cache_stats_t stats;
+        json_t *cache = json_object();
+        engine_cache_stats(self->L, &stats);
+        json_object_set_new(cache, "hits", json_integer(stats.hits));
+        json_object_set_new(cache, "misses", json_integer(stats.misses));
+        json_object_set_new(cache, "entries", json_integer(stats.entries));
+        json_object_set_new(cache, "capacity", json_integer(stats.capacity));
+        json_object_set_new(results, "chunk_cache", cache);
+    }
+    if (self->alloc != NULL) {
+        lalloc_stats_t stats;
+        json_t *memory = json_object();
+        lalloc_stats (self->alloc, &stats);
+        json_object_set_new(memory, "bytes", json_integer(stats.bytes));
+        json_object_set_new(memory, "high_water", json_integer(stats.high_water));
+        json_object_set_new(memory, "blocks", json_integer(stats.blocks));
+        json_object_set_new(memory, "allocations", json_integer(stats.allocations));
+        json_object_set_new(memory, "large", json_integer(stats.large));
+        json_object_set_new(memory, "arena", json_integer(stats.arena));
+        json_object_set_new(results, "memory", memory);
+    }
+    json_t *publish = json_object();
+    json_object_set_new(publish, "published", json_integer(self->published));
+    json_object_set_new(publish, "sent", json_integer(self->publish_sent));
+    json_object_set_new(publish, "dropped", json_integer(self->publish_dropped));
+    json_object_set_new(publish, "blocked", json_integer(self->publish_blocked));
+    json_object_set_new(publish, "queued", json_integer(zlist_size (self->outbox)));
+    json_object_set_new(publish, "high_water", json_integer(self->publish_high_water));
+    json_object_set_new(results, "publish", publish);
+    json_object_set_new(self->root, "results", results);
+    return lua_status_encode(self->root, "ok", "");
+}
+
 //  --------------------------------------------------------------------------
 //  Handle a command from calling application
 
@@ -385,8 +791,12 @@ s_self_handle_pipe (self_t *self)
     if (self->verbose)
         zsys_info ("tracks: API command=%s", command);
 
-    if (streq (command, "VERBOSE"))
+    if (streq (command, "VERBOSE")) {
+        size_t index;
         self->verbose = true;
+        for (index = 0; index < self->nworkers; index++)
+            zstr_sendx (self->workers [index], "VERBOSE", NULL);
+    }
     else
     if (streq (command, "CONFIGURE")) {
         int port;
@@ -395,8 +805,55 @@ s_self_handle_pipe (self_t *self)
         s_self_configure (self, port);
     }
     else
+    if (streq (command, "WORKERS")) {
+        int nworkers;
+        int rc = zsock_recv (self->pipe, "i", &nworkers);
+        assert (rc == 0);
+        s_self_start_workers (self, nworkers);
+    }
+    else
+    //  Request forwarded by the front actor of a worker pool, the reply
+    //  goes back tagged with the request id
+    if (streq (command, "REQUEST")) {
+        char *id, *request;
+        if (zsock_recv (self->pipe, "ss", &id, &request) == 0) {
+            json_t *root = json_loads(request, 0, NULL);
+            zmsg_t *envelope = zmsg_new ();
+            zmsg_addstr (envelope, "REPLY");
+            zmsg_addstr (envelope, id);
+            s_self_handle_request (self, root);
+            s_self_send_reply (self, self->pipe, &envelope);
+            json_decref(root);
+            zstr_free (&id);
+            zstr_free (&request);
+        }
+    }
+    else
+    if (streq (command, "SCHEDULER")) {
+        char *mode = zstr_recv (self->pipe);
+        size_t index;
+        for (index = 0; index < self->nworkers; index++)
+            zstr_sendx (self->workers [index], "SCHEDULER", mode, NULL);
+        if (mode && streq (mode, "tick"))
+            self->scheduler = TRACKS_SCHEDULER_TICK;
+        else
+        if (mode && streq (mode, "event"))
+            self->scheduler = TRACKS_SCHEDULER_EVENT;
+        else
+            zsys_error ("tracks: - invalid scheduler: %s", mode);
+        //  Disarm the timer, it is re-armed in the new mode
+        struct itimerspec its = {{0, 0}, {0, 0}};
+        timerfd_settime (self->timer_fd, 0, &its, NULL);
+        self->deadline = 0;
+        zstr_free (&mode);
+    }
+    else
     if (streq (command, "RECREATE_LUA")) {
-        s_self_spawn_lua(self);
+        size_t index;
+        for (index = 0; index < self->nworkers; index++)
+            zstr_sendx (self->workers [index], "RECREATE_LUA", NULL);
+        if (self->nworkers == 0)
+            s_self_spawn_lua(self);
     }
     else
     //  All actors must handle $TERM in this way
@@ -411,31 +868,78 @@ s_self_handle_pipe (self_t *self)
 }
 
 //  --------------------------------------------------------------------------
-//  Handle a command from calling application
+//  PROFILE request: "Action" is "start", "stop", "reset" or "report" (the
+//  default). Every action replies with the report: the "Top" (10) tracks
+//  by wall time and a folded dump for flamegraph.pl, weighted by wall time
+//  in usecs or by instructions with "Weight": "instructions".
 
 static int
-s_self_handle_rep (self_t *self)
+s_self_profile (self_t *self, json_t *request)
 {
-    //  Get just the command off the REP socket
-    const char *command;
-    json_t *root = json_object();
-    char *request = zstr_recv (self->responder);
-    if (!request) {
-        return -1;                  //  Interrupted
+    const char *action = json_string_value(json_object_get(request, "Action"));
+    const char *weight = json_string_value(json_object_get(request, "Weight"));
+    json_t *top = json_object_get(request, "Top");
+
+    json_object_clear(self->root);
+    if (self->L == NULL)
+        return lua_status_encode(self->root, "error", "no Lua state");
+    if (!self->profiler) {
+        self->profiler = profiler_new ();
+        assert (self->profiler);
     }
+    if (action && streq (action, "start"))
+        profiler_start (self->profiler, self->L);
+    else
+    if (action && streq (action, "stop"))
+        profiler_stop (self->profiler, self->L);
+    else
+    if (action && streq (action, "reset"))
+        profiler_reset (self->profiler);
+    else
+    if (action && !streq (action, "report"))
+        return lua_status_encode(self->root, "error", "invalid profiler action");
+
+    json_object_set_new(self->root, "results", profiler_report (self->profiler,
+                json_is_integer(top)? (size_t) json_integer_value(top): 10,
+                weight && streq (weight, "instructions")));
+    return lua_status_encode(self->root, "ok", "");
+}
+
+//  --------------------------------------------------------------------------
+//  Execute a decoded request, the reply is left in self->root
+
+static void
+s_self_handle_request (self_t *self, json_t *root)
+{
+    //  Get just the command off the request
+    const char *command;
 
-    // Decode request
-    root = json_loads(request, 0, NULL);
     command = json_string_value(json_object_get(root, "VostCmd"));
+    //  "Encoding": "msgpack" asks for a MessagePack reply, requests sent
+    //  as MessagePack are tagged with it by the front
+    self->encoding = TRACKS_ENCODING_JSON;
+    const char *encoding = json_string_value(json_object_get(root, "Encoding"));
+    if (encoding && streq (encoding, "msgpack"))
+        self->encoding = TRACKS_ENCODING_MSGPACK;
     if (!command) {
-        return -1;
+        json_object_clear(self->root);
+        lua_status_encode(self->root, "error", "invalid request");
+        return;
     }
 
     // Extract chunk of Lua code, if present in the request
     self->lchunk = json_string_value(json_object_get(root, "LuaCode"));
+    // The track is named by "Track", or else by its "Affinity" key
+    self->ltrack = json_string_value(json_object_get(root, "Track"));
+    if (!self->ltrack)
+        self->ltrack = json_string_value(json_object_get(root, "Affinity"));
 
     if (self->verbose)
-        zsys_info ("tracks: REP socket command=%s", command);
+        zsys_info ("tracks: ROUTER socket command=%s", command);
+    // Bring the track time up to date, new waitSeconds deadlines are
+    // relative to it and the event scheduler may have slept for long
+    if (self->scheduler == TRACKS_SCHEDULER_EVENT)
+        s_self_wake_waiting_threads(self);
     // Request to immediately run a single chunk
     if (streq (command, "RUN")) {
         self->concurrent = false;
@@ -452,18 +956,373 @@ s_self_handle_rep (self_t *self)
     if (streq (command, "RECREATE_LUA")) {
         s_self_spawn_lua(self);
     }
+    else
+    // Report scheduler statistics
+    if (streq (command, "STATS")) {
+        s_self_encode_stats(self);
+    }
+    else
+    // Control the profiler and report what it found
+    if (streq (command, "PROFILE")) {
+        s_self_profile(self, root);
+    }
     else {
         zsys_error ("tracks: - invalid command: %s", command);
         assert (false);
     }
-    zstr_free (&request);
-    // We use a REQ/REP socket pair, so a reply is mandatory
-    self->reply = zmsg_new();
-    zmsg_addstr(self->reply, json_dumps(self->root, 0));
-    zmsg_send(&(self->reply), self->responder);
+    self->lchunk = NULL;
+    self->ltrack = NULL;
+    //  Let DEALER clients match out of order replies
+    json_t *id = json_object_get(root, "RequestId");
+    if (id)
+        json_object_set(self->root, "RequestId", id);
+}
+
+//  Encode the reply as a MessagePack map. Results of a chunk are taken
+//  straight from the Lua table, numbers keep their type.
+
+static void
+s_self_encode_msgpack (self_t *self, mp_writer_t *writer)
+{
+    bool lua_results = self->results_ref != LUA_NOREF;
+    size_t count = json_object_size(self->root);
+    const char *key;
+    json_t *value;
+
+    if (lua_results && json_object_get(self->root, "results") == NULL)
+        count++;
+    mp_write_map (writer, (uint32_t) count);
+    if (lua_results) {
+        mp_write_str (writer, "results", strlen ("results"));
+        lua_rawgeti(self->L, LUA_REGISTRYINDEX, self->results_ref);
+        mp_encode_lua (writer, self->L, -1);
+        lua_pop(self->L, 1);
+    }
+    json_object_foreach (self->root, key, value) {
+        if (lua_results && streq (key, "results"))
+            continue;
+        mp_write_str (writer, key, strlen (key));
+        mp_encode_json (writer, value);
+    }
+}
+
+//  Encode the reply as JSON text into the reply buffer, streaming the
+//  results of a chunk straight from the Lua table
+
+static void
+s_self_encode_json (self_t *self)
+{
+    bool lua_results = self->results_ref != LUA_NOREF;
+    bool first = true;
+    const char *key;
+    json_t *value;
+
+    je_reset (&self->json);
+    je_write_raw (&self->json, "{", 1);
+    if (lua_results) {
+        je_write_raw (&self->json, "\"results\":", 10);
+        lua_rawgeti(self->L, LUA_REGISTRYINDEX, self->results_ref);
+        je_encode_lua (&self->json, self->L, -1);
+        lua_pop(self->L, 1);
+        first = false;
+    }
+    json_object_foreach (self->root, key, value) {
+        if (lua_results && streq (key, "results"))
+            continue;
+        if (!first)
+            je_write_raw (&self->json, ",", 1);
+        je_write_str (&self->json, key, strlen (key));
+        je_write_raw (&self->json, ":", 1);
+        je_encode_json (&self->json, value);
+        first = false;
+    }
+    je_write_raw (&self->json, "}", 1);
+}
+
+//  Send the reply in self->root behind the envelope, destroys the envelope
+
+static void
+s_self_send_reply (self_t *self, zsock_t *dest, zmsg_t **envelope_p)
+{
+    if (self->encoding == TRACKS_ENCODING_MSGPACK) {
+        //  Size the reply first, then encode it into the frame itself
+        mp_writer_t writer = { NULL, 0, 0 };
+        s_self_encode_msgpack (self, &writer);
+        zframe_t *frame = zframe_new (NULL, writer.pos);
+        writer.data = zframe_data (frame);
+        writer.size = zframe_size (frame);
+        writer.pos = 0;
+        s_self_encode_msgpack (self, &writer);
+        zmsg_append (*envelope_p, &frame);
+    }
+    else {
+        s_self_encode_json (self);
+        if (self->json.failed) {
+            zsys_error ("tracks: out of memory encoding reply");
+            zmsg_addstr (*envelope_p,
+                    "{\"status\":\"error\",\"errormsg\":\"reply too large\"}");
+        }
+        else {
+            zmsg_addmem (*envelope_p, self->json.data, self->json.len);
+            if (self->verbose)
+                zsys_info ("tracks: reply %.*s", (int) self->json.len, self->json.data);
+        }
+    }
+    if (self->results_ref != LUA_NOREF) {
+        luaL_unref(self->L, LUA_REGISTRYINDEX, self->results_ref);
+        self->results_ref = LUA_NOREF;
+    }
+    zmsg_send (envelope_p, dest);
+}
+
+//  --------------------------------------------------------------------------
+//  Handle a request from the ROUTER socket. The envelope is the client
+//  identity plus the empty delimiter REQ clients put in front of the body,
+//  DEALER clients may leave out the delimiter. Every request is tagged with
+//  a request id; requests without a "RequestId" get the server's id, which
+//  is echoed in the reply.
+
+static int
+s_self_handle_rep (self_t *self)
+{
+    zmsg_t *msg = zmsg_recv (self->responder);
+    if (!msg) {
+        return -1;                  //  Interrupted
+    }
+    zmsg_t *envelope = zmsg_new ();
+    zframe_t *identity = zmsg_pop (msg);
+    zmsg_append (envelope, &identity);
+    if (zmsg_size (msg) > 1 && zframe_size (zmsg_first (msg)) == 0) {
+        zframe_t *delimiter = zmsg_pop (msg);
+        zmsg_append (envelope, &delimiter);
+    }
+    zframe_t *request = zmsg_pop (msg);
+    zmsg_destroy (&msg);
+
+    //  Requests come as JSON text or as a MessagePack map, the reply uses
+    //  the same encoding unless the request asks otherwise
+    uint64_t id = ++self->request_seq;
+    json_t *root = NULL;
+    if (request && mp_is_map (zframe_data (request), zframe_size (request))) {
+        root = mp_decode_json (zframe_data (request), zframe_size (request));
+        if (json_is_object(root) && !json_object_get(root, "Encoding"))
+            json_object_set_new(root, "Encoding", json_string("msgpack"));
+    }
+    else
+    if (request)
+        root = json_loadb((const char *) zframe_data (request),
+                zframe_size (request), 0, NULL);
+    if (json_is_object(root) && !json_object_get(root, "RequestId"))
+        json_object_set_new(root, "RequestId", json_integer(id));
+
+    if (self->nworkers && json_is_object(root)) {
+        //  Hand the request to a worker, or queue it until one is idle, and
+        //  keep the envelope until the worker replies. The front socket is
+        //  read on meanwhile, replies may come back in any order
+        size_t index = s_self_select_worker (self, root);
+        char *key = zsys_sprintf ("%" PRIu64, id);
+        char *tagged = json_dumps(root, 0);
+        zmsg_t *forward = zmsg_new ();
+        zmsg_addstr (forward, "REQUEST");
+        zmsg_addstr (forward, key);
+        zmsg_addstr (forward, tagged);
+        zhashx_insert (self->pending, key, envelope);
+        if (index == TRACKS_NO_WORKER) {
+            if (self->verbose)
+                zsys_info ("tracks: queue request %s, all workers busy", key);
+            zlist_append (self->backlog, forward);
+        }
+        else
+            s_self_dispatch (self, index, &forward);
+        zstr_free (&key);
+        free (tagged);
+    }
+    else {
+        s_self_handle_request (self, root);
+        s_self_send_reply (self, self->responder, &envelope);
+    }
+    json_decref(root);
+    zframe_destroy (&request);
     return 0;
 }
 
+//  --------------------------------------------------------------------------
+//  Pass a worker's reply on to the client that sent the request, and the
+//  worker's published messages on to the subscribers
+
+static int
+s_self_handle_worker (self_t *self, zsock_t *reader)
+{
+    zmsg_t *msg = zmsg_recv (reader);
+    if (!msg)
+        return -1;                  //  Interrupted
+    char *command = zmsg_popstr (msg);
+    if (command && streq (command, "PUBLISH")) {
+        if (self->publisher)
+            zmsg_send (&msg, self->publisher);
+        zmsg_destroy (&msg);
+        zstr_free (&command);
+        return 0;
+    }
+    zstr_free (&command);
+    size_t index;
+    for (index = 0; index < self->nworkers; index++)
+        if (zactor_sock (self->workers [index]) == reader && self->inflight [index] > 0)
+            self->inflight [index]--;
+    char *key = zmsg_popstr (msg);
+    zmsg_t *envelope = key ? (zmsg_t *) zhashx_lookup (self->pending, key) : NULL;
+    if (envelope) {
+        zhashx_delete (self->pending, key);
+        zframe_t *reply = zmsg_pop (msg);
+        zmsg_append (envelope, &reply);
+        zmsg_send (&envelope, self->responder);
+    }
+    else
+        zsys_warning ("tracks: reply for unknown request %s", key ? key : "");
+    zstr_free (&key);
+    zmsg_destroy (&msg);
+    s_self_dispatch_backlog (self);
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Send the messages queued by publish(). A worker hands them to the front
+//  actor, which owns the PUB socket. When the pipe to the front is full
+//  the rest stays queued and is retried shortly.
+
+static int s_self_flush_ready (zloop_t *loop, int timer_id, void *arg);
+
+static void
+s_self_flush_outbox (self_t *self)
+{
+    zsock_t *dest = self->worker? self->pipe: self->publisher;
+
+    while (zlist_size (self->outbox) > 0) {
+        if (self->worker && !(zsock_events (dest) & ZMQ_POLLOUT)) {
+            self->publish_blocked++;
+            break;
+        }
+        zmsg_t *msg = (zmsg_t *) zlist_pop (self->outbox);
+        if (!dest) {
+            //  Not configured yet, nobody could subscribe
+            zmsg_destroy (&msg);
+            self->publish_dropped++;
+            continue;
+        }
+        if (self->worker)
+            zmsg_pushstr (msg, "PUBLISH");
+        zmsg_send (&msg, dest);
+        self->publish_sent++;
+    }
+    if (zlist_size (self->outbox) > 0 && !self->flushing) {
+        zloop_timer (self->loop, 1, 1, s_self_flush_ready, self);
+        self->flushing = true;
+    }
+}
+
+static int
+s_self_flush_ready (zloop_t *loop, int timer_id, void *arg)
+{
+    (void) loop;
+    (void) timer_id;
+    self_t *self = (self_t *) arg;
+    self->flushing = false;
+    s_self_flush_outbox(self);
+    return 0;
+}
+
+//  --------------------------------------------------------------------------
+//  Reactor handlers, every event may add or remove waiting tracks, so the
+//  timer is re-armed afterwards. Returning -1 ends the reactor.
+
+static int
+s_self_pipe_ready (zloop_t *loop, zsock_t *reader, void *arg)
+{
+    self_t *self = (self_t *) arg;
+    if (s_self_handle_pipe(self) == -1 || self->terminated)
+        return -1;
+    s_self_flush_outbox(self);
+    s_self_schedule(self);
+    return 0;
+}
+
+static int
+s_self_rep_ready (zloop_t *loop, zsock_t *reader, void *arg)
+{
+    self_t *self = (self_t *) arg;
+    s_self_handle_rep(self);
+    s_self_flush_outbox(self);
+    s_self_schedule(self);
+    return 0;
+}
+
+static int
+s_self_worker_ready (zloop_t *loop, zsock_t *reader, void *arg)
+{
+    self_t *self = (self_t *) arg;
+    return s_self_handle_worker(self, reader);
+}
+
+static int
+s_self_timer_ready (zloop_t *loop, zmq_pollitem_t *item, void *arg)
+{
+    self_t *self = (self_t *) arg;
+    uint64_t expirations;
+    if (read (self->timer_fd, &expirations, sizeof (expirations)) != sizeof (expirations))
+        return 0;                   //  Spurious wake-up, timer was re-armed
+    int64_t now = s_now_usecs ();
+    s_self_record_jitter(self, now);
+    if (self->scheduler == TRACKS_SCHEDULER_TICK)
+        self->deadline += self->interval * 1000 * expirations;
+    else
+        self->deadline = 0;
+    s_self_wake_waiting_threads(self);
+    s_self_flush_outbox(self);
+    s_self_schedule(self);
+    return 0;
+}
+
+//  A device driver thread posted, e.g. an alarm, let its handlers signal
+//  the waiting tracks
+
+static int
+s_self_events_ready (zloop_t *loop, zmq_pollitem_t *item, void *arg)
+{
+    self_t *self = (self_t *) arg;
+    if (self->L == NULL) {
+        //  Nobody to deliver to, drop them
+        uint64_t count;
+        if (read (device_events_fd (self->events), &count, sizeof (count)) < 0)
+            zsys_warning ("tracks: could not read device events: %s", strerror (errno));
+        return 0;
+    }
+    if (self->profiler)
+        profiler_enter (self->profiler);
+    int errors = device_events_dispatch (self->events, self->L);
+    if (self->profiler)
+        profiler_leave (self->profiler);
+    if (errors)
+        zsys_warning ("tracks: %d device event handlers failed", errors);
+    s_self_flush_outbox(self);
+    s_self_schedule(self);
+    return 0;
+}
+
+static void
+s_self_run (self_t *self)
+{
+    //  Sleep until a request arrives or the earliest waiting track is due,
+    //  the timerfd gives sub-millisecond wake-up accuracy
+    zmq_pollitem_t timer = { NULL, self->timer_fd, ZMQ_POLLIN, 0 };
+    zmq_pollitem_t events = { NULL, device_events_fd (self->events), ZMQ_POLLIN, 0 };
+    zloop_reader (self->loop, self->pipe, s_self_pipe_ready, self);
+    zloop_poller (self->loop, &timer, s_self_timer_ready, self);
+    zloop_poller (self->loop, &events, s_self_events_ready, self);
+    self->lasttime = s_now_usecs ();
+    s_self_schedule(self);
+    zloop_start (self->loop);
+}
+
 //  --------------------------------------------------------------------------
 //  Actor
 //  must call zsock_signal (pipe) when initialized
@@ -476,37 +1335,27 @@ tracks (zsock_t *pipe, void *args)
     assert (self);
     //  Signal successful initialization
     zsock_signal (pipe, 0);
+    s_self_run (self);
+    s_self_destroy(&self);
+}
 
-    //  Do a 'frame rate limited game loop' approach
-    //  Update time
-    self->nexttime = zclock_mono();
-    while (!self->terminated) {
-        self->currtime = zclock_mono();
-        if(self->currtime >= self->nexttime) {
-            // Assign the time for the next execution
-            self->nexttime += self->interval;
-            //  Poll on API pipe and on REQ-REP socket
-            long timeout = 1; // Allow a tiny timeout
-            zsock_t *which = (zsock_t *) zpoller_wait(self->poller, timeout);
-            if (zpoller_terminated(self->poller)) // Handle interrupts
-                break;
-            if (which == self->pipe)
-                s_self_handle_pipe(self);
-            if (which == self->responder)
-                s_self_handle_rep(self);
-            s_self_wake_waiting_threads(self);
-        }
-        else {
-            // calculate sleep time
-            int64_t sleeptime = self->nexttime - self->currtime;
-            // sanity check
-            if (sleeptime > 0) {
-                zclock_sleep(sleeptime);
-            }
-        }
-    }
+//  --------------------------------------------------------------------------
+//  Worker of the pool, gets requests from the front actor over its pipe
+
+static void
+s_worker (zsock_t *pipe, void *args)
+{
+    self_t *self = s_self_new (pipe);
+    assert (self);
+    self->worker = true;
+    s_self_spawn_lua(self);
+    assert(self->L);
+    //  Signal successful initialization
+    zsock_signal (pipe, 0);
+    s_self_run (self);
     s_self_destroy(&self);
 }
+
 //  --------------------------------------------------------------------------
 //  Selftest
 
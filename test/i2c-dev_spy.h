@@ -0,0 +1,20 @@
+#ifndef _I2C_DEV_SPY_H_
+#define _I2C_DEV_SPY_H_
+#include <stdint.h>
+
+/*
+ * Fake i2c device for the driver tests. It replaces open_i2c_dev and
+ * set_slave_addr of i2cbusses.c and serves the SMBus and combined transfer
+ * ioctls from a register file of 16 bit words.
+ */
+
+/* Clears the registers and counters, combined transfers work again */
+void spy_reset(void);
+void spy_set_reg(uint8_t reg, uint16_t val);
+uint16_t spy_get_reg(uint8_t reg);
+/* Lets combined transfers fail like on a SMBus only adapter */
+void spy_set_no_rdwr(int no_rdwr);
+/* Number of combined transfers and SMBus word reads done */
+int spy_rdwr_count(void);
+int spy_word_read_count(void);
+#endif
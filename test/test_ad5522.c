@@ -0,0 +1,87 @@
+#include <stdint.h>
+#include "unity.h"
+#include "ad5522.h"
+
+#define UNITY_GAIN 65536
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/* FIN DAC output for X1 with M and C, data sheet transfer function */
+static int64_t dac_output(unsigned int x1, unsigned int m, unsigned int c)
+{
+    return ((int64_t)x1 * (m + 1) >> 16) + c - 0x8000;
+}
+
+void test_ad5522_cal_code_identity(void)
+{
+    TEST_ASSERT_EQUAL_INT64(12345, ad5522_cal_code(UNITY_GAIN, 0, 12345));
+}
+
+void test_ad5522_cal_code_gain_and_offset(void)
+{
+    /* 0.5 rounds to the nearest code */
+    TEST_ASSERT_EQUAL_INT64(5000 - 7, ad5522_cal_code(UNITY_GAIN / 2, -7, 10000));
+    TEST_ASSERT_EQUAL_INT64(2, ad5522_cal_code(UNITY_GAIN / 2, 0, 3));
+}
+
+void test_ad5522_cal_dac_codes_identity(void)
+{
+    unsigned int m, c;
+
+    TEST_ASSERT_EQUAL_INT(0, ad5522_cal_dac_codes(UNITY_GAIN, 0, &m, &c));
+    TEST_ASSERT_EQUAL_HEX16(0xffff, m);
+    TEST_ASSERT_EQUAL_HEX16(0x8000, c);
+}
+
+void test_ad5522_cal_dac_codes_m_is_gain_less_one(void)
+{
+    unsigned int m, c;
+
+    TEST_ASSERT_EQUAL_INT(0, ad5522_cal_dac_codes(UNITY_GAIN / 2, 100, &m, &c));
+    TEST_ASSERT_EQUAL_HEX16(0x7fff, m);
+    TEST_ASSERT_EQUAL_HEX16(0x8000 + 100, c);
+}
+
+void test_ad5522_cal_dac_codes_reject_what_does_not_fit(void)
+{
+    unsigned int m, c;
+
+    TEST_ASSERT_EQUAL_INT(-1, ad5522_cal_dac_codes(UNITY_GAIN + 1, 0, &m, &c));
+    TEST_ASSERT_EQUAL_INT(-1, ad5522_cal_dac_codes(0, 0, &m, &c));
+    TEST_ASSERT_EQUAL_INT(-1, ad5522_cal_dac_codes(UNITY_GAIN, 0x8000, &m, &c));
+    TEST_ASSERT_EQUAL_INT(-1, ad5522_cal_dac_codes(UNITY_GAIN, -0x8001, &m, &c));
+}
+
+void test_ad5522_hardware_and_software_calibration_agree(void)
+{
+    static const int32_t gains[] = {UNITY_GAIN, 65000, 64000, UNITY_GAIN / 2};
+    static const int32_t offsets[] = {0, -50, 37};
+    unsigned int i, j, m, c, x1;
+
+    for (i = 0; i < sizeof(gains) / sizeof(gains[0]); i++)
+        for (j = 0; j < sizeof(offsets) / sizeof(offsets[0]); j++) {
+            TEST_ASSERT_EQUAL_INT(0, ad5522_cal_dac_codes(gains[i], offsets[j], &m, &c));
+            for (x1 = 1000; x1 < 65536; x1 += 4096)
+                /* the DAC truncates, software rounds */
+                TEST_ASSERT_INT64_WITHIN(1, ad5522_cal_code(gains[i], offsets[j], x1),
+                        dac_output(x1, m, c));
+        }
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_ad5522_cal_code_identity);
+    RUN_TEST(test_ad5522_cal_code_gain_and_offset);
+    RUN_TEST(test_ad5522_cal_dac_codes_identity);
+    RUN_TEST(test_ad5522_cal_dac_codes_m_is_gain_less_one);
+    RUN_TEST(test_ad5522_cal_dac_codes_reject_what_does_not_fit);
+    RUN_TEST(test_ad5522_hardware_and_software_calibration_agree);
+    return UNITY_END();
+}
@@ -0,0 +1,84 @@
+#include "unity.h"
+#include "colour.h"
+
+#define N 2
+
+static const double unit[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+
+static double raw_buf[3][N], out_buf[COLOUR_NUM][N];
+static double *raw[3], *out[COLOUR_NUM];
+
+void setUp(void)
+{
+    int c;
+
+    for (c = 0; c < 3; c++)
+        raw[c] = raw_buf[c];
+    for (c = 0; c < COLOUR_NUM; c++)
+        out[c] = out_buf[c];
+}
+
+void tearDown(void)
+{
+}
+
+static void set_raw(int i, double x, double y, double z)
+{
+    raw[0][i] = x;
+    raw[1][i] = y;
+    raw[2][i] = z;
+}
+
+void test_colour_d65_white_point(void)
+{
+    set_raw(0, 95.047, 100.0, 108.883);
+    colour_kernel(unit, raw, out, 1);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-5, 0.312727, out[COLOUR_XC][0]);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-5, 0.329023, out[COLOUR_YC][0]);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-5, 0.197840, out[COLOUR_U][0]);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-5, 0.468336, out[COLOUR_V][0]);
+    /* McCamy is within a few K of the 6504 K of D65 */
+    TEST_ASSERT_DOUBLE_WITHIN(0.5, 6503.46, out[COLOUR_CCT][0]);
+}
+
+void test_colour_illuminant_a_cct(void)
+{
+    /* CIE illuminant A, 2856 K */
+    set_raw(0, 109.85, 100.0, 35.585);
+    colour_kernel(unit, raw, out, 1);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-4, 0.44757, out[COLOUR_XC][0]);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-4, 0.40745, out[COLOUR_YC][0]);
+    TEST_ASSERT_DOUBLE_WITHIN(5.0, 2856.0, out[COLOUR_CCT][0]);
+}
+
+void test_colour_matrix_is_row_major(void)
+{
+    const double m[9] = {0, 0, 1, 1, 0, 0, 0, 2, 0};
+
+    set_raw(0, 1.0, 2.0, 3.0);
+    colour_kernel(m, raw, out, 1);
+    TEST_ASSERT_EQUAL_DOUBLE(3.0, out[COLOUR_X][0]);
+    TEST_ASSERT_EQUAL_DOUBLE(1.0, out[COLOUR_Y][0]);
+    TEST_ASSERT_EQUAL_DOUBLE(4.0, out[COLOUR_Z][0]);
+}
+
+void test_colour_samples_are_independent(void)
+{
+    set_raw(0, 95.047, 100.0, 108.883);
+    set_raw(1, 1.0, 1.0, 1.0);
+    colour_kernel(unit, raw, out, N);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-5, 0.312727, out[COLOUR_XC][0]);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-12, 1.0 / 3.0, out[COLOUR_XC][1]);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-12, 4.0 / 19.0, out[COLOUR_U][1]);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-12, 9.0 / 19.0, out[COLOUR_V][1]);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_colour_d65_white_point);
+    RUN_TEST(test_colour_illuminant_a_cct);
+    RUN_TEST(test_colour_matrix_is_row_major);
+    RUN_TEST(test_colour_samples_are_independent);
+    return UNITY_END();
+}
@@ -0,0 +1,168 @@
+#include "unity.h"
+#include "mcdc04.h"
+#include "i2c-dev_spy.h"
+
+/* measurement state output registers */
+#define OUT1 0x1
+#define OUT2 0x2
+#define OUT3 0x3
+/* config state */
+#define CREGL 0x6
+
+static mcdc04_t *sensor;
+
+void setUp(void)
+{
+    spy_reset();
+    sensor = mcdc04_create(1, 0x74);
+}
+
+void tearDown(void)
+{
+    mcdc04_destroy(&sensor);
+}
+
+static void set_outputs(void)
+{
+    spy_set_reg(OUT1, 1111);
+    spy_set_reg(OUT2, 2222);
+    spy_set_reg(OUT3, 3333);
+}
+
+void test_mcdc04_create_opens_device(void)
+{
+    TEST_ASSERT_NOT_NULL(sensor);
+}
+
+void test_mcdc04_one_shot_maps_xyz_to_out3_out1_out2(void)
+{
+    unsigned int x, y, z;
+
+    mcdc04_trigger_start(sensor);
+    set_outputs();
+    TEST_ASSERT_EQUAL_INT(0, mcdc04_trigger_finish(sensor));
+    mcdc04_get_xyz(sensor, &x, &y, &z);
+    TEST_ASSERT_EQUAL_UINT(3333, x);
+    TEST_ASSERT_EQUAL_UINT(1111, y);
+    TEST_ASSERT_EQUAL_UINT(2222, z);
+}
+
+void test_mcdc04_continuous_read_agrees_with_one_shot(void)
+{
+    unsigned int x, y, z, cx, cy, cz;
+
+    mcdc04_trigger_start(sensor);
+    set_outputs();
+    mcdc04_trigger_finish(sensor);
+    mcdc04_get_xyz(sensor, &x, &y, &z);
+
+    TEST_ASSERT_EQUAL_INT(0, mcdc04_start_continuous(sensor));
+    set_outputs();
+    TEST_ASSERT_EQUAL_INT(0, mcdc04_read_xyz(sensor, &cx, &cy, &cz));
+    mcdc04_stop_continuous(sensor);
+    TEST_ASSERT_EQUAL_UINT(x, cx);
+    TEST_ASSERT_EQUAL_UINT(y, cy);
+    TEST_ASSERT_EQUAL_UINT(z, cz);
+}
+
+void test_mcdc04_raw_channels_are_output_registers(void)
+{
+    unsigned int val;
+
+    mcdc04_trigger_start(sensor);
+    set_outputs();
+    mcdc04_trigger_finish(sensor);
+    mcdc04_read_raw(sensor, 1, &val);
+    TEST_ASSERT_EQUAL_UINT(1111, val);
+    mcdc04_read_raw(sensor, 3, &val);
+    TEST_ASSERT_EQUAL_UINT(3333, val);
+}
+
+void test_mcdc04_reads_outputs_in_one_transfer(void)
+{
+    unsigned int out[MCDC04_OUTPUTS];
+
+    set_outputs();
+    TEST_ASSERT_EQUAL_INT(0, mcdc04_read_all(sensor, out));
+    TEST_ASSERT_EQUAL_INT(1, spy_rdwr_count());
+    TEST_ASSERT_EQUAL_INT(0, spy_word_read_count());
+    TEST_ASSERT_EQUAL_UINT(3333, out[MCDC04_OUT_X]);
+}
+
+void test_mcdc04_falls_back_to_word_reads(void)
+{
+    unsigned int x, y, z;
+
+    spy_set_no_rdwr(1);
+    set_outputs();
+    TEST_ASSERT_EQUAL_INT(0, mcdc04_read_xyz(sensor, &x, &y, &z));
+    TEST_ASSERT_EQUAL_INT(MCDC04_OUTPUTS, spy_word_read_count());
+    TEST_ASSERT_EQUAL_UINT(3333, x);
+    TEST_ASSERT_EQUAL_UINT(1111, y);
+    TEST_ASSERT_EQUAL_UINT(2222, z);
+}
+
+void test_mcdc04_gain_factor_doubles_per_step(void)
+{
+    int i;
+
+    TEST_ASSERT_DOUBLE_WITHIN(1e-12, 64.0 / 320.0, mcdc04_gain_factor(0));
+    for (i = 1; i < MCDC04_GAIN_STEPS; i++)
+        TEST_ASSERT_DOUBLE_WITHIN(1e-12, 2.0 * mcdc04_gain_factor(i - 1), mcdc04_gain_factor(i));
+}
+
+void test_mcdc04_gain_predict_hits_middle_of_band(void)
+{
+    int i;
+
+    for (i = 0; i < MCDC04_GAIN_STEPS; i++)
+        TEST_ASSERT_EQUAL_INT(i, mcdc04_gain_predict(32767.0 / mcdc04_gain_factor(i)));
+}
+
+void test_mcdc04_gain_predict_keeps_reading_in_band(void)
+{
+    double level;
+    int gain;
+
+    for (level = 500.0; level < 200000.0; level *= 1.1) {
+        gain = mcdc04_gain_predict(level);
+        TEST_ASSERT_TRUE((gain >= 0) && (gain < MCDC04_GAIN_STEPS));
+        TEST_ASSERT_TRUE(level * mcdc04_gain_factor(gain) >= MCDC04_GAIN_LOW);
+        TEST_ASSERT_TRUE(level * mcdc04_gain_factor(gain) < MCDC04_GAIN_HIGH);
+    }
+}
+
+void test_mcdc04_gain_predict_out_of_range(void)
+{
+    TEST_ASSERT_EQUAL_INT(-1, mcdc04_gain_predict(MCDC04_GAIN_HIGH / mcdc04_gain_factor(0)));
+    TEST_ASSERT_EQUAL_INT(MCDC04_GAIN_STEPS, mcdc04_gain_predict(1.0));
+}
+
+void test_mcdc04_set_gain_writes_iref_and_tint(void)
+{
+    mcdc04_set_gain(sensor, 4);
+    mcdc04_trigger_start(sensor);
+    /* input direction, 20 nA, 64 ms */
+    TEST_ASSERT_EQUAL_HEX16(0x86, spy_get_reg(CREGL));
+    mcdc04_set_gain(sensor, 0);
+    mcdc04_trigger_start(sensor);
+    /* 320 nA */
+    TEST_ASSERT_EQUAL_HEX16(0xa6, spy_get_reg(CREGL));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_mcdc04_create_opens_device);
+    RUN_TEST(test_mcdc04_one_shot_maps_xyz_to_out3_out1_out2);
+    RUN_TEST(test_mcdc04_continuous_read_agrees_with_one_shot);
+    RUN_TEST(test_mcdc04_raw_channels_are_output_registers);
+    RUN_TEST(test_mcdc04_reads_outputs_in_one_transfer);
+    RUN_TEST(test_mcdc04_falls_back_to_word_reads);
+    RUN_TEST(test_mcdc04_gain_factor_doubles_per_step);
+    RUN_TEST(test_mcdc04_gain_predict_hits_middle_of_band);
+    RUN_TEST(test_mcdc04_gain_predict_keeps_reading_in_band);
+    RUN_TEST(test_mcdc04_gain_predict_out_of_range);
+    RUN_TEST(test_mcdc04_set_gain_writes_iref_and_tint);
+    return UNITY_END();
+}
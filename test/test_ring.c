@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include "unity.h"
+#include "ring.h"
+
+#define SIZE 8
+
+static ring_t *ring;
+
+void setUp(void)
+{
+    ring = ring_create(SIZE, sizeof(uint64_t));
+}
+
+void tearDown(void)
+{
+    ring_destroy(&ring);
+}
+
+static void push_n(uint64_t n)
+{
+    uint64_t i, val;
+
+    for (i = 0; i < n; i++) {
+        val = ring_head(ring) + 1;
+        ring_push(ring, &val);
+    }
+}
+
+void test_ring_create_needs_power_of_two(void)
+{
+    ring_t *bad = ring_create(6, sizeof(uint64_t));
+
+    TEST_ASSERT_NULL(bad);
+    bad = ring_create(1, sizeof(uint64_t));
+    TEST_ASSERT_NULL(bad);
+    TEST_ASSERT_NOT_NULL(ring);
+}
+
+void test_ring_empty_has_nothing_to_read(void)
+{
+    uint64_t val, first;
+
+    TEST_ASSERT_EQUAL_UINT64(0, ring_head(ring));
+    TEST_ASSERT_EQUAL_INT(-1, ring_get(ring, 0, &val));
+    TEST_ASSERT_EQUAL_INT(-1, ring_get(ring, 1, &val));
+    TEST_ASSERT_EQUAL_UINT64(0, ring_next(ring, 0));
+    TEST_ASSERT_EQUAL_UINT(0, ring_window(ring, 4, 0, &val, &first));
+}
+
+void test_ring_get_returns_entry_by_number(void)
+{
+    uint64_t val;
+
+    push_n(3);
+    TEST_ASSERT_EQUAL_UINT64(3, ring_head(ring));
+    TEST_ASSERT_EQUAL_INT(0, ring_get(ring, 2, &val));
+    TEST_ASSERT_EQUAL_UINT64(2, val);
+    TEST_ASSERT_EQUAL_INT(-1, ring_get(ring, 4, &val));
+}
+
+void test_ring_keeps_size_minus_one_entries(void)
+{
+    uint64_t val;
+
+    push_n(20);
+    /* 20 - SIZE + 1 shares its slot with 21, the next one written */
+    TEST_ASSERT_EQUAL_INT(-1, ring_get(ring, 20 - SIZE + 1, &val));
+    TEST_ASSERT_EQUAL_INT(0, ring_get(ring, 20 - SIZE + 2, &val));
+    TEST_ASSERT_EQUAL_UINT64(20 - SIZE + 2, val);
+    TEST_ASSERT_EQUAL_INT(0, ring_get(ring, 20, &val));
+    TEST_ASSERT_EQUAL_UINT64(20, val);
+}
+
+void test_ring_next_skips_overwritten_entries(void)
+{
+    push_n(20);
+    TEST_ASSERT_EQUAL_UINT64(20 - SIZE + 2, ring_next(ring, 0));
+    TEST_ASSERT_EQUAL_UINT64(18, ring_next(ring, 17));
+    TEST_ASSERT_EQUAL_UINT64(0, ring_next(ring, 20));
+}
+
+void test_ring_window_returns_latest_oldest_first(void)
+{
+    uint64_t vals[SIZE], first;
+    size_t n;
+
+    push_n(5);
+    n = ring_window(ring, 3, 0, vals, &first);
+    TEST_ASSERT_EQUAL_UINT(3, n);
+    TEST_ASSERT_EQUAL_UINT64(3, first);
+    TEST_ASSERT_EQUAL_UINT64(3, vals[0]);
+    TEST_ASSERT_EQUAL_UINT64(5, vals[2]);
+}
+
+void test_ring_window_honours_since(void)
+{
+    uint64_t vals[SIZE], first;
+    size_t n;
+
+    push_n(5);
+    n = ring_window(ring, 4, 4, vals, &first);
+    TEST_ASSERT_EQUAL_UINT(1, n);
+    TEST_ASSERT_EQUAL_UINT64(5, first);
+    TEST_ASSERT_EQUAL_UINT64(5, vals[0]);
+    TEST_ASSERT_EQUAL_UINT(0, ring_window(ring, 4, 5, vals, &first));
+}
+
+void test_ring_window_is_limited_to_kept_entries(void)
+{
+    uint64_t vals[SIZE], first;
+    size_t n;
+
+    push_n(20);
+    n = ring_window(ring, SIZE, 0, vals, &first);
+    TEST_ASSERT_EQUAL_UINT(SIZE - 1, n);
+    TEST_ASSERT_EQUAL_UINT64(20 - SIZE + 2, first);
+    TEST_ASSERT_EQUAL_UINT64(first, vals[0]);
+    TEST_ASSERT_EQUAL_UINT64(20, vals[n - 1]);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_ring_create_needs_power_of_two);
+    RUN_TEST(test_ring_empty_has_nothing_to_read);
+    RUN_TEST(test_ring_get_returns_entry_by_number);
+    RUN_TEST(test_ring_keeps_size_minus_one_entries);
+    RUN_TEST(test_ring_next_skips_overwritten_entries);
+    RUN_TEST(test_ring_window_returns_latest_oldest_first);
+    RUN_TEST(test_ring_window_honours_since);
+    RUN_TEST(test_ring_window_is_limited_to_kept_entries);
+    return UNITY_END();
+}
@@ -0,0 +1,81 @@
+#include "unity.h"
+#include "stats.h"
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_stats_mean_std(void)
+{
+    int raw[] = {2, 4, 4, 4, 5, 5, 7, 9};
+    double mean, std;
+
+    stats_mean_std(raw, 8, &mean, &std);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-12, 5.0, mean);
+    TEST_ASSERT_DOUBLE_WITHIN(1e-12, 2.138089935299395, std);
+}
+
+void test_stats_mean_std_of_one_sample(void)
+{
+    int raw[] = {32768};
+    double mean, std;
+
+    stats_mean_std(raw, 1, &mean, &std);
+    TEST_ASSERT_EQUAL_DOUBLE(32768.0, mean);
+    TEST_ASSERT_EQUAL_DOUBLE(0.0, std);
+}
+
+void test_stats_reject_none_keeps_order(void)
+{
+    int raw[] = {5, 1, 3}, *kept;
+
+    TEST_ASSERT_EQUAL_INT(3, stats_reject(raw, 3, "none", 0.1, &kept));
+    TEST_ASSERT_EQUAL_PTR(raw, kept);
+    TEST_ASSERT_EQUAL_INT(5, kept[0]);
+}
+
+void test_stats_reject_median_drops_outliers(void)
+{
+    int raw[] = {100, 102, 98, 101, 99, 100, 500, 100, 101, 99}, *kept;
+    int n, i;
+
+    n = stats_reject(raw, 10, "median", 0.1, &kept);
+    TEST_ASSERT_EQUAL_INT(9, n);
+    for (i = 0; i < n; i++)
+        TEST_ASSERT_INT_WITHIN(2, 100, kept[i]);
+}
+
+void test_stats_reject_median_keeps_lsb_noise_when_mad_is_zero(void)
+{
+    int raw[] = {1000, 1000, 1000, 1000, 1000, 1001, 999, 1000, 1000, 2000}, *kept;
+
+    /* more than half on the median, MAD is 0 */
+    TEST_ASSERT_EQUAL_INT(9, stats_reject(raw, 10, "median", 0.1, &kept));
+    TEST_ASSERT_EQUAL_INT(999, kept[0]);
+    TEST_ASSERT_EQUAL_INT(1001, kept[8]);
+}
+
+void test_stats_reject_trim_drops_both_ends(void)
+{
+    int raw[] = {9, 0, 5, 1, 8, 2, 7, 3, 6, 4}, *kept;
+
+    TEST_ASSERT_EQUAL_INT(6, stats_reject(raw, 10, "trim", 0.2, &kept));
+    TEST_ASSERT_EQUAL_INT(2, kept[0]);
+    TEST_ASSERT_EQUAL_INT(7, kept[5]);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_stats_mean_std);
+    RUN_TEST(test_stats_mean_std_of_one_sample);
+    RUN_TEST(test_stats_reject_none_keeps_order);
+    RUN_TEST(test_stats_reject_median_drops_outliers);
+    RUN_TEST(test_stats_reject_median_keeps_lsb_noise_when_mad_is_zero);
+    RUN_TEST(test_stats_reject_trim_drops_both_ends);
+    return UNITY_END();
+}